@@ -18,27 +18,121 @@
 
 #include "avatar.h"
 
+#include "backgroundtask.h"
 #include "connection.h"
 
 #include "events/eventcontent.h"
 #include "jobs/mediathumbnailjob.h"
+#include "mediacache.h"
 
 #include <QtCore/QDir>
+#include <QtCore/QHash>
 #include <QtCore/QPointer>
 #include <QtCore/QStandardPaths>
 #include <QtCore/QStringBuilder>
 #include <QtGui/QPainter>
 
+#include <algorithm>
+#include <list>
+
 using namespace Quotient;
 using std::move;
 
+namespace {
+/// An LRU cache of avatar images with a limit on their total size
+class ImageCache {
+public:
+    QImage find(const QString& mediaId, QSize size, bool countHit = true)
+    {
+        const auto it = index.constFind(makeKey(mediaId, size));
+        if (it == index.cend()) {
+            if (countHit)
+                ++misses;
+            return {};
+        }
+        if (countHit)
+            ++hits;
+        entries.splice(entries.begin(), entries, *it);
+        return (*it)->image;
+    }
+
+    void insert(const QString& mediaId, QSize size, QImage image)
+    {
+        const auto key = makeKey(mediaId, size);
+        if (const auto it = index.find(key); it != index.end()) {
+            used -= (*it)->cost;
+            entries.erase(*it);
+            index.erase(it);
+        }
+        const auto cost = qint64(image.bytesPerLine()) * image.height();
+        entries.push_front({ key, mediaId, move(image), cost });
+        index.insert(key, entries.begin());
+        used += cost;
+        shrink();
+    }
+
+    /// Drop all images made from the media
+    void remove(const QString& mediaId)
+    {
+        for (auto it = entries.begin(); it != entries.end();)
+            if (it->mediaId == mediaId) {
+                used -= it->cost;
+                index.remove(it->key);
+                it = entries.erase(it);
+            } else
+                ++it;
+    }
+
+    void setLimit(qint64 newLimit)
+    {
+        limit = std::max(newLimit, qint64(0));
+        shrink();
+    }
+
+    qint64 limit = 32 * 1024 * 1024;
+    qint64 used = 0;
+    quint64 hits = 0;
+    quint64 misses = 0;
+
+private:
+    struct Entry {
+        QString key;
+        QString mediaId;
+        QImage image;
+        qint64 cost;
+    };
+    std::list<Entry> entries; // Most recently used first
+    QHash<QString, std::list<Entry>::iterator> index;
+
+    static QString makeKey(const QString& mediaId, QSize size)
+    {
+        return mediaId % '@' % QString::number(size.width()) % 'x'
+               % QString::number(size.height());
+    }
+
+    void shrink()
+    {
+        while (used > limit && !entries.empty()) {
+            used -= entries.back().cost;
+            index.remove(entries.back().key);
+            entries.pop_back();
+        }
+    }
+};
+
+ImageCache& imageCache()
+{
+    static ImageCache cache;
+    return cache;
+}
+} // namespace
+
 class Avatar::Private {
 public:
     explicit Private(QUrl url = {}) : _url(move(url)) {}
     ~Private()
     {
-        if (isJobRunning(_thumbnailRequest))
-            _thumbnailRequest->abandon();
+        dropThumbnailRequest();
         if (isJobRunning(_uploadRequest))
             _uploadRequest->abandon();
     }
@@ -49,17 +143,48 @@ public:
 
     bool checkUrl(const QUrl& url) const;
     QString localFile() const;
+    QString mediaId() const { return _url.authority() + _url.path(); }
+
+    // The below do the heavy lifting on worker threads and call
+    // the callbacks once done
+    void loadFromDisk() const;
+    /// Request a thumbnail from the server; the callbacks are called once
+    /// it's processed
+    void fetchThumbnail(Connection* connection, QSize size) const;
+    void processThumbnail(QImage thumbnail) const;
+    void scale(QImage original, QSize size) const;
+    void notifyCallbacks() const;
+    /// Stop waiting for the current thumbnail request, if any
+    void dropThumbnailRequest() const;
 
     QUrl _url;
 
-    // The below are related to image caching, hence mutable
-    mutable QImage _originalImage;
-    mutable std::vector<QPair<QSize, QImage>> _scaledImages;
+    // The below are related to image caching, hence mutable; the images
+    // themselves are in imageCache()
     mutable QSize _requestedSize;
-    mutable enum { Unknown, Cache, Network, Banned } _imageSource = Unknown;
+    mutable enum {
+        Unknown,
+        Loading, //< Being looked up in the disk cache
+        NotCached, //< Not found in the disk cache
+        Cache,
+        Network,
+        Banned
+    } _imageSource = Unknown;
     mutable QPointer<MediaThumbnailJob> _thumbnailRequest = nullptr;
+    /// The connection the last get() came through, to refetch the image
+    /// if it is gone from the disk cache
+    mutable QPointer<Connection> _connection;
     mutable QPointer<BaseJob> _uploadRequest = nullptr;
     mutable std::vector<get_callback_t> callbacks;
+    /// The media id being loaded from the disk cache, if any
+    mutable QString _loadingMediaId;
+    /// Sizes of images being scaled on worker threads
+    mutable std::vector<QSize> _scalingSizes;
+    /// Bumped with each new original image, to drop stale scaled images
+    mutable int _generation = 0;
+    /// The context for the continuations of background work: when it's
+    /// destroyed (first of all data members), they are not called
+    QObject _context;
 };
 
 Avatar::Avatar() : d(std::make_unique<Private>()) {}
@@ -100,7 +225,20 @@ bool Avatar::upload(Connection* connection, QIODevice* source,
     return d->upload(connection->uploadContent(source), move(callback));
 }
 
-QString Avatar::mediaId() const { return d->_url.authority() + d->_url.path(); }
+QString Avatar::mediaId() const { return d->mediaId(); }
+
+void Avatar::setImageCacheLimit(qint64 bytes)
+{
+    imageCache().setLimit(bytes);
+}
+
+qint64 Avatar::imageCacheLimit() { return imageCache().limit; }
+
+qint64 Avatar::imageCacheSize() { return imageCache().used; }
+
+quint64 Avatar::imageCacheHits() { return imageCache().hits; }
+
+quint64 Avatar::imageCacheMisses() { return imageCache().misses; }
 
 QImage Avatar::Private::get(Connection* connection, QSize size,
                             get_callback_t callback) const
@@ -109,49 +247,167 @@ QImage Avatar::Private::get(Connection* connection, QSize size,
         qCCritical(MAIN) << "Null callbacks are not allowed in Avatar::get";
         Q_ASSERT(false);
     }
+    // Each waiting branch below should only store the callback once
+    const auto waitForImage = [this, &callback] {
+        if (callback)
+            callbacks.emplace_back(std::exchange(callback, nullptr));
+    };
+    _connection = connection;
 
-    if (_imageSource == Unknown && _originalImage.load(localFile())) {
-        _imageSource = Cache;
-        _requestedSize = _originalImage.size();
+    if (_imageSource == Unknown) {
+        _imageSource = Loading;
+        loadFromDisk();
+    }
+    if (_imageSource == Loading) {
+        waitForImage();
+        return {};
     }
 
     // Alternating between longer-width and longer-height requests is a sure way
     // to trick the below code into constantly getting another image from
     // the server because the existing one is alleged unsatisfactory.
     // Client authors can only blame themselves if they do so.
-    if (((_imageSource == Unknown && !_thumbnailRequest)
+    if (((_imageSource == NotCached && !_thumbnailRequest)
          || size.width() > _requestedSize.width()
          || size.height() > _requestedSize.height())
         && checkUrl(_url)) {
-        qCDebug(MAIN) << "Getting avatar from" << _url.toString();
-        _requestedSize = size;
-        if (isJobRunning(_thumbnailRequest))
-            _thumbnailRequest->abandon();
-        if (callback)
-            callbacks.emplace_back(move(callback));
-        _thumbnailRequest = connection->getThumbnail(_url, size);
-        QObject::connect(_thumbnailRequest, &MediaThumbnailJob::success,
-                         _thumbnailRequest, [this] {
-                             _imageSource = Network;
-                             _originalImage = _thumbnailRequest->scaledThumbnail(
-                                 _requestedSize);
-                             _originalImage.save(localFile());
-                             _scaledImages.clear();
-                             for (const auto& n : callbacks)
-                                 n();
-                             callbacks.clear();
-                         });
+        waitForImage();
+        fetchThumbnail(connection, size);
     }
 
-    for (const auto& p : _scaledImages)
-        if (p.first == size)
-            return p.second;
-    auto result = _originalImage.isNull()
-                      ? QImage()
-                      : _originalImage.scaled(size, Qt::KeepAspectRatio,
-                                              Qt::SmoothTransformation);
-    _scaledImages.emplace_back(size, result);
-    return result;
+    if (auto result = imageCache().find(mediaId(), size); !result.isNull())
+        return result;
+    const auto original = imageCache().find(mediaId(), {}, false);
+    if (original.isNull()) {
+        // The image may have been evicted from memory but not from the disk
+        if (_imageSource == Cache || _imageSource == Network) {
+            waitForImage();
+            loadFromDisk();
+        } else if (isJobRunning(_thumbnailRequest))
+            waitForImage();
+        return {};
+    }
+    waitForImage();
+    scale(original, size);
+    // Return a rough placeholder until the properly scaled image is ready
+    return original.scaled(size, Qt::KeepAspectRatio, Qt::FastTransformation);
+}
+
+void Avatar::Private::loadFromDisk() const
+{
+    if (_loadingMediaId == mediaId())
+        return; // Already loading
+
+    _loadingMediaId = mediaId();
+    runInBackground(
+        &_context,
+        [fileName = localFile()] {
+            QImage image;
+            image.load(fileName);
+            return image;
+        },
+        [this, id = mediaId()](QImage image) {
+            if (_loadingMediaId == id)
+                _loadingMediaId.clear();
+            if (id != mediaId())
+                return; // The URL has changed in the meantime
+
+            if (_imageSource == Loading) {
+                _imageSource = image.isNull() ? NotCached : Cache;
+                _requestedSize = image.size();
+            } else if (image.isNull()) {
+                // The file has been evicted from the disk cache or deleted;
+                // notifying the callbacks would only make them call get()
+                // and get here again, so get the image from the server
+                qCDebug(MAIN) << "Avatar" << id
+                              << "is gone from the disk cache, refetching";
+                const auto size = std::exchange(_requestedSize, {});
+                _imageSource = NotCached;
+                if (_connection && size.isValid() && checkUrl(_url)) {
+                    fetchThumbnail(_connection, size);
+                    return;
+                }
+            }
+            if (!image.isNull())
+                imageCache().insert(id, {}, move(image));
+            notifyCallbacks();
+        });
+}
+
+void Avatar::Private::fetchThumbnail(Connection* connection, QSize size) const
+{
+    qCDebug(MAIN) << "Getting avatar from" << _url.toString();
+    _requestedSize = size;
+    dropThumbnailRequest();
+    auto* job = connection->getThumbnail(_url, size);
+    _thumbnailRequest = job;
+    QObject::connect(job, &MediaThumbnailJob::success, &_context, [this, job] {
+        _imageSource = Network;
+        processThumbnail(job->thumbnail());
+    });
+}
+
+void Avatar::Private::processThumbnail(QImage thumbnail) const
+{
+    // Until the thumbnail is scaled, use it as it came
+    ++_generation;
+    imageCache().remove(mediaId()); // Scaled images of the old one are stale
+    imageCache().insert(mediaId(), {}, thumbnail);
+    runInBackground(
+        &_context,
+        [thumbnail, size = _requestedSize] {
+            return thumbnail.scaled(size, Qt::KeepAspectRatio,
+                                    Qt::SmoothTransformation);
+        },
+        [this, id = mediaId(), generation = _generation](QImage image) {
+            if (generation != _generation)
+                return; // Another thumbnail has arrived meanwhile
+            imageCache().remove(id);
+            imageCache().insert(id, {}, move(image));
+            notifyCallbacks();
+        });
+}
+
+void Avatar::Private::scale(QImage original, QSize size) const
+{
+    if (std::find(_scalingSizes.cbegin(), _scalingSizes.cend(), size)
+        != _scalingSizes.cend())
+        return; // Already scaling
+
+    _scalingSizes.push_back(size);
+    runInBackground(
+        &_context,
+        [original, size] {
+            return original.scaled(size, Qt::KeepAspectRatio,
+                                   Qt::SmoothTransformation);
+        },
+        [this, size, id = mediaId(), generation = _generation](QImage image) {
+            _scalingSizes.erase(std::remove(_scalingSizes.begin(),
+                                            _scalingSizes.end(), size),
+                                _scalingSizes.end());
+            if (generation == _generation)
+                imageCache().insert(id, size, move(image));
+            notifyCallbacks();
+        });
+}
+
+void Avatar::Private::notifyCallbacks() const
+{
+    // Callbacks usually call get() again, which may add more callbacks
+    const auto currentCallbacks = std::exchange(callbacks, {});
+    for (const auto& n : currentCallbacks)
+        n();
+}
+
+void Avatar::Private::dropThumbnailRequest() const
+{
+    // Thumbnail requests may be shared with other avatars of the same media
+    // (see Connection::getThumbnail()), so they are released, not abandoned
+    if (isJobRunning(_thumbnailRequest))
+        _thumbnailRequest->release(&_context);
+    else if (_thumbnailRequest)
+        QObject::disconnect(_thumbnailRequest, nullptr, &_context, nullptr);
+    _thumbnailRequest = nullptr;
 }
 
 bool Avatar::Private::upload(UploadContentJob* job, upload_callback_t &&callback)
@@ -181,8 +437,18 @@ bool Avatar::Private::checkUrl(const QUrl& url) const
 
 QString Avatar::Private::localFile() const
 {
-    static const auto cachePath = cacheLocation(QStringLiteral("avatars"));
-    return cachePath % _url.authority() % '_' % _url.fileName() % ".png";
+    // Thumbnails are stored in the media cache by MediaThumbnailJob; take
+    // the biggest one and scale it as needed
+    auto fileName = MediaCache::instance().findThumbnail(mediaId());
+    if (fileName.isEmpty()) {
+        // Fall back to the cache of older versions that stored avatars
+        // by themselves
+        static const auto legacyCachePath =
+            cacheLocation(QStringLiteral("avatars"));
+        fileName = legacyCachePath % _url.authority() % '_' % _url.fileName()
+                   % ".png";
+    }
+    return fileName;
 }
 
 QUrl Avatar::url() const { return d->_url; }
@@ -194,7 +460,6 @@ bool Avatar::updateUrl(const QUrl& newUrl)
 
     d->_url = newUrl;
     d->_imageSource = Private::Unknown;
-    if (isJobRunning(d->_thumbnailRequest))
-        d->_thumbnailRequest->abandon();
+    d->dropThumbnailRequest();
     return true;
 }
@@ -52,6 +52,23 @@ public:
     QUrl url() const;
     bool updateUrl(const QUrl& newUrl);
 
+    /// Set the memory budget for avatar images, in bytes
+    /*! Images of all avatars, original and scaled, are kept in a single
+     * cache keyed by the media id and the image size, so that avatars with
+     * the same media id (e.g. the same user in several rooms) share images.
+     * When the images take more memory than the budget, the least recently
+     * used ones are dropped; the originals are reloaded from the disk cache
+     * when needed again.
+     */
+    static void setImageCacheLimit(qint64 bytes);
+    static qint64 imageCacheLimit();
+    /// The memory currently taken by cached avatar images, in bytes
+    static qint64 imageCacheSize();
+    /// The number of requests for avatar images served from the cache
+    static quint64 imageCacheHits();
+    /// The number of requests for avatar images that had to make an image
+    static quint64 imageCacheMisses();
+
 private:
     class Private;
     std::unique_ptr<Private> d;
@@ -0,0 +1,15 @@
+#include "backgroundtask.h"
+
+using namespace Quotient;
+
+_impl::BackgroundTask::BackgroundTask(std::function<void()> work)
+    : work(std::move(work))
+{
+    setAutoDelete(false); // Deleted on the thread it was created in
+}
+
+void _impl::BackgroundTask::run()
+{
+    work();
+    emit finished();
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <QtCore/QObject>
+#include <QtCore/QRunnable>
+#include <QtCore/QThreadPool>
+
+#include <functional>
+#include <memory>
+#include <optional>
+#include <type_traits>
+
+namespace Quotient {
+namespace _impl {
+    /// A runnable that emits finished() from its thread once it's done
+    /** \sa runInBackground */
+    class BackgroundTask : public QObject, public QRunnable {
+        Q_OBJECT
+    public:
+        explicit BackgroundTask(std::function<void()> work);
+
+        void run() override;
+
+    signals:
+        void finished();
+
+    private:
+        std::function<void()> work;
+    };
+} // namespace _impl
+
+/*! \brief Run a function on a thread from the given pool
+ *
+ * \p work is called on a worker thread and should not touch anything that
+ * the calling thread may use meanwhile. Once it returns, \p then is called
+ * with its result on the thread \p context lives in - unless \p context has
+ * been destroyed by then, in which case the result is just dropped.
+ */
+template <typename WorkT, typename ThenT>
+inline void runInBackground(QThreadPool* pool, const QObject* context,
+                            WorkT work, ThenT then)
+{
+    using result_type = std::invoke_result_t<WorkT&>;
+    auto result = std::make_shared<std::optional<result_type>>();
+    auto* task = new _impl::BackgroundTask(
+        [work = std::move(work), result]() mutable { result->emplace(work()); });
+    // finished() is emitted on the worker thread, so both connections are
+    // queued, and the task is still there when the continuation runs
+    QObject::connect(task, &_impl::BackgroundTask::finished, context,
+                     [then = std::move(then), result]() mutable {
+                         then(std::move(**result));
+                     });
+    QObject::connect(task, &_impl::BackgroundTask::finished, task,
+                     &QObject::deleteLater);
+    pool->start(task);
+}
+
+/// Run a function on a thread from QThreadPool::globalInstance()
+/** \sa runInBackground(QThreadPool*, const QObject*, WorkT, ThenT) */
+template <typename WorkT, typename ThenT>
+inline void runInBackground(const QObject* context, WorkT work, ThenT then)
+{
+    runInBackground(QThreadPool::globalInstance(), context, std::move(work),
+                    std::move(then));
+}
+} // namespace Quotient
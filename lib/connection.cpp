@@ -22,6 +22,8 @@
 #ifdef Quotient_E2EE_ENABLED
 #    include "encryptionmanager.h"
 #endif // Quotient_E2EE_ENABLED
+#include "mediaprefetcher.h"
+#include "paginationscheduler.h"
 #include "room.h"
 #include "settings.h"
 #include "user.h"
@@ -57,11 +59,14 @@
 #include <QtCore/QElapsedTimer>
 #include <QtCore/QFile>
 #include <QtCore/QMimeDatabase>
+#include <QtCore/QtMath>
 #include <QtCore/QRegularExpression>
 #include <QtCore/QStandardPaths>
 #include <QtCore/QStringBuilder>
 #include <QtNetwork/QDnsLookup>
 
+#include <typeinfo>
+
 using namespace Quotient;
 
 // This is very much Qt-specific; STL iterators don't have key() and value()
@@ -111,7 +116,7 @@ public:
     QMetaObject::Connection syncLoopConnection {};
     int syncTimeout = -1;
 
-    GetCapabilitiesJob* capabilitiesJob = nullptr;
+    QPointer<GetCapabilitiesJob> capabilitiesJob = nullptr;
     GetCapabilitiesJob::Capabilities capabilities;
 
     QVector<GetLoginFlowsJob::LoginFlow> loginFlows;
@@ -124,6 +129,18 @@ public:
     QPointer<GetLoginFlowsJob> loginFlowsJob = nullptr;
 
     SyncJob* syncJob = nullptr;
+    PaginationScheduler* paginationScheduler = nullptr;
+    MediaPrefetcher* mediaPrefetcher = nullptr;
+    struct ThumbnailRequest {
+        QPointer<MediaThumbnailJob> job;
+        QSize size; //< The size requested from the server
+    };
+    /// Running thumbnail requests by media ids, shared among requesters
+    QMultiHash<QString, ThumbnailRequest> thumbnailRequests;
+    /// Running downloads by media ids and target file names
+    QHash<QPair<QString, QString>, QPointer<DownloadFileJob>> fileDownloads;
+    /// Running jobs started with a shared policy, by BaseJob::sharingKey()
+    QHash<QString, QPointer<BaseJob>> sharedJobs;
     QPointer<LogoutJob> logoutJob = nullptr;
 
     bool cacheState = true;
@@ -262,6 +279,8 @@ public:
 Connection::Connection(const QUrl& server, QObject* parent)
     : QObject(parent), d(new Private(std::make_unique<ConnectionData>(server)))
 {
+    d->paginationScheduler = new PaginationScheduler(this);
+    d->mediaPrefetcher = new MediaPrefetcher(this);
     d->q = this; // All d initialization should occur before this line
 }
 
@@ -289,7 +308,9 @@ void Connection::resolveServer(const QString& mxid)
 
     const auto& oldBaseUrl = d->data->baseUrl();
     d->data->setBaseUrl(maybeBaseUrl); // Temporarily set it for this one call
-    d->resolverJob = callApi<GetWellknownJob>();
+    d->resolverJob = new GetWellknownJob();
+    d->resolverJob->setCacheable(true);
+    run(d->resolverJob);
     // Connect to finished() to make sure baseUrl is restored in any case
     connect(d->resolverJob, &BaseJob::finished, this, [this, maybeBaseUrl, oldBaseUrl] {
         // Revert baseUrl so that setHomeserver() below triggers signals
@@ -387,7 +408,10 @@ void Connection::assumeIdentity(const QString& mxId, const QString& accessToken,
 
 void Connection::reloadCapabilities()
 {
-    d->capabilitiesJob = callApi<GetCapabilitiesJob>(BackgroundRequest);
+    auto* job = callApi<GetCapabilitiesJob>(SharedBackgroundRequest);
+    if (job == d->capabilitiesJob)
+        return; // Already being reloaded
+    d->capabilitiesJob = job;
     connect(d->capabilitiesJob, &BaseJob::success, this, [this] {
         d->capabilities = d->capabilitiesJob->capabilities();
 
@@ -844,13 +868,59 @@ inline auto splitMediaId(const QString& mediaId)
     return idParts;
 }
 
+/// Round each dimension of the size up to a power of two
+/** Thumbnails of the same media requested with slightly different sizes
+ *  end up in the same bucket and can be served by a single request. */
+inline QSize thumbnailSizeBucket(QSize size)
+{
+    const auto roundUp = [](int dim) {
+        return dim > 0 ? int(qNextPowerOfTwo(quint32(dim - 1))) : dim;
+    };
+    return { roundUp(size.width()), roundUp(size.height()) };
+}
+
 MediaThumbnailJob* Connection::getThumbnail(const QString& mediaId,
                                             QSize requestedSize,
                                             RunningPolicy policy)
 {
+    const auto bucketSize = thumbnailSizeBucket(requestedSize);
+    // Share a running request for a thumbnail at least as big as needed
+    for (auto it = d->thumbnailRequests.constFind(mediaId);
+         it != d->thumbnailRequests.cend() && it.key() == mediaId; ++it)
+        if (isJobRunning(it->job) && it->size.width() >= bucketSize.width()
+            && it->size.height() >= bucketSize.height()) {
+            it->job->addRequester();
+            if (!(policy & BackgroundRequest))
+                it->job->bringToForeground();
+            if (!d->mediaPrefetcher->isPrefetching()) {
+                // Not a mere prefetch anymore
+                using RequestClass = BaseJob::RequestClass;
+                if (it->job->requestClass() == RequestClass::Background)
+                    it->job->setRequestClass(RequestClass::Media);
+                d->mediaPrefetcher->addForegroundRequest(mediaId, it->job);
+            }
+            return it->job;
+        }
+
     auto idParts = splitMediaId(mediaId);
-    return callApi<MediaThumbnailJob>(policy, idParts.front(), idParts.back(),
-                                      requestedSize);
+    auto* job =
+        new MediaThumbnailJob(idParts.front(), idParts.back(), bucketSize);
+    // Prefetches don't take the slots of media requests the user waits for
+    if (d->mediaPrefetcher->isPrefetching())
+        job->setRequestClass(BaseJob::RequestClass::Background);
+    run(job, policy);
+    d->thumbnailRequests.insert(mediaId, { job, bucketSize });
+    connect(job, &BaseJob::finished, this, [this, mediaId, job] {
+        for (auto it = d->thumbnailRequests.find(mediaId);
+             it != d->thumbnailRequests.end() && it.key() == mediaId;)
+            if (it->job == job || !it->job)
+                it = d->thumbnailRequests.erase(it);
+            else
+                ++it;
+    });
+    if (!d->mediaPrefetcher->isPrefetching())
+        d->mediaPrefetcher->addForegroundRequest(mediaId, job);
+    return job;
 }
 
 MediaThumbnailJob* Connection::getThumbnail(const QUrl& url, QSize requestedSize,
@@ -872,15 +942,15 @@ Connection::uploadContent(QIODevice* contentSource, const QString& filename,
 {
     Q_ASSERT(contentSource != nullptr);
     auto contentType = overrideContentType;
-    if (contentType.isEmpty()) {
+    if (contentType.isEmpty())
         contentType = QMimeDatabase()
                           .mimeTypeForFileNameAndData(filename, contentSource)
                           .name();
-        if (!contentSource->open(QIODevice::ReadOnly)) {
-            qCWarning(MAIN) << "Couldn't open content source" << filename
-                            << "for reading:" << contentSource->errorString();
-            return nullptr;
-        }
+    if (!contentSource->isOpen()
+        && !contentSource->open(QIODevice::ReadOnly | QIODevice::Unbuffered)) {
+        qCWarning(MAIN) << "Couldn't open content source" << filename
+                        << "for reading:" << contentSource->errorString();
+        return nullptr;
     }
     return callApi<UploadContentJob>(contentSource, filename, contentType);
 }
@@ -889,8 +959,11 @@ UploadContentJob* Connection::uploadFile(const QString& fileName,
                                          const QString& overrideContentType)
 {
     auto sourceFile = new QFile(fileName);
-    return uploadContent(sourceFile, QFileInfo(*sourceFile).fileName(),
-                         overrideContentType);
+    auto* job = uploadContent(sourceFile, QFileInfo(*sourceFile).fileName(),
+                              overrideContentType);
+    if (!job)
+        delete sourceFile;
+    return job;
 }
 
 GetContentJob* Connection::getContent(const QString& mediaId)
@@ -908,9 +981,24 @@ DownloadFileJob* Connection::downloadFile(const QUrl& url,
                                           const QString& localFilename)
 {
     auto mediaId = url.authority() + url.path();
+    const auto key = qMakePair(mediaId, localFilename);
+    // Share a running download of the same media to the same file
+    if (const auto runningJob = d->fileDownloads.value(key);
+        isJobRunning(runningJob)) {
+        runningJob->addRequester();
+        d->mediaPrefetcher->addForegroundRequest(mediaId, runningJob);
+        return runningJob;
+    }
+
     auto idParts = splitMediaId(mediaId);
     auto* job =
         callApi<DownloadFileJob>(idParts.front(), idParts.back(), localFilename);
+    d->fileDownloads.insert(key, job);
+    connect(job, &BaseJob::finished, this, [this, key, job] {
+        if (d->fileDownloads.value(key) == job)
+            d->fileDownloads.remove(key);
+    });
+    d->mediaPrefetcher->addForegroundRequest(mediaId, job);
     return job;
 }
 
@@ -1079,9 +1167,11 @@ ForgetRoomJob* Connection::forgetRoom(const QString& id)
     connect(forgetJob, &BaseJob::result, this, [this, id, forgetJob] {
         // Leave room in case of success, or room not known by server
         if (forgetJob->error() == BaseJob::Success
-            || forgetJob->error() == BaseJob::NotFoundError)
+            || forgetJob->error() == BaseJob::NotFoundError) {
             d->removeRoom(id); // Delete the room from roomMap
-        else
+            QFile::remove(
+                stateCacheDir().filePath(SearchIndex::fileNameForRoom(id)));
+        } else
             qCWarning(MAIN).nospace() << "Error forgetting room " << id << ": "
                                       << forgetJob->errorString();
     });
@@ -1232,6 +1322,16 @@ QByteArray Connection::accessToken() const
 
 bool Connection::isLoggedIn() const { return !accessToken().isEmpty(); }
 
+PaginationScheduler* Connection::paginationScheduler() const
+{
+    return d->paginationScheduler;
+}
+
+MediaPrefetcher* Connection::mediaPrefetcher() const
+{
+    return d->mediaPrefetcher;
+}
+
 #ifdef Quotient_E2EE_ENABLED
 QtOlm::Account* Connection::olmAccount() const
 {
@@ -1268,6 +1368,24 @@ QVector<Room*> Connection::allRooms() const
     return result;
 }
 
+SearchHits Connection::searchMessages(const QString& query, int limit) const
+{
+    SearchHits result;
+    for (auto* r : rooms(JoinState::Join))
+        result += r->searchMessages(query, limit);
+
+    const auto newerFirst = [](const SearchHit& lhs, const SearchHit& rhs) {
+        return lhs.timestamp > rhs.timestamp;
+    };
+    if (limit >= 0 && limit < result.size()) {
+        std::partial_sort(result.begin(), result.begin() + limit, result.end(),
+                          newerFirst);
+        result.resize(limit);
+    } else
+        std::sort(result.begin(), result.end(), newerFirst);
+    return result;
+}
+
 QVector<Room*> Connection::rooms(JoinStates joinStates) const
 {
     QVector<Room*> result;
@@ -1560,7 +1678,9 @@ void Connection::setHomeserver(const QUrl& url)
     }
 
     // Whenever a homeserver is updated, retrieve available login flows from it
-    d->loginFlowsJob = callApi<GetLoginFlowsJob>(BackgroundRequest);
+    d->loginFlowsJob = new GetLoginFlowsJob();
+    d->loginFlowsJob->setCacheable(true);
+    run(d->loginFlowsJob, BackgroundRequest);
     connect(d->loginFlowsJob, &BaseJob::result, this, [this] {
         if (d->loginFlowsJob->status().good())
             d->loginFlows = d->loginFlowsJob->flows();
@@ -1724,11 +1844,33 @@ void Connection::setLazyLoading(bool newValue)
 
 BaseJob* Connection::run(BaseJob* job, RunningPolicy runningPolicy)
 {
+    const auto shared = (runningPolicy & SharedForegroundRequest) != 0;
+    const auto key = shared ? job->sharingKey() : QString();
+    if (!key.isEmpty()) {
+        const auto runningJob = d->sharedJobs.value(key);
+        if (isJobRunning(runningJob) && typeid(*runningJob) == typeid(*job)) {
+            qCDebug(MAIN) << job << "shares the running request of"
+                          << runningJob.data();
+            job->deleteLater();
+            runningJob->addRequester();
+            if (!(runningPolicy & BackgroundRequest))
+                runningJob->bringToForeground();
+            return runningJob;
+        }
+    }
+
     // Reparent to protect from #397, #398 and to prevent BaseJob* from being
     // garbage-collected if made by or returned to QML/JavaScript.
     job->setParent(this);
     connect(job, &BaseJob::failure, this, &Connection::requestFailed);
     job->initiate(d->data.get(), runningPolicy & BackgroundRequest);
+    if (!key.isEmpty() && isJobRunning(job)) {
+        d->sharedJobs.insert(key, job);
+        connect(job, &BaseJob::finished, this, [this, key, job] {
+            if (d->sharedJobs.value(key) == job)
+                d->sharedJobs.remove(key);
+        });
+    }
     return job;
 }
 
@@ -22,6 +22,7 @@
 #include "joinstate.h"
 #include "qt_connection_util.h"
 #include "quotient_common.h"
+#include "searchindex.h"
 
 #include "csapi/login.h"
 #include "csapi/create_room.h"
@@ -46,6 +47,8 @@ namespace Quotient {
 class Room;
 class User;
 class ConnectionData;
+class PaginationScheduler;
+class MediaPrefetcher;
 class RoomEvent;
 
 class SyncJob;
@@ -187,6 +190,16 @@ public:
     /// Get the total number of rooms in the given join state(s)
     Q_INVOKABLE int roomsCount(Quotient::JoinStates joinStates) const;
 
+    /// Search messages in the timelines of all joined rooms
+    /*!
+     * Looks up the words of \p query in the local search indices of rooms
+     * (see Room::searchMessages); hits from all rooms are merged and ranked
+     * by recency, the newest first. Works offline, as long as the indices
+     * have been built from the loaded timelines or the state cache.
+     * \param limit the maximum number of hits; -1 means no limit
+     */
+    SearchHits searchMessages(const QString& query, int limit = 50) const;
+
     /** Check whether the account has data of the given type
      * Direct chats map is not supported by this method _yet_.
      */
@@ -337,6 +350,10 @@ public:
     QtOlm::Account* olmAccount() const;
 #endif // Quotient_E2EE_ENABLED
     Q_INVOKABLE Quotient::SyncJob* syncJob() const;
+    /// Get the scheduler of history requests of all rooms on this connection
+    PaginationScheduler* paginationScheduler() const;
+    /// Get the prefetcher of thumbnails for rooms on this connection
+    MediaPrefetcher* mediaPrefetcher() const;
     Q_INVOKABLE int millisToReconnect() const;
 
     Q_INVOKABLE void getTurnServers();
@@ -416,7 +433,14 @@ public:
     bool lazyLoading() const;
     void setLazyLoading(bool newValue);
 
-    /*! Start a pre-created job object on this connection */
+    /*! Start a pre-created job object on this connection
+     *
+     * If \p runningPolicy tells to share the job and an identical job is
+     * already running, \p job is deleted and the running job is returned;
+     * as it may have other requesters, use BaseJob::release() rather than
+     * BaseJob::abandon() to give up on it.
+     * \return the job that is running the request
+     */
     Q_INVOKABLE BaseJob* run(BaseJob* job,
                              RunningPolicy runningPolicy = ForegroundRequest);
 
@@ -429,6 +453,8 @@ public:
      *
      * \param runningPolicy controls how the job is executed
      * \param jobArgs arguments to the job constructor
+     * \return the new job; or, if the policy tells to share the job,
+     *         an identical job already running, if there's one
      *
      * \sa BaseJob::isBackground. QNetworkRequest::BackgroundRequestAttribute
      */
@@ -436,8 +462,8 @@ public:
     JobT* callApi(RunningPolicy runningPolicy, JobArgTs&&... jobArgs)
     {
         auto job = new JobT(std::forward<JobArgTs>(jobArgs)...);
-        run(job, runningPolicy);
-        return job;
+        // run() only returns another job if it's of exactly the same type
+        return static_cast<JobT*>(run(job, runningPolicy));
     }
 
     /*! Start a job of a specified type with specified arguments
@@ -566,6 +592,16 @@ public slots:
     void stopSync();
     QString nextBatchToken() const;
 
+    /*! \brief Get a thumbnail of the media
+     *
+     * Requests for the same media are coalesced: while a request for
+     * a thumbnail at least as big as \p requestedSize (rounded up to a power
+     * of two in each dimension) is running, the same job is returned to all
+     * callers; if any of them asks for it in the foreground, so is
+     * the request made, unless it has already been sent. Since the job may be
+     * shared, callers should release() rather than abandon() it when they
+     * no more need the thumbnail.
+     */
     virtual MediaThumbnailJob*
     getThumbnail(const QString& mediaId, QSize requestedSize,
                  RunningPolicy policy = BackgroundRequest);
@@ -575,7 +611,15 @@ public slots:
                                     int requestedHeight,
                                     RunningPolicy policy = BackgroundRequest);
 
-    // QIODevice* should already be open
+    /*! \brief Upload the contents of the device to the media repository
+     *
+     * The device is opened for reading if it's not open yet; the returned
+     * job takes ownership of it. Contents of random-access devices (such as
+     * files) are streamed without loading them in memory as a whole;
+     * sequential devices are buffered before sending.
+     * \return the upload job; nullptr if the device couldn't be opened,
+     *         in which case the device remains owned by the caller
+     */
     UploadContentJob* uploadContent(QIODevice* contentSource,
                                     const QString& filename = {},
                                     const QString& overrideContentType = {});
@@ -583,7 +627,10 @@ public slots:
                                  const QString& overrideContentType = {});
     GetContentJob* getContent(const QString& mediaId);
     GetContentJob* getContent(const QUrl& url);
-    // If localFilename is empty, a temporary file will be created
+    // If localFilename is empty, a temporary file will be created.
+    // While the same media is being downloaded to the same file, the running
+    // job is returned instead of starting another one; release() it rather
+    // than abandon() it to cancel the download.
     DownloadFileJob* downloadFile(const QUrl& url,
                                   const QString& localFilename = {});
 
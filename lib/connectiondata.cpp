@@ -20,13 +20,16 @@
 
 #include "logging.h"
 #include "networkaccessmanager.h"
+#include "retryscheduler.h"
 #include "jobs/basejob.h"
 
+#include <QtCore/QHash>
 #include <QtCore/QTimer>
 #include <QtCore/QPointer>
 
+#include <algorithm>
 #include <array>
-#include <queue>
+#include <deque>
 
 using namespace Quotient;
 
@@ -49,60 +52,197 @@ public:
 
     QString id() const { return userId + '/' + deviceId; }
 
-    using job_queue_t = std::queue<QPointer<BaseJob>>;
-    std::array<job_queue_t, 2> jobs; // 0 - foreground, 1 - background
+    static constexpr size_t ClassCount = size_t(RequestClass::Background) + 1;
+    /// A lower class passed over this many times goes before higher ones
+    static constexpr int MaxPassovers = 8;
+    struct ClassQueue {
+        std::deque<QPointer<BaseJob>> queued;
+        std::vector<QPointer<BaseJob>> running;
+        int maxRunning;
+        int passovers = 0;
+        /// A job for each additional request of the running jobs
+        std::vector<QPointer<BaseJob>> extra = {};
+
+        int load() const { return int(running.size() + extra.size()); }
+    };
+    // Sync holds a long-polling request; send and interactive classes
+    // together can take all the slots, media and background can't, so that
+    // a burst of thumbnails never delays sending messages
+    std::array<ClassQueue, ClassCount> queues { { { {}, {}, 1 },
+                                                  { {}, {}, 4 },
+                                                  { {}, {}, 4 },
+                                                  { {}, {}, 2 },
+                                                  { {}, {}, 1 } } };
+    /// QNAM opens at most 6 connections per host; keeping the number of
+    /// running requests within that leaves the order to the dispatcher
+    int maxRunningTotal = 6;
+    /// Queue indices of the sent requests, as their classes may change
+    QHash<const BaseJob*, size_t> dispatchedClasses;
+    QTimer dispatchTimer;
+    bool dispatching = false;
     QTimer rateLimiter;
+    std::unique_ptr<RetryScheduler> retryScheduler;
+
+    int runningTotal();
+    ClassQueue* nextQueue();
+    void dispatch();
 };
 
+int ConnectionData::Private::runningTotal()
+{
+    const auto isGone = [](const QPointer<BaseJob>& j) { return !j; };
+    int total = 0;
+    for (auto& q : queues) {
+        q.running.erase(std::remove_if(q.running.begin(), q.running.end(),
+                                       isGone),
+                        q.running.end());
+        q.extra.erase(std::remove_if(q.extra.begin(), q.extra.end(), isGone),
+                      q.extra.end());
+        total += q.load();
+    }
+    // Forget the jobs deleted while running
+    for (auto it = dispatchedClasses.begin(); it != dispatchedClasses.end();) {
+        const auto& running = queues[*it].running;
+        if (std::find(running.cbegin(), running.cend(), it.key())
+            == running.cend())
+            it = dispatchedClasses.erase(it);
+        else
+            ++it;
+    }
+    return total;
+}
+
+ConnectionData::Private::ClassQueue* ConnectionData::Private::nextQueue()
+{
+    ClassQueue* next = nullptr;
+    for (auto& q : queues) {
+        if (q.queued.empty() || q.load() >= q.maxRunning)
+            continue;
+        if (!next || q.passovers >= MaxPassovers) {
+            if (next)
+                ++next->passovers;
+            next = &q;
+        } else
+            ++q.passovers;
+    }
+    if (next)
+        next->passovers = 0;
+    return next;
+}
+
+void ConnectionData::Private::dispatch()
+{
+    if (rateLimiter.isActive() || dispatching)
+        return;
+    dispatching = true;
+    while (runningTotal() < maxRunningTotal) {
+        auto* q = nextQueue();
+        if (!q)
+            break;
+        const auto job = q->queued.front();
+        q->queued.pop_front();
+        if (!job || job->error() == BaseJob::Abandoned)
+            continue;
+        if (job->error() != BaseJob::Pending) {
+            qCCritical(MAIN) << "Job" << job << "is in the wrong status:"
+                             << job->status();
+            Q_ASSERT(false);
+            job->setStatus(BaseJob::Pending);
+        }
+        q->running.push_back(job);
+        dispatchedClasses.insert(job, size_t(q - queues.data()));
+        job->sendRequest();
+    }
+    dispatching = false;
+}
+
 ConnectionData::ConnectionData(QUrl baseUrl)
     : d(std::make_unique<Private>(std::move(baseUrl)))
 {
-    // Each lambda invocation below takes no more than one job from the
-    // queues (first foreground, then background) and resumes it; then
-    // restarts the rate limiter timer with duration 0, effectively yielding
-    // to the event loop and then resuming until both queues are empty.
-    QObject::connect(&d->rateLimiter, &QTimer::timeout, [this] {
-        // TODO: Consider moving out all job->sendRequest() invocations to
-        // a dedicated thread
-        d->rateLimiter.setInterval(0);
-        for (auto& q : d->jobs)
-            while (!q.empty()) {
-                const auto job = q.front();
-                q.pop();
-                if (!job || job->error() == BaseJob::Abandoned)
-                    continue;
-                if (job->error() != BaseJob::Pending) {
-                    qCCritical(MAIN)
-                        << "Job" << job
-                        << "is in the wrong status:" << job->status();
-                    Q_ASSERT(false);
-                    job->setStatus(BaseJob::Pending);
-                }
-                job->sendRequest();
-                d->rateLimiter.start();
-                return;
-            }
-        qCDebug(MAIN) << d->id() << "job queues are empty";
-    });
+    d->retryScheduler = std::make_unique<RetryScheduler>(this);
+    // Jobs are sent from the event loop, never from within submit(); the
+    // dispatch timer coalesces submissions made in one event loop turn
+    // TODO: Consider moving out all job->sendRequest() invocations to
+    // a dedicated thread
+    d->dispatchTimer.setSingleShot(true);
+    d->dispatchTimer.setInterval(0);
+    QObject::connect(&d->dispatchTimer, &QTimer::timeout,
+                     [this] { d->dispatch(); });
+    QObject::connect(&d->rateLimiter, &QTimer::timeout,
+                     [this] { d->dispatch(); });
 }
 
 ConnectionData::~ConnectionData()
 {
     d->rateLimiter.disconnect();
     d->rateLimiter.stop();
+    d->dispatchTimer.disconnect();
+    d->dispatchTimer.stop();
 }
 
 void ConnectionData::submit(BaseJob* job)
 {
     job->setStatus(BaseJob::Pending);
-    if (!d->rateLimiter.isActive()) {
-        QTimer::singleShot(0, job, &BaseJob::sendRequest);
+    auto& q = d->queues[size_t(job->requestClass())];
+    q.queued.emplace_back(job);
+    if (d->rateLimiter.isActive() || q.load() >= q.maxRunning)
+        qCDebug(MAIN) << job << "queued," << q.queued.size() << "job(s) of"
+                      << job->requestClass() << "class waiting in" << d->id()
+                      << "queues";
+    if (!d->dispatchTimer.isActive())
+        d->dispatchTimer.start();
+}
+
+void ConnectionData::requestDone(BaseJob* job)
+{
+    const auto classIt = d->dispatchedClasses.find(job);
+    if (classIt == d->dispatchedClasses.end())
         return;
+    auto& running = d->queues[*classIt].running;
+    d->dispatchedClasses.erase(classIt);
+    running.erase(std::remove(running.begin(), running.end(), job),
+                  running.end());
+    if (!d->dispatchTimer.isActive())
+        d->dispatchTimer.start();
+}
+
+bool ConnectionData::reclassify(BaseJob* job, RequestClass oldClass)
+{
+    if (d->dispatchedClasses.contains(job))
+        return false;
+    auto& oldQueue = d->queues[size_t(oldClass)];
+    const auto it =
+        std::find(oldQueue.queued.begin(), oldQueue.queued.end(), job);
+    if (it != oldQueue.queued.end()) {
+        oldQueue.queued.erase(it);
+        d->queues[size_t(job->requestClass())].queued.emplace_back(job);
+        if (!d->dispatchTimer.isActive())
+            d->dispatchTimer.start();
     }
-    d->jobs[size_t(job->isBackground())].emplace(job);
-    qCDebug(MAIN) << job << "queued," << d->jobs.front().size() << "+"
-                  << d->jobs.back().size() << "total jobs in" << d->id()
-                  << "queues";
+    return true;
+}
+
+bool ConnectionData::takeExtraSlot(BaseJob* job)
+{
+    auto& q = d->queues[d->dispatchedClasses.value(
+        job, size_t(job->requestClass()))];
+    if (d->rateLimiter.isActive() || d->runningTotal() >= d->maxRunningTotal
+        || q.load() >= q.maxRunning)
+        return false;
+    q.extra.emplace_back(job);
+    return true;
+}
+
+void ConnectionData::releaseExtraSlot(BaseJob* job)
+{
+    for (auto& q : d->queues)
+        if (const auto it = std::find(q.extra.begin(), q.extra.end(), job);
+            it != q.extra.end()) {
+            q.extra.erase(it);
+            if (!d->dispatchTimer.isActive())
+                d->dispatchTimer.start();
+            return;
+        }
 }
 
 void ConnectionData::limitRate(std::chrono::milliseconds nextCallAfter)
@@ -112,6 +252,41 @@ void ConnectionData::limitRate(std::chrono::milliseconds nextCallAfter)
     d->rateLimiter.start(nextCallAfter);
 }
 
+int ConnectionData::maxRunningRequests(RequestClass requestClass) const
+{
+    return d->queues[size_t(requestClass)].maxRunning;
+}
+
+void ConnectionData::setMaxRunningRequests(RequestClass requestClass,
+                                           int newMax)
+{
+    d->queues[size_t(requestClass)].maxRunning = std::max(newMax, 1);
+    d->dispatchTimer.start();
+}
+
+int ConnectionData::maxRunningRequests() const { return d->maxRunningTotal; }
+
+void ConnectionData::setMaxRunningRequests(int newMax)
+{
+    d->maxRunningTotal = std::max(newMax, 1);
+    d->dispatchTimer.start();
+}
+
+int ConnectionData::runningRequests(RequestClass requestClass) const
+{
+    return d->queues[size_t(requestClass)].load();
+}
+
+int ConnectionData::queuedRequests(RequestClass requestClass) const
+{
+    return int(d->queues[size_t(requestClass)].queued.size());
+}
+
+RetryScheduler* ConnectionData::retryScheduler() const
+{
+    return d->retryScheduler.get();
+}
+
 QByteArray ConnectionData::accessToken() const { return d->accessToken; }
 
 QUrl ConnectionData::baseUrl() const { return d->baseUrl; }
@@ -18,6 +18,8 @@
 
 #pragma once
 
+#include "jobs/basejob.h"
+
 #include <QtCore/QUrl>
 
 #include <memory>
@@ -26,16 +28,54 @@
 class QNetworkAccessManager;
 
 namespace Quotient {
-class BaseJob;
+class RetryScheduler;
 
 class ConnectionData {
 public:
     explicit ConnectionData(QUrl baseUrl);
     virtual ~ConnectionData();
 
+    /// Queue the job's request for sending
+    /**
+     * Requests are sent in the order of their classes' priority, within
+     * the limits on running requests per class and in total; a request of
+     * a lower class that has been passed over several times goes next, so
+     * that no class starves.
+     * \sa BaseJob::requestClass
+     */
     void submit(BaseJob* job);
+    /// Free the slot taken by the job's request once it is done
+    /** BaseJob calls this when it gets a reply or is abandoned */
+    void requestDone(BaseJob* job);
+    /// Move the queued request of the job to the queue of its current class
+    /**
+     * \return false if the request has already been sent, in which case
+     *         it stays in \p oldClass until done
+     */
+    bool reclassify(BaseJob* job, RequestClass oldClass);
+    /// Take a slot for an additional request of a running job
+    /**
+     * Jobs making more than one request at a time (e.g., DownloadFileJob
+     * fetching ranges in parallel) call this for each additional request,
+     * so that it counts against the limits of the job's class.
+     * \return whether the limits allow one more request now
+     */
+    bool takeExtraSlot(BaseJob* job);
+    /// Free a slot taken with takeExtraSlot()
+    void releaseExtraSlot(BaseJob* job);
     void limitRate(std::chrono::milliseconds nextCallAfter);
 
+    using RequestClass = BaseJob::RequestClass;
+    int maxRunningRequests(RequestClass requestClass) const;
+    void setMaxRunningRequests(RequestClass requestClass, int newMax);
+    int maxRunningRequests() const;
+    /// Set the limit on the number of requests running in all classes
+    void setMaxRunningRequests(int newMax);
+    int runningRequests(RequestClass requestClass) const;
+    int queuedRequests(RequestClass requestClass) const;
+    /// The scheduler of retries of the jobs on this connection
+    RetryScheduler* retryScheduler() const;
+
     QByteArray accessToken() const;
     QUrl baseUrl() const;
     const QString& deviceId() const;
@@ -146,38 +146,87 @@ RoomMessageEvent::RoomMessageEvent(const QString& plainBody, MsgType msgType,
     : RoomMessageEvent(plainBody, msgTypeToJson(msgType), content)
 {}
 
-TypedBase* contentFromFile(const QFileInfo& file, bool asGenericFile)
+QString rawMsgTypeForMimeType(const QMimeType& mimeType)
+{
+    auto name = mimeType.name();
+    return name.startsWith("image/")
+               ? QStringLiteral("m.image")
+               : name.startsWith("video/")
+                     ? QStringLiteral("m.video")
+                     : name.startsWith("audio/") ? QStringLiteral("m.audio")
+                                                 : QStringLiteral("m.file");
+}
+
+LocalFileInfo LocalFileInfo::guess(const QFileInfo& file)
+{
+    return { file,
+             QMimeDatabase().mimeTypeForFile(file,
+                                             QMimeDatabase::MatchExtension),
+             {},
+             {} };
+}
+
+LocalFileInfo LocalFileInfo::probe(const QFileInfo& file,
+                                   QSize maxThumbnailSize)
+{
+    LocalFileInfo result { file, QMimeDatabase().mimeTypeForFile(file), {}, {} };
+    const auto mimeTypeName = result.mimeType.name();
+    const auto filePath = file.absoluteFilePath();
+    if (mimeTypeName.startsWith("image/")) {
+        QImageReader reader(filePath);
+        result.imageSize = reader.size();
+        if (maxThumbnailSize.isValid() && result.imageSize.isValid()
+            && (result.imageSize.width() > maxThumbnailSize.width()
+                || result.imageSize.height() > maxThumbnailSize.height())) {
+            // Formats like JPEG can downscale while decoding, which is
+            // much faster than reading the full image and scaling it
+            reader.setScaledSize(
+                result.imageSize.scaled(maxThumbnailSize, Qt::KeepAspectRatio));
+            result.thumbnail = reader.read();
+        }
+    } else if (mimeTypeName.startsWith("video/"))
+        // duration can only be obtained asynchronously and can only be
+        // reliably done by starting to play the file. Left for a future
+        // implementation.
+        result.imageSize =
+            QMediaResource(QUrl::fromLocalFile(filePath)).resolution();
+    return result;
+}
+
+TypedBase* contentFromFile(const LocalFileInfo& info, bool asGenericFile)
 {
-    auto filePath = file.absoluteFilePath();
-    auto localUrl = QUrl::fromLocalFile(filePath);
-    auto mimeType = QMimeDatabase().mimeTypeForFile(file);
+    const auto& file = info.file;
+    auto localUrl = QUrl::fromLocalFile(file.absoluteFilePath());
     if (!asGenericFile) {
-        auto mimeTypeName = mimeType.name();
+        auto mimeTypeName = info.mimeType.name();
         if (mimeTypeName.startsWith("image/"))
-            return new ImageContent(localUrl, file.size(), mimeType,
-                                    QImageReader(filePath).size(),
-                                    file.fileName());
+            return new ImageContent(localUrl, file.size(), info.mimeType,
+                                    info.imageSize, file.fileName());
 
-        // duration can only be obtained asynchronously and can only be reliably
-        // done by starting to play the file. Left for a future implementation.
         if (mimeTypeName.startsWith("video/"))
-            return new VideoContent(localUrl, file.size(), mimeType,
-                                    QMediaResource(localUrl).resolution(),
-                                    file.fileName());
+            return new VideoContent(localUrl, file.size(), info.mimeType,
+                                    info.imageSize, file.fileName());
 
         if (mimeTypeName.startsWith("audio/"))
-            return new AudioContent(localUrl, file.size(), mimeType,
+            return new AudioContent(localUrl, file.size(), info.mimeType,
                                     file.fileName());
     }
-    return new FileContent(localUrl, file.size(), mimeType, file.fileName());
+    return new FileContent(localUrl, file.size(), info.mimeType,
+                           file.fileName());
 }
 
 RoomMessageEvent::RoomMessageEvent(const QString& plainBody,
                                    const QFileInfo& file, bool asGenericFile)
+    : RoomMessageEvent(plainBody, LocalFileInfo::probe(file), asGenericFile)
+{}
+
+RoomMessageEvent::RoomMessageEvent(const QString& plainBody,
+                                   const LocalFileInfo& fileInfo,
+                                   bool asGenericFile)
     : RoomMessageEvent(plainBody,
                        asGenericFile ? QStringLiteral("m.file")
-                                     : rawMsgTypeForFile(file),
-                       contentFromFile(file, asGenericFile))
+                                     : rawMsgTypeForMimeType(fileInfo.mimeType),
+                       contentFromFile(fileInfo, asGenericFile))
 {}
 
 RoomMessageEvent::RoomMessageEvent(const QJsonObject& obj)
@@ -254,17 +303,6 @@ QString RoomMessageEvent::replacedEvent() const
     return isReplacement(rel) ? rel->eventId : QString();
 }
 
-QString rawMsgTypeForMimeType(const QMimeType& mimeType)
-{
-    auto name = mimeType.name();
-    return name.startsWith("image/")
-               ? QStringLiteral("m.image")
-               : name.startsWith("video/")
-                     ? QStringLiteral("m.video")
-                     : name.startsWith("audio/") ? QStringLiteral("m.audio")
-                                                 : QStringLiteral("m.file");
-}
-
 QString RoomMessageEvent::rawMsgTypeForUrl(const QUrl& url)
 {
     return rawMsgTypeForMimeType(QMimeDatabase().mimeTypeForUrl(url));
@@ -21,11 +21,16 @@
 #include "eventcontent.h"
 #include "roomevent.h"
 
-class QFileInfo;
+#include <QtCore/QFileInfo>
+#include <QtGui/QImage>
 
 namespace Quotient {
 namespace MessageEventContent = EventContent; // Back-compatibility
 
+namespace EventContent {
+    struct LocalFileInfo;
+}
+
 /**
  * The event class corresponding to m.room.message events
  */
@@ -57,6 +62,9 @@ public:
                               EventContent::TypedBase* content = nullptr);
     explicit RoomMessageEvent(const QString& plainBody, const QFileInfo& file,
                               bool asGenericFile = false);
+    explicit RoomMessageEvent(const QString& plainBody,
+                              const EventContent::LocalFileInfo& fileInfo,
+                              bool asGenericFile = false);
     explicit RoomMessageEvent(const QJsonObject& obj);
 
     MsgType msgtype() const;
@@ -110,6 +118,26 @@ namespace EventContent {
         return { RelatesTo::ReplacementTypeId(), std::move(eventId) };
     }
 
+    /**
+     * Properties of a local file to be sent in a message
+     *
+     * guess() only looks at the file name and size and is fast; probe()
+     * reads the file, which may take a while for big media files. Both are
+     * thread-safe, so probe() can (and normally should) be called from
+     * a worker thread.
+     */
+    struct LocalFileInfo {
+        QFileInfo file;
+        QMimeType mimeType;
+        QSize imageSize; //< For images and, if known, videos
+        /// A downscaled copy of an image bigger than the requested size
+        QImage thumbnail;
+
+        static LocalFileInfo guess(const QFileInfo& file);
+        static LocalFileInfo probe(const QFileInfo& file,
+                                   QSize maxThumbnailSize = {});
+    };
+
     /**
      * Rich text content for m.text, m.emote, m.notice
      *
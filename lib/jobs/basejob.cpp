@@ -19,16 +19,20 @@
 #include "basejob.h"
 
 #include "connectiondata.h"
+#include "backgroundtask.h"
+#include "retryscheduler.h"
 
 #include <QtCore/QRegularExpression>
 #include <QtCore/QTimer>
 #include <QtCore/QStringBuilder>
 #include <QtCore/QMetaEnum>
 #include <QtCore/QPointer>
+#include <QtCore/QCoreApplication>
 #include <QtNetwork/QNetworkAccessManager>
 #include <QtNetwork/QNetworkReply>
 #include <QtNetwork/QNetworkRequest>
 
+#include <algorithm>
 #include <array>
 
 using namespace Quotient;
@@ -87,7 +91,6 @@ class BaseJob::Private {
 public:
     struct JobTimeoutConfig {
         seconds jobTimeout;
-        seconds nextRetryInterval;
     };
 
     // Using an idiom from clang-tidy:
@@ -101,7 +104,6 @@ public:
         , needsToken(nt)
     {
         timer.setSingleShot(true);
-        retryTimer.setSingleShot(true);
     }
 
     ~Private()
@@ -115,13 +117,17 @@ public:
     }
 
     void sendRequest();
+    struct DecodedJson {
+        QJsonDocument json;
+        Status status;
+    };
     /*! \brief Parse the response byte array into JSON
      *
-     * This calls QJsonDocument::fromJson() on rawResponse, converts
-     * the QJsonParseError result to BaseJob::Status and stores the resulting
-     * JSON in jsonResponse.
+     * This calls QJsonDocument::fromJson() on \p data and converts
+     * the QJsonParseError result to BaseJob::Status; it can be called from
+     * any thread.
      */
-    Status parseJson();
+    static DecodedJson parseJson(const QByteArray& data);
 
     ConnectionData* connection = nullptr;
 
@@ -134,11 +140,23 @@ public:
     bool needsToken;
 
     bool inBackground = false;
+    Omittable<RequestClass> requestClass = none;
+    bool cacheable = false;
+    int requesters = 1;
 
     // There's no use of QMimeType here because we don't want to match
     // content types against the known MIME type hierarchy; and at the same
     // type QMimeType is of little help with MIME type globs (`text/*` etc.)
     QByteArrayList expectedContentTypes { "application/json" };
+    bool parseJsonResponse = true;
+
+    /// Whether the response body has to be parsed as JSON before
+    /// prepareResult()
+    bool parsesJson() const
+    {
+        return parseJsonResponse
+               && expectedContentTypes == QByteArrayList { "application/json" };
+    }
 
     QByteArrayList expectedKeys;
 
@@ -159,10 +177,9 @@ public:
     LoggingCategory logCat = JOBS;
 
     QTimer timer;
-    QTimer retryTimer;
 
     static constexpr std::array<const JobTimeoutConfig, 3> errorStrategy {
-        { { 90s, 5s }, { 90s, 10s }, { 120s, 30s } }
+        { { 90s }, { 90s }, { 120s } }
     };
     int maxRetries = int(errorStrategy.size());
     int retriesTaken = 0;
@@ -198,16 +215,11 @@ BaseJob::BaseJob(HttpVerb verb, const QString& name, const QString& endpoint,
 {
     setObjectName(name);
     connect(&d->timer, &QTimer::timeout, this, &BaseJob::timeout);
-    connect(&d->retryTimer, &QTimer::timeout, this, [this] {
-        qCDebug(d->logCat) << "Retrying" << this;
-        d->connection->submit(this);
-    });
 }
 
 BaseJob::~BaseJob()
 {
     stop();
-    d->retryTimer.stop(); // See #398
     qCDebug(d->logCat) << this << "destroyed";
 }
 
@@ -215,6 +227,34 @@ QUrl BaseJob::requestUrl() const { return d->reply ? d->reply->url() : QUrl(); }
 
 bool BaseJob::isBackground() const { return d->inBackground; }
 
+QString BaseJob::sharingKey() const
+{
+    if (d->verb != HttpVerb::Get)
+        return {};
+    auto headerNames = d->requestHeaders.keys();
+    std::sort(headerNames.begin(), headerNames.end());
+    QByteArray headers;
+    for (const auto& name : qAsConst(headerNames))
+        headers += '\n' + name + ": " + d->requestHeaders.value(name);
+    return (d->needsToken ? "auth:"_ls : "noauth:"_ls) % d->apiEndpoint % '?'
+           % d->requestQuery.toString(QUrl::FullyEncoded)
+           % QString::fromLatin1(headers);
+}
+
+ConnectionData* BaseJob::connectionData() const { return d->connection; }
+
+void BaseJob::addRequester() { ++d->requesters; }
+
+void BaseJob::bringToForeground()
+{
+    if (!d->inBackground)
+        return;
+    const auto oldClass = requestClass();
+    d->inBackground = false;
+    if (d->connection && !d->connection->reclassify(this, oldClass))
+        d->inBackground = true; // Already sent, it's too late
+}
+
 const QString& BaseJob::apiEndpoint() const { return d->apiEndpoint; }
 
 void BaseJob::setApiEndpoint(const QString& apiEndpoint)
@@ -264,6 +304,13 @@ void BaseJob::setExpectedContentTypes(const QByteArrayList& contentTypes)
     d->expectedContentTypes = contentTypes;
 }
 
+bool BaseJob::parsesJsonResponse() const { return d->parseJsonResponse; }
+
+void BaseJob::setParseJsonResponse(bool parse)
+{
+    d->parseJsonResponse = parse;
+}
+
 const QByteArrayList BaseJob::expectedKeys() const { return d->expectedKeys; }
 
 void BaseJob::addExpectedKey(const QByteArray& key) { d->expectedKeys << key; }
@@ -315,10 +362,30 @@ void BaseJob::Private::sendRequest()
     // what seems like an attempt to write to a closed channel. If/when that
     // changes, false should be turned to true below.
         , false);
+    const auto useCache = cacheable && verb == HttpVerb::Get;
+    req.setAttribute(QNetworkRequest::CacheLoadControlAttribute,
+                     useCache ? QNetworkRequest::PreferNetwork
+                              : QNetworkRequest::AlwaysNetwork);
+    req.setAttribute(QNetworkRequest::CacheSaveControlAttribute, useCache);
     Q_ASSERT(req.url().isValid());
     for (auto it = requestHeaders.cbegin(); it != requestHeaders.cend(); ++it)
         req.setRawHeader(it.key(), it.value());
 
+    if (auto* source = requestData.source();
+        verb != HttpVerb::Get && source && !source->isSequential()) {
+        // Stream the request body from the source with QNAM's fixed-size
+        // chunks instead of buffering all of it in memory; the source is
+        // rewound so that a retry sends the whole body again. Sequential
+        // sources cannot be rewound, so QNAM is left to buffer them.
+        if (!source->seek(0))
+            qCWarning(logCat) << "Couldn't rewind the request data for"
+                              << apiEndpoint;
+        req.setAttribute(QNetworkRequest::DoNotBufferUploadDataAttribute,
+                         true);
+        if (!req.header(QNetworkRequest::ContentLengthHeader).isValid())
+            req.setHeader(QNetworkRequest::ContentLengthHeader, source->size());
+    }
+
     switch (verb) {
     case HttpVerb::Get:
         reply = connection->nam()->get(req);
@@ -347,28 +414,54 @@ void BaseJob::initiate(ConnectionData* connData, bool inBackground)
         d->inBackground = inBackground;
         d->connection = connData;
         doPrepare();
+        if (status().code != Pending) // See finishPreparation()
+            submit();
+        return;
+    }
+    qCCritical(d->logCat)
+        << "Developers, ensure the Connection is valid before using it";
+    Q_ASSERT(false);
+    setStatus(IncorrectRequestError, tr("Invalid server connection"));
+    QTimer::singleShot(0, this, &BaseJob::finishJob);
+}
 
-        if (d->needsToken && d->connection->accessToken().isEmpty())
-            setStatus(Unauthorised);
-        else if ((d->verb == HttpVerb::Post || d->verb == HttpVerb::Put)
-            && d->requestData.source()
-            && !d->requestData.source()->isReadable()) {
-            setStatus(FileError, "Request data not ready");
-        }
-        Q_ASSERT(status().code != Pending); // doPrepare() must NOT set this
-        if (Q_LIKELY(status().code == Unprepared)) {
-            d->connection->submit(this);
-            return;
-        }
-        qCWarning(d->logCat).noquote()
-            << "Request failed preparation and won't be sent:"
-            << d->dumpRequest();
-    } else {
-        qCCritical(d->logCat)
-            << "Developers, ensure the Connection is valid before using it";
-        Q_ASSERT(false);
-        setStatus(IncorrectRequestError, tr("Invalid server connection"));
+void BaseJob::finishPreparation(Status result)
+{
+    Q_ASSERT(status().code == Pending);
+    Q_ASSERT(result.code != Pending);
+    setStatus(std::move(result));
+    submit();
+}
+
+void BaseJob::submit()
+{
+    if (d->needsToken && d->connection->accessToken().isEmpty())
+        setStatus(Unauthorised);
+    else if ((d->verb == HttpVerb::Post || d->verb == HttpVerb::Put)
+             && d->requestData.source()
+             && !d->requestData.source()->isReadable()) {
+        setStatus(FileError, "Request data not ready");
+    }
+    if (Q_LIKELY(status().code == Unprepared)) {
+        d->connection->submit(this);
+        return;
+    }
+    if (status().good()) {
+        qCDebug(d->logCat).noquote()
+            << "Request served without sending:" << d->dumpRequest();
+        // Look like any other running job until finished
+        const auto result = status();
+        setStatus(Pending);
+        QTimer::singleShot(0, this, [this, result] {
+            if (status().code != Pending)
+                return; // Abandoned meanwhile
+            setStatus(result);
+            finishJob();
+        });
+        return;
     }
+    qCWarning(d->logCat).noquote()
+        << "Request failed preparation and won't be sent:" << d->dumpRequest();
     // The status is no good, finalise
     QTimer::singleShot(0, this, &BaseJob::finishJob);
 }
@@ -387,8 +480,10 @@ void BaseJob::sendRequest()
     d->sendRequest();
     Q_ASSERT(d->reply);
     connect(reply(), &QNetworkReply::finished, this, [this] {
+        d->connection->requestDone(this);
         gotReply();
-        finishJob();
+        if (status().code != Pending) // See finishDeferred()
+            finishJob();
     });
     if (d->reply->isRunning()) {
         connect(reply(), &QNetworkReply::metaDataChanged, this,
@@ -406,24 +501,78 @@ void BaseJob::sendRequest()
             << "Request could not start:" << d->dumpRequest();
 }
 
-BaseJob::Status BaseJob::Private::parseJson()
+auto BaseJob::Private::parseJson(const QByteArray& data) -> DecodedJson
 {
     QJsonParseError error { 0, QJsonParseError::MissingObject };
-    jsonResponse = QJsonDocument::fromJson(rawResponse, &error);
-    return { error.error == QJsonParseError::NoError ? NoError
-                                                     : IncorrectResponse,
-             error.errorString() };
+    auto json = QJsonDocument::fromJson(data, &error);
+    return { std::move(json),
+             { error.error == QJsonParseError::NoError ? NoError
+                                                       : IncorrectResponse,
+               error.errorString() } };
+}
+
+static bool backgroundDecoding = false;
+
+/// The dedicated thread to decode JSON responses on
+static QThreadPool* decodingThread()
+{
+    static auto* pool = [] {
+        auto* p = new QThreadPool(QCoreApplication::instance());
+        p->setMaxThreadCount(1);
+        p->setExpiryTimeout(-1); // Keep the thread around
+        return p;
+    }();
+    return pool;
+}
+
+bool BaseJob::decodesInBackground() { return backgroundDecoding; }
+
+void BaseJob::setDecodeInBackground(bool enable)
+{
+    backgroundDecoding = enable;
 }
 
 void BaseJob::gotReply()
 {
+    if (reply()
+            ->attribute(QNetworkRequest::SourceIsFromCacheAttribute)
+            .toBool())
+        qCDebug(d->logCat) << this << "got the response from the HTTP cache";
     setStatus(checkReply(reply()));
 
-    if (status().good()
-        && d->expectedContentTypes == QByteArrayList { "application/json" }) {
+    if (status().good() && d->parsesJson()) {
         d->rawResponse = reply()->readAll();
-        setStatus(d->parseJson());
-        if (status().good() && !expectedKeys().empty()) {
+        if (backgroundDecoding) {
+            // Look like a running job until the JSON is decoded; the timeout
+            // doesn't apply as the reply has arrived already
+            d->timer.stop();
+            setStatus(Pending);
+            runInBackground(decodingThread(), this,
+                            [data = d->rawResponse] {
+                                return Private::parseJson(data);
+                            },
+                            [this](Private::DecodedJson&& decoded) {
+                                if (status().code != Pending)
+                                    return; // Abandoned meanwhile
+                                d->jsonResponse = std::move(decoded.json);
+                                setStatus(std::move(decoded.status));
+                                processReply();
+                                if (status().code != Pending)
+                                    finishJob();
+                            });
+            return;
+        }
+        auto decoded = Private::parseJson(d->rawResponse);
+        d->jsonResponse = std::move(decoded.json);
+        setStatus(std::move(decoded.status));
+    }
+    processReply();
+}
+
+void BaseJob::processReply()
+{
+    if (status().good() && d->parsesJson()) {
+        if (!expectedKeys().empty()) {
             const auto& responseObject = jsonData();
             QByteArrayList missingKeys;
             for (const auto& k: expectedKeys())
@@ -455,6 +604,14 @@ void BaseJob::gotReply()
     }
 }
 
+void BaseJob::finishDeferred(Status result)
+{
+    Q_ASSERT(status().code == Pending);
+    Q_ASSERT(result.code != Pending);
+    setStatus(std::move(result));
+    finishJob();
+}
+
 bool checkContentType(const QByteArray& type, const QByteArrayList& patterns)
 {
     if (patterns.isEmpty())
@@ -522,10 +679,12 @@ BaseJob::Status BaseJob::prepareError()
     // Try to make sense of the error payload but be prepared for all kinds
     // of unexpected stuff (raw HTML, plain text, foreign JSON among those)
     if (!d->rawResponse.isEmpty()
-        && reply()->rawHeader("Content-Type") == "application/json")
-        d->parseJson();
+        && reply()->rawHeader("Content-Type") == "application/json") {
+        auto decoded = Private::parseJson(d->rawResponse);
+        d->jsonResponse = std::move(decoded.json);
+    }
 
-    // By now, if d->parseJson() above succeeded then jsonData() will return
+    // By now, if parsing above succeeded then jsonData() will return
     // a valid JSON object - or an empty object otherwise (in which case most
     // of if's below will fall through to `return NoError` at the end
     const auto& errorJson = jsonData();
@@ -579,8 +738,8 @@ QJsonValue BaseJob::takeValueFromJson(const QString& key)
 
 void BaseJob::stop()
 {
-    // This method is (also) used to semi-finalise the job before retrying; so
-    // stop the timeout timer but keep the retry timer running.
+    // This method is (also) used to semi-finalise the job before retrying;
+    // the retry itself is scheduled with the connection's RetryScheduler.
     d->timer.stop();
     if (d->reply) {
         d->reply->disconnect(this); // Ignore whatever comes from the reply
@@ -589,13 +748,23 @@ void BaseJob::stop()
                 << this << "stopped without ready network reply";
             d->reply->abort(); // Keep the reply object in case clients need it
         }
-    } else
+    } else if (!status().good())
         qCWarning(d->logCat) << this << "stopped with empty network reply";
 }
 
 void BaseJob::finishJob()
 {
     stop();
+    if (d->connection)
+        d->connection->requestDone(this);
+    if (d->reply) {
+        // Let the retry scheduler know whether the homeserver is reachable
+        auto* retryScheduler = d->connection->retryScheduler();
+        if (error() == NetworkError || error() == Timeout)
+            retryScheduler->reportNetworkFailure(this);
+        else if (error() != Abandoned)
+            retryScheduler->reportResponse();
+    }
     switch(error()) {
     case TooManyRequests:
         emit rateLimited();
@@ -616,18 +785,16 @@ void BaseJob::finishJob()
     case IncorrectResponse:
     case Timeout:
         if (d->retriesTaken < d->maxRetries) {
-            // TODO: The whole retrying thing should be put to
-            // Connection(Manager) otherwise independently retrying jobs make a
-            // bit of notification storm towards the UI.
-            const seconds retryIn = error() == Timeout ? 0s
-                                                       : getNextRetryInterval();
+            // Timeouts are retried quickly: the server may just be busy
+            const auto quickRetry = error() == Timeout;
             ++d->retriesTaken;
+            setStatus(Pending, "Pending retry");
+            const auto retryIn = d->connection->retryScheduler()->schedule(
+                this, d->retriesTaken, quickRetry);
             qCWarning(d->logCat).nospace()
                 << this << ": retry #" << d->retriesTaken << " in "
-                << retryIn.count() << " s";
-            setStatus(Pending, "Pending retry");
-            d->retryTimer.start(retryIn);
-            emit retryScheduled(d->retriesTaken, milliseconds(retryIn).count());
+                << retryIn.count() << " ms";
+            emit retryScheduled(d->retriesTaken, retryIn.count());
             return;
         }
         [[fallthrough]];
@@ -660,7 +827,8 @@ BaseJob::duration_ms_t BaseJob::getCurrentTimeoutMs() const
 
 seconds BaseJob::getNextRetryInterval() const
 {
-    return d->getCurrentTimeoutConfig().nextRetryInterval;
+    return duration_cast<seconds>(
+        RetryScheduler::backoff(d->retriesTaken + 1));
 }
 
 BaseJob::duration_ms_t BaseJob::getNextRetryMs() const
@@ -670,8 +838,8 @@ BaseJob::duration_ms_t BaseJob::getNextRetryMs() const
 
 milliseconds BaseJob::timeToRetry() const
 {
-    return d->retryTimer.isActive() ? d->retryTimer.remainingTimeAsDuration()
-                                    : 0s;
+    return d->connection ? d->connection->retryScheduler()->timeToRetry(this)
+                         : 0ms;
 }
 
 BaseJob::duration_ms_t BaseJob::millisToRetry() const
@@ -681,6 +849,32 @@ BaseJob::duration_ms_t BaseJob::millisToRetry() const
 
 int BaseJob::maxRetries() const { return d->maxRetries; }
 
+BaseJob::RequestClass BaseJob::requestClass() const
+{
+    if (d->requestClass)
+        return *d->requestClass;
+    if (d->apiEndpoint.startsWith("/_matrix/media/"_ls))
+        return RequestClass::Media;
+    if (d->verb == HttpVerb::Get)
+        return d->inBackground ? RequestClass::Background
+                               : RequestClass::Interactive;
+    return RequestClass::Send;
+}
+
+void BaseJob::setRequestClass(RequestClass newClass)
+{
+    const auto oldClass = requestClass();
+    const auto oldSetting = d->requestClass;
+    d->requestClass = newClass;
+    if (d->connection && isJobRunning(this)
+        && !d->connection->reclassify(this, oldClass))
+        d->requestClass = oldSetting; // Already sent, it's too late
+}
+
+bool BaseJob::isCacheable() const { return d->cacheable; }
+
+void BaseJob::setCacheable(bool cacheable) { d->cacheable = cacheable; }
+
 void BaseJob::setMaxRetries(int newMaxRetries)
 {
     d->maxRetries = newMaxRetries;
@@ -802,7 +996,11 @@ void BaseJob::abandon()
 {
     beforeAbandon();
     d->timer.stop();
-    d->retryTimer.stop(); // In case abandon() was called between retries
+    if (d->connection) {
+        d->connection->requestDone(this);
+        // In case abandon() was called between retries
+        d->connection->retryScheduler()->cancel(this);
+    }
     setStatus(Abandoned);
     if (d->reply)
         d->reply->disconnect(this);
@@ -811,6 +1009,18 @@ void BaseJob::abandon()
     deleteLater();
 }
 
+void BaseJob::release(const QObject* requester)
+{
+    if (requester)
+        disconnect(requester);
+    if (--d->requesters > 0) {
+        qCDebug(d->logCat) << this << "is still needed by" << d->requesters
+                           << "requester(s)";
+        return;
+    }
+    abandon();
+}
+
 void BaseJob::timeout()
 {
     setStatus(TimeoutError, "The job has timed out");
@@ -86,6 +86,21 @@ public:
     };
     Q_ENUM(StatusCode)
 
+    /*! The class of a request, used by ConnectionData to dispatch it
+     *
+     * The classes are listed in the order of priority; each of them has its
+     * own limit on the number of requests running at the same time.
+     * \sa ConnectionData::setMaxRunningRequests
+     */
+    enum class RequestClass {
+        Sync, //< Sync requests
+        Send, //< Requests changing something on the server: sending etc.
+        Interactive, //< Data fetching in the foreground
+        Media, //< Media repository: thumbnails, downloads and uploads
+        Background, //< Data fetching in the background
+    };
+    Q_ENUM(RequestClass)
+
     /**
      * A simple wrapper around QUrlQuery that allows its creation from
      * a list of string pairs
@@ -149,6 +164,32 @@ public:
 
     QUrl requestUrl() const;
     bool isBackground() const;
+    /// A key identifying the request for sharing it between callers
+    /**
+     * The key is made of the endpoint, the query, the request headers and
+     * whether the request is authenticated; it's empty for requests other
+     * than GET, as only those are safe to share. Jobs whose result depends
+     * on anything else (e.g., the file to save the response to) should
+     * extend the key in an override, or return an empty key to opt out of
+     * sharing.
+     * \sa Quotient::SharedForegroundRequest
+     */
+    virtual QString sharingKey() const;
+    /// Register one more requester of the job
+    /**
+     * Connection calls this each time it gives a running job to another
+     * caller instead of starting a new one.
+     * \sa release
+     */
+    void addRequester();
+    /// Make the job a foreground one, if it's still possible
+    /**
+     * A request still waiting in the queue moves to the class it would have
+     * if the job were initiated in the foreground; a request that has
+     * already been sent keeps its class.
+     * \sa isBackground, requestClass
+     */
+    void bringToForeground();
 
     /** Current status of the job */
     Status status() const;
@@ -237,6 +278,47 @@ public:
     int maxRetries() const;
     void setMaxRetries(int newMaxRetries);
 
+    /// The class the request of this job is dispatched with
+    /**
+     * Unless set explicitly, media repository requests are of class Media;
+     * other GET requests are Interactive or Background, depending on
+     * isBackground(); the rest are Send.
+     */
+    RequestClass requestClass() const;
+    /// Set the request class
+    /**
+     * If the job is initiated already, its request moves to the queue of
+     * the new class unless it has been sent, in which case the class stays.
+     */
+    void setRequestClass(RequestClass newClass);
+
+    /// Whether JSON responses are decoded on a dedicated thread
+    static bool decodesInBackground();
+    /// Decode JSON responses of all jobs on a dedicated thread
+    /**
+     * Network I/O already happens on a Qt-internal thread; this moves
+     * parsing of the received JSON off the thread jobs live in as well,
+     * which keeps the UI responsive when many replies arrive at once.
+     * Jobs still emit their signals and run prepareResult() on their
+     * own thread. Disabled by default.
+     */
+    static void setDecodeInBackground(bool enable);
+
+    /// Whether the response may be taken from and saved to the HTTP cache
+    bool isCacheable() const;
+    /// Let the response of a GET request go through the HTTP cache
+    /**
+     * Cacheable responses are served from the cache of
+     * NetworkAccessManager while fresh, and revalidated with a conditional
+     * request when stale, as told by their Cache-Control, ETag and
+     * Last-Modified headers. Since the cache is shared by all connections,
+     * only enable this for responses that don't differ between users.
+     * This has to be set before the job is run: create the job with
+     * \c new and pass it to Connection::run() afterwards, as callApi()
+     * may send the request right away.
+     */
+    void setCacheable(bool cacheable);
+
     using duration_ms_t = std::chrono::milliseconds::rep; // normally int64_t
 
     std::chrono::seconds getCurrentTimeout() const;
@@ -263,6 +345,18 @@ public slots:
      */
     void abandon();
 
+    /// Give up on the job result on behalf of \p requester
+    /**
+     * This disconnects \p requester from the job signals; the job is
+     * abandoned once each of its requesters has released it. For a job
+     * that is not shared this is the same as abandon(); jobs returned by
+     * Connection::getThumbnail(), Connection::downloadFile() or started with
+     * a shared running policy may be shared, and should be released rather
+     * than abandoned.
+     * \sa addRequester
+     */
+    void release(const QObject* requester = nullptr);
+
 signals:
     /** The job is about to send a network request */
     void aboutToSendRequest();
@@ -355,10 +449,22 @@ protected:
     const QByteArrayList& expectedContentTypes() const;
     void addExpectedContentType(const QByteArray& contentType);
     void setExpectedContentTypes(const QByteArrayList& contentTypes);
+    bool parsesJsonResponse() const;
+    /// Whether BaseJob should parse the JSON response by itself
+    /**
+     * Normally a successful `application/json` response is parsed before
+     * prepareResult() is called, and the result is available via jsonData()
+     * and friends. Turn this off to read the body from reply() in
+     * prepareResult() instead, e.g. to parse it on another thread; expected
+     * keys are not checked in that case. Errors are parsed either way.
+     */
+    void setParseJsonResponse(bool parse);
     const QByteArrayList expectedKeys() const;
     void addExpectedKey(const QByteArray &key);
     void setExpectedKeys(const QByteArrayList &keys);
 
+    /// The connection the job runs on; nullptr until it's initiated
+    ConnectionData* connectionData() const;
     const QNetworkReply* reply() const;
     QNetworkReply* reply();
 
@@ -374,9 +480,21 @@ protected:
      *
      * This method is called no more than once per job lifecycle,
      * when it's first scheduled for execution; in particular, it is not called
-     * on retries.
+     * on retries. An error status set here fails the job without sending
+     * the request; setting Success finishes the job successfully, also without
+     * sending the request (e.g., when the result is already in a cache).
+     * Setting Pending defers the preparation, for work that shouldn't block
+     * the calling thread: the job keeps running without sending the request
+     * until finishPreparation() is called.
      */
     virtual void doPrepare();
+    /*! \brief Carry on with the job after doPrepare() has deferred it
+     *
+     * \p result is what doPrepare() would otherwise set: Unprepared to send
+     * the request, Success to finish the job without sending it, or an error
+     * to fail the job.
+     */
+    void finishPreparation(Status result);
 
     /*! Postprocessing after the network request has been sent
      *
@@ -389,12 +507,24 @@ protected:
 
     /*! \brief An extension point for additional reply processing.
      *
-     * The base implementation does nothing and returns Success.
+     * The base implementation does nothing and returns Success. Returning
+     * Pending defers the result: the job keeps running until
+     * finishDeferred() is called.
      *
-     * \sa gotReply
+     * \sa gotReply, finishDeferred
      */
     virtual Status prepareResult();
 
+    /*! \brief Finish the job after prepareResult() has deferred the result
+     *
+     * This is for jobs that need more asynchronous work (e.g., additional
+     * network requests) after the reply is received. \p result is processed
+     * in the same way as the one returned from prepareResult(), including
+     * retries on network errors; the job timeout still applies while
+     * the result is deferred.
+     */
+    void finishDeferred(Status result);
+
     /*! \brief Process details of the error
      *
      * The function processes the reply in case when status from checkReply()
@@ -459,11 +589,14 @@ protected slots:
 private slots:
     void sendRequest();
     void gotReply();
+    /// Finish processing the reply once its JSON, if any, is decoded
+    void processReply();
 
     friend class ConnectionData; // to provide access to sendRequest()
 
 private:
     void stop();
+    void submit();
     void finishJob();
 
     class Private;
@@ -1,11 +1,43 @@
 #include "downloadfilejob.h"
 
+#include "backgroundtask.h"
+#include "connectiondata.h"
+#include "mediacache.h"
+
 #include <QtCore/QFile>
+#include <QtCore/QPointer>
+#include <QtCore/QRegularExpression>
+#include <QtCore/QStringBuilder>
 #include <QtCore/QTemporaryFile>
+#include <QtNetwork/QNetworkAccessManager>
 #include <QtNetwork/QNetworkReply>
 
+#include <algorithm>
+#include <vector>
+
 using namespace Quotient;
 
+namespace {
+/// A range of bytes of the file, fetched by a single request at a time
+struct Segment {
+    qint64 begin = 0;
+    qint64 end = -1; //< Past the last byte; -1 while it's unknown
+    qint64 written = 0;
+    /// The additional reply fetching the segment, if there's one
+    QPointer<QNetworkReply> reply = nullptr;
+    int failures = 0;
+
+    qint64 next() const { return begin + written; }
+    bool complete() const { return end >= 0 && next() >= end; }
+};
+
+QByteArray rangeHeader(qint64 begin, qint64 end)
+{
+    return "bytes=" + QByteArray::number(begin) + '-'
+           + (end >= 0 ? QByteArray::number(end - 1) : QByteArray());
+}
+} // namespace
+
 class DownloadFileJob::Private {
 public:
     Private() : tempFile(new QTemporaryFile()) {}
@@ -15,8 +47,48 @@ public:
         , tempFile(new QFile(targetFile->fileName() + ".qtntdownload"))
     {}
 
+    ~Private() { abortRanges(); }
+
     QScopedPointer<QFile> targetFile;
     QScopedPointer<QFile> tempFile;
+    QString mediaId;
+    bool fromCache = false;
+
+    /// Segments of the file; the job's own reply works on mainSegment,
+    /// additional replies (if any) on the others
+    std::vector<Segment> segments = std::vector<Segment>(1);
+    int mainSegment = 0;
+    qint64 totalSize = -1;
+    int parallelRanges = 1;
+    qint64 parallelMinSize = 0;
+    /// The request to base additional range requests on
+    QNetworkRequest rangeRequest;
+    QPointer<QNetworkAccessManager> nam;
+    /// Set when prepareResult() has deferred the result until the additional
+    /// replies finish
+    bool waitingForRanges = false;
+
+    qint64 bytesWritten() const
+    {
+        qint64 result = 0;
+        for (const auto& s : segments)
+            result += s.written;
+        return result;
+    }
+    /// Abort the additional replies; returns how many there were
+    int abortRanges()
+    {
+        int count = 0;
+        for (auto& s : segments)
+            if (QNetworkReply* r = s.reply) {
+                s.reply = nullptr;
+                r->disconnect();
+                r->abort();
+                r->deleteLater();
+                ++count;
+            }
+        return count;
+    }
 };
 
 QUrl DownloadFileJob::makeRequestUrl(QUrl baseUrl, const QUrl& mxcUri)
@@ -32,13 +104,33 @@ DownloadFileJob::DownloadFileJob(const QString& serverName,
     , d(localFilename.isEmpty() ? new Private : new Private(localFilename))
 {
     setObjectName(QStringLiteral("DownloadFileJob"));
+    d->mediaId = serverName % '/' % mediaId;
+    connect(this, &BaseJob::aboutToSendRequest, this,
+            &DownloadFileJob::prepareRangeRequest);
 }
 
+DownloadFileJob::~DownloadFileJob() = default;
+
 QString DownloadFileJob::targetFileName() const
 {
     return (d->targetFile ? d->targetFile : d->tempFile)->fileName();
 }
 
+void DownloadFileJob::setParallelRanges(int count, qint64 minFileSize)
+{
+    d->parallelRanges = std::max(count, 1);
+    d->parallelMinSize = minFileSize;
+}
+
+QString DownloadFileJob::sharingKey() const
+{
+    // Jobs downloading to a temporary file can share it
+    auto key = GetContentJob::sharingKey();
+    if (!key.isEmpty() && d->targetFile)
+        key += "\nfile:" % d->targetFile->fileName();
+    return key;
+}
+
 void DownloadFileJob::doPrepare()
 {
     if (d->targetFile && !d->targetFile->isReadable()
@@ -54,46 +146,316 @@ void DownloadFileJob::doPrepare()
         setStatus(FileError, "Could not open the temporary download file");
         return;
     }
-    qCDebug(JOBS) << "Downloading to" << d->tempFile->fileName();
+    const auto cachedFileName = MediaCache::instance().find(d->mediaId);
+    if (cachedFileName.isEmpty()) {
+        qCDebug(JOBS) << "Downloading to" << d->tempFile->fileName();
+        return;
+    }
+    // Copy the cached file off the main thread
+    setStatus(Pending);
+    runInBackground(
+        this,
+        [cachedFileName, tempFileName = d->tempFile->fileName()] {
+            QFile cachedFile(cachedFileName);
+            QFile tempFile(tempFileName);
+            if (!cachedFile.open(QIODevice::ReadOnly)
+                || !tempFile.open(QIODevice::WriteOnly))
+                return false;
+            while (!cachedFile.atEnd()) {
+                const auto chunk = cachedFile.read(1024 * 1024);
+                if (chunk.isEmpty() || tempFile.write(chunk) != chunk.size())
+                    return false;
+            }
+            return true;
+        },
+        [this](bool copied) {
+            if (status().code != Pending)
+                return; // Abandoned meanwhile
+            if (copied) {
+                qCDebug(JOBS) << "Using the cached copy of" << d->mediaId;
+                d->fromCache = true;
+                finishPreparation(finalise());
+                return;
+            }
+            qCWarning(JOBS) << "Couldn't use the cached copy of" << d->mediaId
+                            << "- downloading it again";
+            d->tempFile->seek(0);
+            d->tempFile->resize(0);
+            qCDebug(JOBS) << "Downloading to" << d->tempFile->fileName();
+            finishPreparation(Unprepared);
+        });
 }
 
-void DownloadFileJob::onSentRequest(QNetworkReply* reply)
+void DownloadFileJob::prepareRangeRequest()
 {
-    connect(reply, &QNetworkReply::metaDataChanged, this, [this, reply] {
-        if (!status().good())
-            return;
-        auto sizeHeader = reply->header(QNetworkRequest::ContentLengthHeader);
-        if (sizeHeader.isValid()) {
-            auto targetSize = sizeHeader.toLongLong();
-            if (targetSize != -1)
-                if (!d->tempFile->resize(targetSize)) {
-                    qCWarning(JOBS) << "Failed to allocate" << targetSize
-                                    << "bytes for" << d->tempFile->fileName();
-                    setStatus(FileError,
-                              "Could not reserve disk space for download");
-                }
+    d->waitingForRanges = false;
+    // Resume the first incomplete segment nobody works on; if all of them
+    // are being fetched by additional replies, take over the one with
+    // the most bytes left (this only happens on retries after a timeout)
+    auto& segments = d->segments;
+    int segmentIndex = -1;
+    for (int i = 0; i < int(segments.size()); ++i)
+        if (!segments[i].complete() && !segments[i].reply) {
+            segmentIndex = i;
+            break;
         }
-    });
-    connect(reply, &QIODevice::readyRead, this, [this, reply] {
+    if (segmentIndex == -1) {
+        for (int i = 0; i < int(segments.size()); ++i) {
+            const auto& s = segments[i];
+            if (!s.complete()
+                && (segmentIndex == -1
+                    || s.end - s.next() > segments[segmentIndex].end
+                                              - segments[segmentIndex].next()))
+                segmentIndex = i;
+        }
+        if (segmentIndex == -1)
+            segmentIndex = 0; // Shouldn't happen; but there's nothing better
+        if (QNetworkReply* r = segments[segmentIndex].reply) {
+            segments[segmentIndex].reply = nullptr;
+            r->disconnect();
+            r->abort();
+            r->deleteLater();
+            if (auto* c = connectionData())
+                c->releaseExtraSlot(this);
+        }
+    }
+    d->mainSegment = segmentIndex;
+
+    const auto& s = segments[segmentIndex];
+    auto headers = requestHeaders();
+    if (s.next() > 0 || s.end >= 0) {
+        qCDebug(JOBS) << "Requesting bytes" << s.next() << "to" << s.end
+                      << "of" << d->mediaId;
+        headers.insert("Range", rangeHeader(s.next(), s.end));
+    } else if (d->parallelRanges > 1 && d->totalSize < 0)
+        // Only ask for the first range, to learn the file size and whether
+        // the server supports ranges at all
+        headers.insert("Range",
+                       rangeHeader(0, std::max(d->parallelMinSize
+                                                   / d->parallelRanges,
+                                               qint64(1))));
+    else
+        headers.remove("Range");
+    setRequestHeaders(headers);
+}
+
+void DownloadFileJob::onSentRequest(QNetworkReply* reply)
+{
+    // Progress is reported for the whole file rather than for each request
+    disconnect(reply, &QNetworkReply::downloadProgress, this,
+               &BaseJob::downloadProgress);
+    connectReply(reply, d->mainSegment);
+}
+
+void DownloadFileJob::connectReply(QNetworkReply* reply, int segmentIndex)
+{
+    connect(reply, &QNetworkReply::metaDataChanged, this,
+            [this, reply, segmentIndex] {
+                if (status().good())
+                    processHeaders(reply, segmentIndex);
+            });
+    connect(reply, &QIODevice::readyRead, this, [this, reply, segmentIndex] {
         if (!status().good())
             return;
+        const auto isMain = reply == this->reply();
+        if (segmentIndex >= int(d->segments.size())
+            || (!isMain && d->segments[segmentIndex].reply != reply))
+            return; // A stale reply
+        auto& s = d->segments[segmentIndex];
         auto bytes = reply->read(reply->bytesAvailable());
-        if (!bytes.isEmpty())
-            d->tempFile->write(bytes);
-        else
+        if (bytes.isEmpty()) {
             qCWarning(JOBS) << "Unexpected empty chunk when downloading from"
                             << reply->url() << "to" << d->tempFile->fileName();
+            return;
+        }
+        if (s.end >= 0 && bytes.size() > s.end - s.next())
+            bytes.truncate(int(s.end - s.next()));
+        if (!d->tempFile->seek(s.next())
+            || d->tempFile->write(bytes) != bytes.size()) {
+            qCWarning(JOBS) << "Failed to write to" << d->tempFile->fileName();
+            if (isMain)
+                setStatus(FileError, "Could not write the downloaded data");
+            else
+                reply->abort();
+            return;
+        }
+        s.written += bytes.size();
+        emit downloadProgress(d->bytesWritten(), d->totalSize);
     });
 }
 
+void DownloadFileJob::processHeaders(QNetworkReply* reply, int segmentIndex)
+{
+    const auto isMain = reply == this->reply();
+    const auto httpCode =
+        reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+    if (httpCode == 200) {
+        if (!isMain) {
+            // Additional replies are only made after the server has shown
+            // support for ranges; treat this as a failure of the reply
+            reply->abort();
+            return;
+        }
+        // The server sends the whole file: start over
+        if (d->bytesWritten() > 0)
+            qCDebug(JOBS) << "The server ignored the range request, restarting"
+                          << "the download of" << d->mediaId;
+        abortRanges();
+        d->segments.assign(1, {});
+        d->mainSegment = 0;
+        const auto sizeHeader =
+            reply->header(QNetworkRequest::ContentLengthHeader);
+        d->totalSize = sizeHeader.isValid() ? sizeHeader.toLongLong() : -1;
+        d->segments.front().end = d->totalSize;
+    } else if (httpCode == 206) {
+        static const QRegularExpression ContentRangeRe(
+            QStringLiteral(R"(^bytes (\d+)-(\d+)/(\d+|\*)$)"));
+        const auto match = ContentRangeRe.match(
+            QString::fromLatin1(reply->rawHeader("Content-Range")));
+        auto& s = d->segments[segmentIndex];
+        if (!match.hasMatch() || match.captured(1).toLongLong() != s.next()) {
+            qCWarning(JOBS) << "Unexpected Content-Range in the response:"
+                            << reply->rawHeader("Content-Range");
+            reply->abort(); // Will be retried
+            return;
+        }
+        if (s.end < 0)
+            s.end = match.captured(2).toLongLong() + 1;
+        if (d->totalSize < 0 && match.captured(3) != "*")
+            d->totalSize = match.captured(3).toLongLong();
+    } else
+        return; // Errors are dealt with when the reply finishes
+
+    if (d->totalSize > 0 && d->tempFile->size() < d->totalSize
+        && !d->tempFile->resize(d->totalSize)) {
+        qCWarning(JOBS) << "Failed to allocate" << d->totalSize << "bytes for"
+                        << d->tempFile->fileName();
+        setStatus(FileError, "Could not reserve disk space for download");
+        return;
+    }
+
+    // Split the rest of a large file among additional replies; the rest of
+    // a smaller one (the first range only covers its beginning) gets
+    // a single reply
+    const auto firstEnd = d->segments.front().end;
+    if (isMain && httpCode == 206 && d->segments.size() == 1
+        && d->parallelRanges > 1 && firstEnd >= 0 && firstEnd < d->totalSize) {
+        const auto count =
+            d->totalSize >= d->parallelMinSize ? d->parallelRanges - 1 : 1;
+        const auto rangeSize = (d->totalSize - firstEnd + count - 1) / count;
+        for (auto begin = firstEnd; begin < d->totalSize; begin += rangeSize) {
+            Segment s;
+            s.begin = begin;
+            s.end = std::min(begin + rangeSize, d->totalSize);
+            d->segments.push_back(s);
+        }
+        qCDebug(JOBS) << "Downloading" << d->mediaId << "in"
+                      << d->segments.size() << "ranges";
+        d->rangeRequest = reply->request();
+        d->nam = reply->manager();
+        startIdleSegments();
+    }
+}
+
+void DownloadFileJob::abortRanges()
+{
+    const auto count = d->abortRanges();
+    if (auto* c = connectionData())
+        for (int i = 0; i < count; ++i)
+            c->releaseExtraSlot(this);
+}
+
+void DownloadFileJob::startIdleSegments()
+{
+    for (int i = 0; i < int(d->segments.size()); ++i) {
+        const auto& s = d->segments[i];
+        if (s.complete() || s.reply || s.failures > maxRetries()
+            || (i == d->mainSegment && reply() && reply()->isRunning()))
+            continue;
+        if (!startRangeReply(i))
+            break; // No free slots; try again when a reply finishes
+    }
+}
+
+bool DownloadFileJob::startRangeReply(int segmentIndex)
+{
+    // Each additional request counts against the limits of the job's class
+    auto* c = connectionData();
+    if (!d->nam || !c || !c->takeExtraSlot(this))
+        return false;
+    auto& s = d->segments[segmentIndex];
+    auto request = d->rangeRequest;
+    request.setRawHeader("Range", rangeHeader(s.next(), s.end));
+    auto* reply = d->nam->get(request);
+    s.reply = reply;
+    connectReply(reply, segmentIndex);
+    connect(reply, &QNetworkReply::finished, this,
+            [this, reply, segmentIndex] {
+                processRangeReply(reply, segmentIndex);
+            });
+    return true;
+}
+
+void DownloadFileJob::processRangeReply(QNetworkReply* reply, int segmentIndex)
+{
+    reply->deleteLater();
+    if (segmentIndex >= int(d->segments.size())
+        || d->segments[segmentIndex].reply != reply)
+        return; // A stale reply
+    auto& s = d->segments[segmentIndex];
+    s.reply = nullptr;
+    if (auto* c = connectionData())
+        c->releaseExtraSlot(this);
+    if (!s.complete()) {
+        qCWarning(JOBS).nospace()
+            << "Failed to get bytes " << s.next() << " to " << s.end << " of "
+            << d->mediaId << ": " << reply->errorString();
+        // Beyond maxRetries(), the job's own request will pick up
+        // the segment on its next retry
+        ++s.failures;
+    }
+    startIdleSegments();
+    if (d->waitingForRanges)
+        if (auto result = checkSegments(); result.code != Pending) {
+            d->waitingForRanges = false;
+            finishDeferred(std::move(result));
+        }
+}
+
+BaseJob::Status DownloadFileJob::checkSegments()
+{
+    auto complete = true;
+    for (const auto& s : d->segments) {
+        if (s.reply)
+            return Pending;
+        complete = complete && s.complete();
+    }
+    return complete ? finalise() : Status(NetworkError, "Incomplete download");
+}
+
 void DownloadFileJob::beforeAbandon()
 {
+    abortRanges();
     if (d->targetFile)
         d->targetFile->remove();
     d->tempFile->remove();
 }
 
 BaseJob::Status DownloadFileJob::prepareResult()
+{
+    auto& s = d->segments[d->mainSegment];
+    if (s.end < 0) // The size was unknown; the whole file has been received
+        s.end = s.next();
+    startIdleSegments();
+    auto result = checkSegments();
+    if (result.code == Pending) {
+        qCDebug(JOBS) << "Waiting for the remaining ranges of" << d->mediaId;
+        d->waitingForRanges = true;
+    }
+    return result;
+}
+
+BaseJob::Status DownloadFileJob::finalise()
 {
     if (d->targetFile) {
         d->targetFile->close();
@@ -109,5 +471,7 @@ BaseJob::Status DownloadFileJob::prepareResult()
     } else
         d->tempFile->close();
     qCDebug(JOBS) << "Saved a file as" << targetFileName();
+    if (!d->fromCache)
+        MediaCache::instance().storeFile(d->mediaId, targetFileName());
     return Success;
 }
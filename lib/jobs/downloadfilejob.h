@@ -10,9 +10,23 @@ public:
 
     DownloadFileJob(const QString& serverName, const QString& mediaId,
                     const QString& localFilename = {});
+    ~DownloadFileJob() override;
 
     QString targetFileName() const;
 
+    /*! \brief Download large files in several concurrent ranges
+     *
+     * If the server supports range requests and the file is at least
+     * \p minFileSize bytes big, the file is downloaded over \p count
+     * concurrent requests, each fetching its own range of bytes. This should
+     * be called before the job sends its first request, e.g. right after
+     * Connection::downloadFile().
+     */
+    void setParallelRanges(int count, qint64 minFileSize = 32 * 1024 * 1024);
+
+    /// The key of the request, extended with the target file
+    QString sharingKey() const override;
+
 private:
     class Private;
     QScopedPointer<Private> d;
@@ -21,5 +35,15 @@ private:
     void onSentRequest(QNetworkReply* reply) override;
     void beforeAbandon() override;
     Status prepareResult() override;
+
+    void prepareRangeRequest();
+    void connectReply(QNetworkReply* reply, int segmentIndex);
+    void processHeaders(QNetworkReply* reply, int segmentIndex);
+    void abortRanges();
+    void startIdleSegments();
+    bool startRangeReply(int segmentIndex);
+    void processRangeReply(QNetworkReply* reply, int segmentIndex);
+    Status checkSegments();
+    Status finalise();
 };
 } // namespace Quotient
@@ -18,6 +18,11 @@
 
 #include "mediathumbnailjob.h"
 
+#include "backgroundtask.h"
+#include "mediacache.h"
+
+#include <QtCore/QStringBuilder>
+
 using namespace Quotient;
 
 QUrl MediaThumbnailJob::makeRequestUrl(QUrl baseUrl, const QUrl& mxcUri,
@@ -32,6 +37,8 @@ MediaThumbnailJob::MediaThumbnailJob(const QString& serverName,
                                      const QString& mediaId, QSize requestedSize)
     : GetContentThumbnailJob(serverName, mediaId, requestedSize.width(),
                              requestedSize.height(), "scale")
+    , _mediaId(serverName % '/' % mediaId)
+    , _requestedSize(requestedSize)
 {}
 
 MediaThumbnailJob::MediaThumbnailJob(const QUrl& mxcUri, QSize requestedSize)
@@ -48,10 +55,50 @@ QImage MediaThumbnailJob::scaledThumbnail(QSize toSize) const
                              Qt::SmoothTransformation);
 }
 
-BaseJob::Status MediaThumbnailJob::prepareResult()
+void MediaThumbnailJob::doPrepare()
 {
-    if (_thumbnail.loadFromData(data()->readAll()))
-        return Success;
+    const auto cachedFileName =
+        MediaCache::instance().findThumbnail(_mediaId, _requestedSize);
+    if (cachedFileName.isEmpty())
+        return;
+    // Images are decoded off the main thread
+    setStatus(Pending);
+    runInBackground(this, [cachedFileName] { return QImage(cachedFileName); },
+                    [this](QImage&& image) {
+                        if (status().code != Pending)
+                            return; // Abandoned meanwhile
+                        if (image.isNull()) {
+                            qCWarning(JOBS)
+                                << "Couldn't load the cached thumbnail of"
+                                << _mediaId;
+                            finishPreparation(Unprepared);
+                            return;
+                        }
+                        qCDebug(JOBS)
+                            << "Using the cached thumbnail of" << _mediaId;
+                        _thumbnail = std::move(image);
+                        finishPreparation(Success);
+                    });
+}
 
-    return { IncorrectResponse, QStringLiteral("Could not read image data") };
+BaseJob::Status MediaThumbnailJob::prepareResult()
+{
+    const auto imageData = data()->readAll();
+    runInBackground(
+        this, [imageData] { return QImage::fromData(imageData); },
+        [this, imageData](QImage&& image) {
+            if (status().code != Pending)
+                return; // Abandoned meanwhile
+            if (image.isNull()) {
+                finishDeferred({ IncorrectResponse,
+                                 QStringLiteral("Could not read image data") });
+                return;
+            }
+            _thumbnail = std::move(image);
+            if (_requestedSize.isValid())
+                MediaCache::instance().storeThumbnail(_mediaId, _requestedSize,
+                                                      imageData);
+            finishDeferred(Success);
+        });
+    return Pending; // See finishDeferred()
 }
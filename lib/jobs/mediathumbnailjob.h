@@ -37,9 +37,12 @@ public:
     QImage scaledThumbnail(QSize toSize) const;
 
 protected:
+    void doPrepare() override;
     Status prepareResult() override;
 
 private:
+    QString _mediaId;
+    QSize _requestedSize;
     QImage _thumbnail;
 };
 } // namespace Quotient
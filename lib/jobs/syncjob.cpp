@@ -40,6 +40,7 @@ SyncJob::SyncJob(const QString& since, const QString& filter, int timeout,
     setRequestQuery(query);
 
     setMaxRetries(std::numeric_limits<int>::max());
+    setRequestClass(RequestClass::Sync);
 }
 
 SyncJob::SyncJob(const QString& since, const Filter& filter, int timeout,
@@ -0,0 +1,533 @@
+#include "mediacache.h"
+
+#include "backgroundtask.h"
+#include "logging.h"
+#include "util.h"
+
+#include <QtCore/QCryptographicHash>
+#include <QtCore/QDateTime>
+#include <QtCore/QDir>
+#include <QtCore/QFile>
+#include <QtCore/QFileInfo>
+#include <QtCore/QJsonArray>
+#include <QtCore/QJsonDocument>
+#include <QtCore/QJsonObject>
+#include <QtCore/QMutexLocker>
+#include <QtCore/QSaveFile>
+#include <QtCore/QStringBuilder>
+
+#include <algorithm>
+
+using namespace Quotient;
+
+static const auto IndexFileName = QStringLiteral("index.json");
+static const auto IndexVersion = 1;
+
+namespace {
+QByteArray fileChecksum(const QString& fileName)
+{
+    QFile f(fileName);
+    if (!f.open(QIODevice::ReadOnly))
+        return {};
+    QCryptographicHash hash(QCryptographicHash::Sha256);
+    hash.addData(&f);
+    return hash.result().toHex();
+}
+
+QString makeFileName(const QString& mediaId, QSize thumbnailSize)
+{
+    auto key = mediaId;
+    if (thumbnailSize.isValid())
+        key += '#' % QString::number(thumbnailSize.width()) % 'x'
+               % QString::number(thumbnailSize.height());
+    return QCryptographicHash::hash(key.toUtf8(), QCryptographicHash::Sha1)
+        .toHex();
+}
+
+bool writeIndex(const QString& fileName, const QByteArray& json)
+{
+    QSaveFile indexFile(fileName);
+    if (!indexFile.open(QIODevice::WriteOnly) || indexFile.write(json) < 0
+        || !indexFile.commit()) {
+        qCWarning(MAIN) << "Couldn't save the media cache index:"
+                        << indexFile.errorString();
+        return false;
+    }
+    return true;
+}
+
+qint64 now() { return QDateTime::currentMSecsSinceEpoch(); }
+} // namespace
+
+MediaCache& MediaCache::instance()
+{
+    static MediaCache cache;
+    return cache;
+}
+
+MediaCache::MediaCache() : cachePath(cacheLocation(QStringLiteral("media")))
+{
+    ioPool.setMaxThreadCount(1);
+    saveTimer.setSingleShot(true);
+    saveTimer.setInterval(5000);
+    connect(&saveTimer, &QTimer::timeout, this, &MediaCache::saveIndex);
+    // This goes first in the queue, so no files are written before
+    // the index is read
+    runInBackground(
+        &ioPool, this,
+        [this] {
+            auto index = readIndex(cachePath);
+            QMutexLocker locker(&resultsLock);
+            loadedIndex.emplace(std::move(index));
+            return true;
+        },
+        [this](bool) { applyResults(); });
+}
+
+MediaCache::~MediaCache()
+{
+    // There's no event loop to deliver the results of the I/O thread any
+    // more; apply them here so that files stored right before exit make it
+    // to the index rather than get removed as unknown at the next start
+    ioPool.waitForDone();
+    applyResults();
+    saveTimer.stop();
+    ioPool.waitForDone(); // Files removed by eviction
+    if (indexDirty && indexLoaded)
+        writeIndex(cachePath % IndexFileName, serializeIndex());
+}
+
+QString MediaCache::find(const QString& mediaId)
+{
+    if (auto* e = findEntry(mediaId, {}))
+        return useEntry(mediaId, *e);
+    return {};
+}
+
+QString MediaCache::findThumbnail(const QString& mediaId, QSize minSize)
+{
+    const auto it = entries.find(mediaId);
+    if (it == entries.end())
+        return {};
+
+    Entry* best = nullptr;
+    const auto area = [](QSize s) { return qint64(s.width()) * s.height(); };
+    for (auto& e : *it) {
+        if (!e.thumbnailSize.isValid())
+            continue;
+        const auto fits = e.thumbnailSize.width() >= minSize.width()
+                          && e.thumbnailSize.height() >= minSize.height();
+        if (!best)
+            best = &e;
+        else {
+            const auto bestFits =
+                best->thumbnailSize.width() >= minSize.width()
+                && best->thumbnailSize.height() >= minSize.height();
+            // Prefer fitting thumbnails, the smallest of them; failing that,
+            // the biggest one
+            if (fits != bestFits ? fits
+                                 : (fits ? area(e.thumbnailSize)
+                                               < area(best->thumbnailSize)
+                                         : area(e.thumbnailSize)
+                                               > area(best->thumbnailSize)))
+                best = &e;
+        }
+    }
+    return best ? useEntry(mediaId, *best) : QString();
+}
+
+void MediaCache::store(const QString& mediaId, const QByteArray& data)
+{
+    write(mediaId, {}, data);
+}
+
+void MediaCache::storeFile(const QString& mediaId, const QString& fileName)
+{
+    dropEntry(mediaId, {});
+    const auto cachedFileName = makeFileName(mediaId, {});
+    runInBackground(
+        &ioPool, this,
+        [this, mediaId, fileName, cachedFileName, limit = limit] {
+            addFinishedStore({ mediaId,
+                               {},
+                               cachedFileName,
+                               copyFile(fileName, cachePath % cachedFileName,
+                                        limit) });
+            return true;
+        },
+        [this](bool) { applyResults(); });
+}
+
+auto MediaCache::copyFile(const QString& fileName, const QString& filePath,
+                          qint64 limit) -> StoredFile
+{
+    const auto size = QFileInfo(fileName).size();
+    if (size > limit) {
+        qCDebug(MAIN) << fileName << "is too big for the media cache";
+        return {};
+    }
+    QFile::remove(filePath);
+    if (!QFile::copy(fileName, filePath)) {
+        qCWarning(MAIN) << "Couldn't copy" << fileName << "to the media cache";
+        return {};
+    }
+    return { size, fileChecksum(filePath) };
+}
+
+void MediaCache::storeThumbnail(const QString& mediaId, QSize requestedSize,
+                                const QByteArray& data)
+{
+    Q_ASSERT(requestedSize.isValid());
+    write(mediaId, requestedSize, data);
+}
+
+void MediaCache::write(const QString& mediaId, QSize thumbnailSize,
+                       const QByteArray& data)
+{
+    if (data.size() > limit) {
+        qCDebug(MAIN) << "The data of" << mediaId
+                      << "are too big for the media cache";
+        return;
+    }
+    dropEntry(mediaId, thumbnailSize);
+    const auto cachedFileName = makeFileName(mediaId, thumbnailSize);
+    runInBackground(
+        &ioPool, this,
+        [this, mediaId, thumbnailSize, cachedFileName, data] {
+            addFinishedStore({ mediaId, thumbnailSize, cachedFileName,
+                               writeFile(cachePath % cachedFileName, data) });
+            return true;
+        },
+        [this](bool) { applyResults(); });
+}
+
+auto MediaCache::writeFile(const QString& filePath, const QByteArray& data)
+    -> StoredFile
+{
+    QSaveFile f(filePath);
+    if (!f.open(QIODevice::WriteOnly) || f.write(data) != data.size()
+        || !f.commit()) {
+        qCWarning(MAIN) << "Couldn't write" << filePath
+                        << "to the media cache:" << f.errorString();
+        return {};
+    }
+    return { data.size(),
+             QCryptographicHash::hash(data, QCryptographicHash::Sha256)
+                 .toHex() };
+}
+
+void MediaCache::addFinishedStore(FinishedStore store)
+{
+    QMutexLocker locker(&resultsLock);
+    finishedStores.push_back(std::move(store));
+}
+
+void MediaCache::applyResults()
+{
+    std::optional<Index> index;
+    std::vector<FinishedStore> stores;
+    {
+        QMutexLocker locker(&resultsLock);
+        index.swap(loadedIndex);
+        stores.swap(finishedStores);
+    }
+    if (index)
+        applyLoadedIndex(std::move(*index));
+    for (auto& s : stores)
+        addEntry(s.mediaId, s.thumbnailSize, s.fileName, std::move(s.stored));
+}
+
+void MediaCache::addEntry(const QString& mediaId, QSize thumbnailSize,
+                          const QString& fileName, StoredFile stored)
+{
+    if (stored.size < 0)
+        return;
+    dropEntry(mediaId, thumbnailSize); // If stored again meanwhile
+    Entry e;
+    e.thumbnailSize = thumbnailSize;
+    e.fileName = fileName;
+    e.size = stored.size;
+    e.checksum = std::move(stored.checksum);
+    e.lastUsed = now();
+    e.verified = true;
+    used += e.size;
+    entries[mediaId].push_back(std::move(e));
+    evict();
+    scheduleSave();
+}
+
+void MediaCache::remove(const QString& mediaId)
+{
+    if (!indexLoaded)
+        removedBeforeLoad.insert(mediaId);
+    const auto it = entries.find(mediaId);
+    if (it == entries.end())
+        return;
+    QStringList fileNames;
+    for (const auto& e : *it) {
+        fileNames.push_back(e.fileName);
+        used -= e.size;
+    }
+    entries.erase(it);
+    removeFiles(fileNames);
+    scheduleSave();
+}
+
+void MediaCache::clear()
+{
+    if (!indexLoaded) {
+        clearedBeforeLoad = true;
+        removedBeforeLoad.clear();
+    }
+    QStringList fileNames;
+    for (const auto& mediaEntries : qAsConst(entries))
+        for (const auto& e : mediaEntries)
+            fileNames.push_back(e.fileName);
+    entries.clear();
+    used = 0;
+    removeFiles(fileNames);
+    scheduleSave();
+}
+
+qint64 MediaCache::sizeLimit() const { return limit; }
+
+void MediaCache::setSizeLimit(qint64 bytes)
+{
+    limit = bytes;
+    if (used > limit) {
+        evict();
+        scheduleSave();
+    }
+}
+
+qint64 MediaCache::totalSize() const { return used; }
+
+MediaCache::Entry* MediaCache::findEntry(const QString& mediaId,
+                                         QSize thumbnailSize)
+{
+    const auto it = entries.find(mediaId);
+    if (it == entries.end())
+        return nullptr;
+    const auto entryIt = std::find_if(it->begin(), it->end(),
+                                      [thumbnailSize](const Entry& e) {
+                                          return e.thumbnailSize
+                                                 == thumbnailSize;
+                                      });
+    return entryIt != it->end() ? &*entryIt : nullptr;
+}
+
+QString MediaCache::useEntry(const QString& mediaId, Entry& entry)
+{
+    const QString fileName = cachePath % entry.fileName;
+    entry.lastUsed = now();
+    scheduleSave();
+    if (entry.verified || entry.verifying)
+        return fileName;
+
+    entry.verifying = true;
+    runInBackground(
+        &ioPool, this,
+        [fileName, size = entry.size, checksum = entry.checksum] {
+            const QFileInfo fi(fileName);
+            return fi.isFile() && fi.size() == size
+                   && fileChecksum(fileName) == checksum;
+        },
+        [this, mediaId, thumbnailSize = entry.thumbnailSize](bool good) {
+            auto* e = findEntry(mediaId, thumbnailSize);
+            if (!e || e->verified)
+                return; // Dropped or stored again meanwhile
+            e->verifying = false;
+            if (good) {
+                e->verified = true;
+                return;
+            }
+            qCWarning(MAIN) << "Dropping the corrupt cached file"
+                            << e->fileName << "for" << mediaId;
+            removeFiles({ e->fileName });
+            dropEntry(mediaId, thumbnailSize); // Invalidates e
+            scheduleSave();
+        });
+    return fileName;
+}
+
+void MediaCache::dropEntry(const QString& mediaId, QSize thumbnailSize)
+{
+    const auto it = entries.find(mediaId);
+    if (it == entries.end())
+        return;
+    auto& mediaEntries = *it;
+    const auto entryIt =
+        std::find_if(mediaEntries.begin(), mediaEntries.end(),
+                     [thumbnailSize](const Entry& e) {
+                         return e.thumbnailSize == thumbnailSize;
+                     });
+    if (entryIt == mediaEntries.end())
+        return;
+    used -= entryIt->size;
+    mediaEntries.erase(entryIt);
+    if (mediaEntries.empty())
+        entries.erase(it);
+    indexDirty = true;
+}
+
+void MediaCache::removeFiles(const QStringList& fileNames)
+{
+    if (fileNames.isEmpty())
+        return;
+    runInBackground(
+        &ioPool, this,
+        [path = cachePath, fileNames] {
+            int removed = 0;
+            for (const auto& f : fileNames)
+                removed += QFile::remove(path % f);
+            return removed;
+        },
+        [](int removed) {
+            qCDebug(MAIN) << removed << "file(s) removed from the media cache";
+        });
+}
+
+void MediaCache::evict()
+{
+    if (used <= limit)
+        return;
+
+    // Evict down to 90% of the limit, to not evict on every next insertion
+    struct Candidate {
+        qint64 lastUsed;
+        QString mediaId;
+        QSize thumbnailSize;
+        QString fileName;
+    };
+    std::vector<Candidate> candidates;
+    for (auto it = entries.cbegin(); it != entries.cend(); ++it)
+        for (const auto& e : *it)
+            candidates.push_back(
+                { e.lastUsed, it.key(), e.thumbnailSize, e.fileName });
+    std::sort(candidates.begin(), candidates.end(),
+              [](const Candidate& c1, const Candidate& c2) {
+                  return c1.lastUsed < c2.lastUsed;
+              });
+    const auto target = limit / 10 * 9;
+    QStringList evicted;
+    for (const auto& c : candidates) {
+        if (used <= target)
+            break;
+        evicted.push_back(c.fileName);
+        dropEntry(c.mediaId, c.thumbnailSize);
+    }
+    removeFiles(evicted);
+    qCDebug(MAIN) << "Media cache size after eviction:" << used << "bytes";
+}
+
+auto MediaCache::readIndex(const QString& cachePath) -> Index
+{
+    Index index;
+    QFile indexFile(cachePath % IndexFileName);
+    if (indexFile.open(QIODevice::ReadOnly)) {
+        const auto json = QJsonDocument::fromJson(indexFile.readAll()).object();
+        if (json.value("version"_ls).toInt() == IndexVersion) {
+            const auto jsonEntries = json.value("entries"_ls).toArray();
+            for (const auto& jv : jsonEntries) {
+                const auto je = jv.toObject();
+                Entry e;
+                if (je.contains("thumbnail_width"_ls))
+                    e.thumbnailSize = { je.value("thumbnail_width"_ls).toInt(),
+                                        je.value("thumbnail_height"_ls).toInt() };
+                e.fileName = je.value("file"_ls).toString();
+                e.size = qint64(je.value("size"_ls).toDouble());
+                e.checksum = je.value("sha256"_ls).toString().toLatin1();
+                e.lastUsed = qint64(je.value("last_used"_ls).toDouble());
+                if (e.fileName.isEmpty())
+                    continue;
+                index[je.value("media_id"_ls).toString()].push_back(e);
+            }
+        } else
+            qCWarning(MAIN) << "Unsupported media cache index version, "
+                               "discarding the media cache";
+    }
+
+    // Remove files that are not in the index, e.g. left after a crash
+    QSet<QString> knownFiles { IndexFileName };
+    for (const auto& mediaEntries : qAsConst(index))
+        for (const auto& e : mediaEntries)
+            knownFiles.insert(e.fileName);
+    int removed = 0;
+    const auto files = QDir(cachePath).entryList(QDir::Files);
+    for (const auto& f : files)
+        if (!knownFiles.contains(f))
+            removed += QFile::remove(cachePath % f);
+    if (removed > 0)
+        qCDebug(MAIN) << removed
+                      << "unknown file(s) removed from the media cache";
+    return index;
+}
+
+void MediaCache::applyLoadedIndex(Index&& index)
+{
+    indexLoaded = true;
+    QStringList droppedFiles;
+    for (auto it = index.begin(); it != index.end(); ++it)
+        for (auto& e : *it) {
+            // Entries stored again in this session use the same file names
+            if (findEntry(it.key(), e.thumbnailSize))
+                continue;
+            if (clearedBeforeLoad || removedBeforeLoad.contains(it.key())) {
+                droppedFiles.push_back(e.fileName);
+                continue;
+            }
+            used += e.size;
+            entries[it.key()].push_back(std::move(e));
+        }
+    clearedBeforeLoad = false;
+    removedBeforeLoad.clear();
+    removeFiles(droppedFiles);
+    evict();
+    if (indexDirty || !droppedFiles.isEmpty())
+        scheduleSave();
+}
+
+QByteArray MediaCache::serializeIndex() const
+{
+    QJsonArray jsonEntries;
+    for (auto it = entries.cbegin(); it != entries.cend(); ++it)
+        for (const auto& e : *it) {
+            QJsonObject je { { "media_id"_ls, it.key() },
+                             { "file"_ls, e.fileName },
+                             { "size"_ls, double(e.size) },
+                             { "sha256"_ls, QString::fromLatin1(e.checksum) },
+                             { "last_used"_ls, double(e.lastUsed) } };
+            if (e.thumbnailSize.isValid()) {
+                je.insert("thumbnail_width"_ls, e.thumbnailSize.width());
+                je.insert("thumbnail_height"_ls, e.thumbnailSize.height());
+            }
+            jsonEntries.push_back(je);
+        }
+    return QJsonDocument(QJsonObject { { "version"_ls, IndexVersion },
+                                       { "entries"_ls, jsonEntries } })
+        .toJson(QJsonDocument::Compact);
+}
+
+void MediaCache::scheduleSave()
+{
+    indexDirty = true;
+    // Changes coming in a row are saved together
+    if (!saveTimer.isActive())
+        saveTimer.start();
+}
+
+void MediaCache::saveIndex()
+{
+    if (!indexLoaded)
+        return; // The index will be saved once it's loaded, if still dirty
+    indexDirty = false;
+    runInBackground(&ioPool, this,
+                    [fileName = cachePath % IndexFileName,
+                     json = serializeIndex()] {
+                        return writeIndex(fileName, json);
+                    },
+                    [this](bool saved) {
+                        if (!saved)
+                            indexDirty = true; // Try again on exit
+                    });
+}
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <QtCore/QByteArray>
+#include <QtCore/QHash>
+#include <QtCore/QMutex>
+#include <QtCore/QObject>
+#include <QtCore/QSet>
+#include <QtCore/QSize>
+#include <QtCore/QString>
+#include <QtCore/QThreadPool>
+#include <QtCore/QTimer>
+
+#include <optional>
+#include <vector>
+
+namespace Quotient {
+/*! \brief An on-disk cache of media files and thumbnails
+ *
+ * Files are stored under cacheLocation("media"), named after a hash of
+ * the media id (`serverName/mediaId` from an mxc URI) and, for thumbnails,
+ * the requested thumbnail size. The cache keeps an index of its files with
+ * their sizes, checksums and last use times; once the total size exceeds
+ * the limit, least recently used files are evicted, and files bigger than
+ * the limit are not cached at all.
+ *
+ * Lookups only consult the index in memory. The index is loaded, and files
+ * are written, removed and checked, on a dedicated thread: files from
+ * earlier sessions can be found once the index is loaded, a stored file
+ * can be found once it's written, and a file is checked against its size
+ * and checksum after it's first looked up in a session, being dropped from
+ * the cache if it fails the check. The index is saved a few seconds after
+ * the last change, and on exit.
+ *
+ * The cache is shared by all connections of the application, and is not
+ * thread-safe: it should only be used from the main thread.
+ */
+class MediaCache : public QObject {
+public:
+    static MediaCache& instance();
+
+    MediaCache(const MediaCache&) = delete;
+    MediaCache& operator=(const MediaCache&) = delete;
+    ~MediaCache() override;
+
+    /// The path to the cached full media file, or an empty string
+    QString find(const QString& mediaId);
+    /*! \brief Find a cached thumbnail of the media
+     *
+     * \return the path to the smallest cached thumbnail requested with
+     *         a size at least as big as \p minSize in both dimensions;
+     *         if there's none, the biggest one; an empty string if
+     *         the media has no cached thumbnails at all
+     */
+    QString findThumbnail(const QString& mediaId, QSize minSize = {});
+
+    /// Store the full media
+    void store(const QString& mediaId, const QByteArray& data);
+    /// Store a copy of the file as the full media
+    void storeFile(const QString& mediaId, const QString& fileName);
+    /// Store the thumbnail of the media requested with the given size
+    void storeThumbnail(const QString& mediaId, QSize requestedSize,
+                        const QByteArray& data);
+
+    /// Remove the media and all its thumbnails from the cache
+    void remove(const QString& mediaId);
+    void clear();
+
+    qint64 sizeLimit() const;
+    /// Set the size limit, evicting files if needed
+    void setSizeLimit(qint64 bytes);
+    /// The total size of the cached files
+    qint64 totalSize() const;
+
+private:
+    MediaCache();
+
+    struct Entry {
+        QSize thumbnailSize; //< Invalid for the full media
+        QString fileName;
+        qint64 size = 0;
+        QByteArray checksum;
+        qint64 lastUsed = 0; //< Milliseconds since the epoch
+        bool verified = false; //< Checked against the checksum
+        bool verifying = false;
+    };
+    struct StoredFile {
+        qint64 size = -1; //< Negative if the file couldn't be stored
+        QByteArray checksum;
+    };
+    struct FinishedStore {
+        QString mediaId;
+        QSize thumbnailSize;
+        QString fileName;
+        StoredFile stored;
+    };
+    /// Entries by media ids
+    using Index = QHash<QString, std::vector<Entry>>;
+    Index entries;
+    QString cachePath;
+    qint64 limit = 256 * 1024 * 1024;
+    qint64 used = 0;
+    bool indexDirty = false;
+    bool indexLoaded = false;
+    /// Media removed before the index has been loaded
+    QSet<QString> removedBeforeLoad;
+    bool clearedBeforeLoad = false;
+    /// The thread for file operations, which are done in the order queued
+    QThreadPool ioPool;
+    QTimer saveTimer;
+    /// Results of the I/O thread that are not in the index yet
+    /**
+     * The I/O thread adds them here; the main thread moves them to
+     * the index as soon as it gets to it, or in the destructor on exit.
+     */
+    QMutex resultsLock;
+    std::optional<Index> loadedIndex;
+    std::vector<FinishedStore> finishedStores;
+
+    Entry* findEntry(const QString& mediaId, QSize thumbnailSize);
+    /// Mark the entry as used and have its file checked if not yet
+    /** \return the path to the file of the entry */
+    QString useEntry(const QString& mediaId, Entry& entry);
+    void write(const QString& mediaId, QSize thumbnailSize,
+               const QByteArray& data);
+    static StoredFile writeFile(const QString& filePath,
+                                const QByteArray& data);
+    static StoredFile copyFile(const QString& fileName,
+                               const QString& filePath, qint64 limit);
+    /// Record the result of storing a file; can be called from any thread
+    void addFinishedStore(FinishedStore store);
+    /// Move the results of the I/O thread to the index
+    void applyResults();
+    void addEntry(const QString& mediaId, QSize thumbnailSize,
+                  const QString& fileName, StoredFile stored);
+    void dropEntry(const QString& mediaId, QSize thumbnailSize);
+    void removeFiles(const QStringList& fileNames);
+    void evict();
+    /// Read the index and remove files not in it; runs on the I/O thread
+    static Index readIndex(const QString& cachePath);
+    void applyLoadedIndex(Index&& index);
+    QByteArray serializeIndex() const;
+    void scheduleSave();
+    void saveIndex();
+};
+} // namespace Quotient
@@ -0,0 +1,106 @@
+#include "mediaprefetcher.h"
+
+#include "connection.h"
+#include "logging.h"
+#include "mediacache.h"
+#include "room.h"
+
+#include "jobs/mediathumbnailjob.h"
+
+#include <algorithm>
+
+using namespace Quotient;
+
+MediaPrefetcher::MediaPrefetcher(Connection* connection)
+    : QObject(connection), connection(connection)
+{}
+
+int MediaPrefetcher::maxRunningRequests() const { return maxRunning; }
+
+void MediaPrefetcher::setMaxRunningRequests(int newMax)
+{
+    maxRunning = std::max(newMax, 1);
+    startNext();
+}
+
+int MediaPrefetcher::runningRequests() const { return running.size(); }
+
+int MediaPrefetcher::queuedRequests() const { return queue.size(); }
+
+QSize MediaPrefetcher::avatarSize() const { return avatarSz; }
+
+void MediaPrefetcher::setAvatarSize(QSize size) { avatarSz = size; }
+
+void MediaPrefetcher::prefetch(Room* room, const QVector<Item>& items)
+{
+    Q_ASSERT(room);
+    cancel(room);
+    for (const auto& item : items)
+        if (!item.mediaId.isEmpty())
+            queue.push_back({ room, item });
+    startNext();
+}
+
+void MediaPrefetcher::cancel(Room* room)
+{
+    queue.erase(std::remove_if(queue.begin(), queue.end(),
+                               [room](const Request& r) {
+                                   return r.room == room || !r.room;
+                               }),
+                queue.end());
+}
+
+void MediaPrefetcher::addForegroundRequest(const QString& mediaId,
+                                           BaseJob* job)
+{
+    // Whatever the user asked for needn't be prefetched anymore
+    queue.erase(std::remove_if(queue.begin(), queue.end(),
+                               [&mediaId](const Request& r) {
+                                   return r.item.mediaId == mediaId;
+                               }),
+                queue.end());
+    if (!isJobRunning(job) || foreground.contains(job))
+        return;
+    foreground.push_back(job);
+    connect(job, &BaseJob::finished, this, [this, job] {
+        foreground.erase(std::remove_if(foreground.begin(), foreground.end(),
+                                        [job](const QPointer<BaseJob>& j) {
+                                            return j == job || !j;
+                                        }),
+                         foreground.end());
+        startNext();
+    });
+}
+
+bool MediaPrefetcher::isPrefetching() const { return starting; }
+
+void MediaPrefetcher::startNext()
+{
+    while (foreground.isEmpty() && running.size() < maxRunning
+           && !queue.isEmpty()) {
+        const auto request = queue.takeFirst();
+        if (!request.room)
+            continue; // The room is gone already
+        const auto& item = request.item;
+        if (!MediaCache::instance().findThumbnail(item.mediaId, item.size)
+                 .isEmpty())
+            continue;
+
+        starting = true;
+        BaseJob* job = connection->getThumbnail(item.mediaId, item.size);
+        starting = false;
+        // A finished job means the thumbnail was served from the cache
+        if (!isJobRunning(job) || running.contains(job))
+            continue;
+        qCDebug(JOBS) << "Prefetching the thumbnail of" << item.mediaId;
+        running.push_back(job);
+        connect(job, &BaseJob::finished, this, [this, job] {
+            running.erase(std::remove_if(running.begin(), running.end(),
+                                         [job](const QPointer<BaseJob>& j) {
+                                             return j == job || !j;
+                                         }),
+                          running.end());
+            startNext();
+        });
+    }
+}
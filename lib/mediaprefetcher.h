@@ -0,0 +1,77 @@
+#pragma once
+
+#include <QtCore/QObject>
+#include <QtCore/QPointer>
+#include <QtCore/QSize>
+#include <QtCore/QVector>
+
+namespace Quotient {
+class BaseJob;
+class Connection;
+class Room;
+
+/*! \brief Fetches thumbnails for the timeline parts about to be displayed
+ *
+ * Rooms submit the thumbnails and avatars needed for the events just outside
+ * their displayed range, nearest ones first; the prefetcher gets them into
+ * MediaCache so that they are at hand when the UI asks for them. To not
+ * compete with what the user is waiting for, prefetch requests are sent
+ * in the Background request class rather than the Media one, at most
+ * maxRunningRequests() prefetches run at a time, and no new prefetch is
+ * started while a thumbnail or a download requested through Connection by
+ * anyone else is running. A prefetch that someone else asks for in
+ * the meantime moves to the Media class.
+ * \sa Connection::mediaPrefetcher
+ */
+class MediaPrefetcher : public QObject {
+    Q_OBJECT
+public:
+    struct Item {
+        QString mediaId;
+        QSize size;
+    };
+
+    explicit MediaPrefetcher(Connection* connection);
+
+    int maxRunningRequests() const;
+    void setMaxRunningRequests(int newMax);
+    int runningRequests() const;
+    int queuedRequests() const;
+    /// The size to prefetch avatars of event senders with
+    /** Set it to the size the UI shows avatars in the timeline with */
+    QSize avatarSize() const;
+    void setAvatarSize(QSize size);
+
+    /// Replace the queued prefetches of the room with \p items
+    /** Items are fetched in the order given, unless already cached */
+    void prefetch(Room* room, const QVector<Item>& items);
+    /// Drop the queued prefetches of the room
+    /** Running prefetches are left to complete, to not waste the traffic */
+    void cancel(Room* room);
+
+    /// Hold off prefetching until \p job finishes
+    /**
+     * Connection calls this for the media requests it makes, except those
+     * made on behalf of the prefetcher itself.
+     */
+    void addForegroundRequest(const QString& mediaId, BaseJob* job);
+    /// Whether the prefetcher is making a request through Connection
+    bool isPrefetching() const;
+
+private:
+    struct Request {
+        QPointer<Room> room;
+        Item item;
+    };
+
+    Connection* connection;
+    QVector<Request> queue;
+    QVector<QPointer<BaseJob>> running;
+    QVector<QPointer<BaseJob>> foreground;
+    int maxRunning = 2;
+    QSize avatarSz { 64, 64 };
+    bool starting = false;
+
+    void startNext();
+};
+} // namespace Quotient
@@ -0,0 +1,112 @@
+#include "memberloader.h"
+
+#include "backgroundtask.h"
+#include "connection.h"
+#include "logging.h"
+
+#include "csapi/rooms.h"
+
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QJsonDocument>
+#include <QtNetwork/QNetworkReply>
+
+using namespace Quotient;
+
+namespace {
+/// GetMembersByRoomJob that leaves the response body to MemberDecoder
+class RawMembersJob : public GetMembersByRoomJob {
+public:
+    RawMembersJob(const QString& roomId, const QString& at,
+                  const QString& membership)
+        : GetMembersByRoomJob(roomId, at, membership)
+    {
+        setParseJsonResponse(false);
+    }
+
+    QByteArray takeRawData() { return std::exchange(rawData, {}); }
+
+protected:
+    Status prepareResult() override
+    {
+        rawData = reply()->readAll();
+        return Success;
+    }
+
+private:
+    QByteArray rawData;
+};
+} // namespace
+
+/// Parse the response to GetMembersByRoomJob; runs on a worker thread
+static EventsArray<RoomMemberEvent> decodeMembers(QByteArray rawData)
+{
+    QElapsedTimer et;
+    et.start();
+    EventsArray<RoomMemberEvent> events;
+    {
+        QJsonParseError error { 0, QJsonParseError::MissingObject };
+        // Drop the raw data as soon as it's parsed
+        const auto doc = QJsonDocument::fromJson(std::exchange(rawData, {}),
+                                                 &error);
+        if (error.error == QJsonParseError::NoError)
+            events = fromJson<EventsArray<RoomMemberEvent>>(
+                doc.object().value("chunk"_ls));
+        else
+            qCWarning(MAIN) << "Could not parse the list of room members:"
+                            << error.errorString();
+    }
+    qCDebug(PROFILER) << "Decoded" << events.size() << "room member(s) in"
+                      << et;
+    return events;
+}
+
+MemberLoader::MemberLoader(Connection* connection, QString roomId,
+                           QString atToken, QStringList memberships,
+                           handler_t handler, QObject* parent)
+    : QObject(parent)
+    , connection(connection)
+    , roomId(std::move(roomId))
+    , atToken(std::move(atToken))
+    , memberships(std::move(memberships))
+    , handler(std::move(handler))
+{
+    loadNext();
+}
+
+MemberLoader::~MemberLoader()
+{
+    if (isJobRunning(job))
+        job->abandon();
+    // A running decoding drops its result when it's done
+}
+
+QString MemberLoader::membership() const { return currentMembership; }
+
+bool MemberLoader::isLoading() const { return isJobRunning(job) || decoding; }
+
+bool MemberLoader::loadNext()
+{
+    Q_ASSERT(!isLoading());
+    if (memberships.isEmpty() || !connection)
+        return false;
+
+    currentMembership = memberships.takeFirst();
+    auto* j = connection->callApi<RawMembersJob>(roomId, atToken,
+                                                 currentMembership);
+    job = j;
+    connect(j, &BaseJob::failure, this,
+            [this] { emit failed(currentMembership); });
+    connect(j, &BaseJob::success, this, [this, j] {
+        decoding = true;
+        runInBackground(
+            this,
+            [rawData = j->takeRawData()]() mutable {
+                return decodeMembers(std::move(rawData));
+            },
+            [this](EventsArray<RoomMemberEvent>&& events) {
+                decoding = false; // Allow the handler to call loadNext()
+                handler(std::move(events), currentMembership);
+            });
+    });
+    return true;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "events/roommemberevent.h"
+
+#include <QtCore/QObject>
+#include <QtCore/QPointer>
+#include <QtCore/QStringList>
+
+#include <functional>
+
+namespace Quotient {
+class Connection;
+class BaseJob;
+
+/*! \brief Loads the full list of room members in portions
+ *
+ * The loader requests members of the room with each of the given membership
+ * filters in turn, so that the members shown first (usually joined ones)
+ * arrive first. The responses are parsed and turned into events on a thread
+ * from QThreadPool::globalInstance(); the events are then passed to
+ * the handler on the thread the loader lives in, one membership at a time.
+ * The next membership is requested when the handler calls loadNext(), which
+ * allows to apply the events of a large room in slices before allocating
+ * memory for more.
+ */
+class MemberLoader : public QObject {
+    Q_OBJECT
+public:
+    using handler_t = std::function<void(EventsArray<RoomMemberEvent>&&,
+                                         const QString& membership)>;
+
+    /*! \brief Start loading members
+     *
+     * \param atToken the sync batch token to get the membership as of
+     * \param memberships membership filters to request members with, in
+     *                    the order of requests
+     */
+    MemberLoader(Connection* connection, QString roomId, QString atToken,
+                 QStringList memberships, handler_t handler,
+                 QObject* parent = nullptr);
+    ~MemberLoader() override;
+
+    /// The membership filter of the current request
+    QString membership() const;
+    /// Whether a request is running or its response is being decoded
+    bool isLoading() const;
+    /// Request members with the next membership filter
+    /** \return false if all memberships have been loaded already */
+    bool loadNext();
+
+signals:
+    /// Members with the current membership filter could not be loaded
+    void failed(QString membership);
+
+private:
+    QPointer<Connection> connection;
+    QString roomId;
+    QString atToken;
+    QStringList memberships;
+    handler_t handler;
+    QString currentMembership;
+    QPointer<BaseJob> job;
+    bool decoding = false;
+};
+} // namespace Quotient
@@ -0,0 +1,145 @@
+#include "membertable.h"
+
+#include "user.h"
+
+#include <QtCore/QJsonDocument>
+
+using namespace Quotient;
+
+int StringPool::acquire(const QString& s)
+{
+    if (s.isEmpty())
+        return -1;
+
+    if (const auto it = ids.constFind(s); it != ids.cend()) {
+        ++refCounts[*it];
+        return *it;
+    }
+    int id;
+    if (!freeIds.isEmpty()) {
+        id = freeIds.takeLast();
+        strings[id] = s;
+        refCounts[id] = 1;
+    } else {
+        id = strings.size();
+        strings.push_back(s);
+        refCounts.push_back(1);
+    }
+    ids.insert(s, id);
+    return id;
+}
+
+void StringPool::release(int id)
+{
+    if (id < 0)
+        return;
+
+    Q_ASSERT(id < strings.size() && refCounts[id] > 0);
+    if (--refCounts[id] == 0) {
+        ids.remove(strings[id]);
+        strings[id].clear();
+        freeIds.push_back(id);
+    }
+}
+
+QString StringPool::value(int id) const
+{
+    return id < 0 ? QString() : strings[id];
+}
+
+int StringPool::size() const { return ids.size(); }
+
+int MemberTable::size() const { return rows.size(); }
+
+bool MemberTable::contains(const QString& userId) const
+{
+    return rows.contains(userId);
+}
+
+void MemberTable::update(const RoomMemberEvent& evt)
+{
+    const auto& userId = evt.stateKey();
+    auto rowIt = rows.find(userId);
+    if (rowIt == rows.end()) {
+        rowIt = rows.insert(userId, memberships.size());
+        memberships.push_back(quint8(MembershipType::Leave));
+        displayNameIds.push_back(-1);
+        bestNameIds.push_back(-1);
+        avatarUrlIds.push_back(-1);
+        packedEvents.push_back({});
+    }
+    const auto row = *rowIt;
+    // Acquire new strings before releasing old ones, to keep ids of those
+    // that didn't change
+    const auto newDisplayNameId = names.acquire(evt.displayName());
+    const auto newBestNameId = names.acquire(getBestKnownName(&evt));
+    const auto newAvatarUrlId =
+        avatarUrls.acquire(getBestKnownAvatarUrl(&evt).toString());
+    names.release(std::exchange(displayNameIds[row], newDisplayNameId));
+    names.release(std::exchange(bestNameIds[row], newBestNameId));
+    avatarUrls.release(std::exchange(avatarUrlIds[row], newAvatarUrlId));
+    memberships[row] = quint8(evt.membership());
+    if (!packedEvents[row].isEmpty()) {
+        packedEvents[row].clear();
+        --packedEventsCount;
+    }
+}
+
+MembershipType MemberTable::membership(const QString& userId) const
+{
+    const auto row = rows.value(userId, -1);
+    return row < 0 ? MembershipType::Leave : MembershipType(memberships[row]);
+}
+
+QString MemberTable::displayName(const QString& userId) const
+{
+    const auto row = rows.value(userId, -1);
+    return row < 0 ? QString() : names.value(displayNameIds[row]);
+}
+
+QString MemberTable::bestKnownName(const QString& userId) const
+{
+    const auto row = rows.value(userId, -1);
+    return row < 0 ? QString() : names.value(bestNameIds[row]);
+}
+
+QUrl MemberTable::bestKnownAvatarUrl(const QString& userId) const
+{
+    const auto row = rows.value(userId, -1);
+    return row < 0 ? QUrl() : QUrl(avatarUrls.value(avatarUrlIds[row]));
+}
+
+void MemberTable::pack(const QString& userId, const QJsonObject& fullJson)
+{
+    const auto row = rows.value(userId, -1);
+    Q_ASSERT_X(row >= 0, __FUNCTION__, "Cannot pack an event of a non-member");
+    if (row < 0)
+        return;
+    if (packedEvents[row].isEmpty())
+        ++packedEventsCount;
+    packedEvents[row] = QJsonDocument(fullJson).toJson(QJsonDocument::Compact);
+}
+
+bool MemberTable::isPacked(const QString& userId) const
+{
+    const auto row = rows.value(userId, -1);
+    return row >= 0 && !packedEvents[row].isEmpty();
+}
+
+event_ptr_tt<RoomMemberEvent> MemberTable::unpack(const QString& userId)
+{
+    const auto row = rows.value(userId, -1);
+    if (row < 0 || packedEvents[row].isEmpty())
+        return nullptr;
+
+    --packedEventsCount;
+    return makeEvent<RoomMemberEvent>(
+        unpackJson(std::exchange(packedEvents[row], {})));
+}
+
+int MemberTable::packedCount() const { return packedEventsCount; }
+
+QJsonObject MemberTable::unpackJson(const QByteArray& packedJson)
+{
+    return QJsonDocument::fromJson(packedJson).object();
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include "events/roommemberevent.h"
+
+#include <QtCore/QByteArray>
+#include <QtCore/QHash>
+#include <QtCore/QVector>
+
+namespace Quotient {
+/// A set of unique strings referred to by integer ids
+/** Strings are reference-counted; the id of a string no more used
+ *  by anybody gets reused for another string. */
+class StringPool {
+public:
+    /// Get an id for the string, adding it to the pool if needed
+    /** \return -1 for an empty string, a non-negative id otherwise */
+    int acquire(const QString& s);
+    /// Release a reference obtained from acquire()
+    void release(int id);
+    QString value(int id) const;
+    int size() const;
+
+private:
+    QVector<QString> strings;
+    QVector<int> refCounts;
+    QHash<QString, int> ids;
+    QVector<int> freeIds;
+};
+
+/*! \brief Compact, column-wise storage of member states of a room
+ *
+ * The table has a row for each user that has a member event in the current
+ * state of the room, with the membership and the best known display name and
+ * avatar URL of the user; names and avatar URLs are kept in string pools
+ * since many members share them. This is enough to answer most questions
+ * about the members without looking at their events; the events themselves
+ * can be packed into the table, as compact JSON, and unpacked back when
+ * somebody needs them.
+ */
+class MemberTable {
+public:
+    int size() const;
+    bool contains(const QString& userId) const;
+
+    /// Update the row of the user from its current member event
+    /** This drops the packed event of the user, if there's one */
+    void update(const RoomMemberEvent& evt);
+
+    /// The membership of the user, or Leave if the user is unknown
+    MembershipType membership(const QString& userId) const;
+    /// The (sanitised) display name from the member event content
+    QString displayName(const QString& userId) const;
+    /// \sa getBestKnownName
+    QString bestKnownName(const QString& userId) const;
+    /// \sa getBestKnownAvatarUrl
+    QUrl bestKnownAvatarUrl(const QString& userId) const;
+
+    /// Store the member event of the user, serialised to compact JSON
+    void pack(const QString& userId, const QJsonObject& fullJson);
+    bool isPacked(const QString& userId) const;
+    /// Remove the packed event of the user from the table and return it
+    /** \return the event, or nullptr if there's no packed event */
+    event_ptr_tt<RoomMemberEvent> unpack(const QString& userId);
+    int packedCount() const;
+
+    /// Call \p fn with the full JSON of each packed event
+    template <typename FnT>
+    void forEachPacked(FnT fn) const
+    {
+        for (const auto& packedJson : packedEvents)
+            if (!packedJson.isEmpty())
+                fn(unpackJson(packedJson));
+    }
+
+private:
+    /// Row numbers by user ids; the only place where user ids are stored
+    QHash<QString, int> rows;
+    QVector<quint8> memberships;
+    QVector<int> displayNameIds;
+    QVector<int> bestNameIds;
+    QVector<int> avatarUrlIds;
+    QVector<QByteArray> packedEvents;
+    int packedEventsCount = 0;
+    StringPool names;
+    StringPool avatarUrls;
+
+    static QJsonObject unpackJson(const QByteArray& packedJson);
+};
+} // namespace Quotient
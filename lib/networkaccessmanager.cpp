@@ -18,7 +18,10 @@
 
 #include "networkaccessmanager.h"
 
+#include "util.h"
+
 #include <QtCore/QCoreApplication>
+#include <QtNetwork/QNetworkDiskCache>
 #include <QtNetwork/QNetworkReply>
 
 using namespace Quotient;
@@ -50,6 +53,11 @@ void NetworkAccessManager::clearIgnoredSslErrors()
 static NetworkAccessManager* createNam()
 {
     auto nam = new NetworkAccessManager(QCoreApplication::instance());
+    // Only jobs that enable BaseJob::setCacheable() store their responses here
+    auto* cache = new QNetworkDiskCache(nam);
+    cache->setCacheDirectory(cacheLocation(QStringLiteral("http")));
+    cache->setMaximumCacheSize(16 * 1024 * 1024);
+    nam->setCache(cache);
 #if (QT_VERSION < QT_VERSION_CHECK(5, 15, 0))
     // See #109; in newer Qt, bearer management is deprecated altogether
     NetworkAccessManager::connect(nam,
@@ -0,0 +1,123 @@
+#include "paginationscheduler.h"
+
+#include "logging.h"
+#include "room.h"
+
+#include "jobs/basejob.h"
+
+#include <algorithm>
+
+using namespace Quotient;
+
+PaginationScheduler::PaginationScheduler(QObject* parent) : QObject(parent)
+{}
+
+int PaginationScheduler::maxRunningRequests() const { return maxRunning; }
+
+void PaginationScheduler::setMaxRunningRequests(int newMax)
+{
+    maxRunning = std::max(newMax, 1);
+    startNext();
+}
+
+int PaginationScheduler::runningRequests() const { return running.size(); }
+
+int PaginationScheduler::queuedRequests() const { return queue.size(); }
+
+void PaginationScheduler::schedule(Room* room, int limit, starter_t starter,
+                                   bool prefetch, const QString& stream)
+{
+    Q_ASSERT(room && starter);
+    const auto runningIt = std::find_if(running.begin(), running.end(),
+                                        [room, &stream](const RunningRequest& r) {
+                                            return r.room == room
+                                                   && r.stream == stream;
+                                        });
+    if (runningIt != running.end()) {
+        runningIt->prefetch &= prefetch;
+        return;
+    }
+
+    const auto queuedIt =
+        std::find_if(queue.begin(), queue.end(), [room, &stream](const Request& r) {
+            return r.room == room && r.stream == stream;
+        });
+    if (queuedIt != queue.end()) {
+        queuedIt->limit = std::max(queuedIt->limit, limit);
+        // A prefetch should not take over an explicit request
+        if (!prefetch || queuedIt->prefetch)
+            queuedIt->starter = std::move(starter);
+        queuedIt->prefetch &= prefetch;
+    } else
+        queue.push_back({ room, limit, std::move(starter), prefetch, stream });
+
+    if (running.size() >= maxRunning)
+        qCDebug(JOBS) << "History request for" << room->objectName()
+                      << "is queued;" << running.size()
+                      << "history request(s) are already running";
+    startNext();
+}
+
+void PaginationScheduler::cancelPrefetch(Room* room)
+{
+    cancelMatching(room, [](bool prefetch, const QString&) { return prefetch; });
+}
+
+void PaginationScheduler::cancel(Room* room, const QString& stream)
+{
+    cancelMatching(room, [&stream](bool, const QString& s) {
+        return s == stream;
+    });
+}
+
+void PaginationScheduler::cancelMatching(
+    Room* room, const std::function<bool(bool, const QString&)>& pred)
+{
+    queue.erase(std::remove_if(queue.begin(), queue.end(),
+                               [room, &pred](const Request& r) {
+                                   return r.room == room
+                                          && pred(r.prefetch, r.stream);
+                               }),
+                queue.end());
+
+    // Abandoning a job emits finished(), which updates running; so collect
+    // the jobs before abandoning them
+    QVector<QPointer<BaseJob>> jobsToAbandon;
+    for (const auto& r : qAsConst(running))
+        if (r.room == room && pred(r.prefetch, r.stream))
+            jobsToAbandon.push_back(r.job);
+    for (const auto& j : qAsConst(jobsToAbandon))
+        if (isJobRunning(j)) {
+            qCDebug(JOBS) << "Cancelling a history request for"
+                          << room->objectName();
+            j->abandon();
+        }
+}
+
+void PaginationScheduler::startNext()
+{
+    while (running.size() < maxRunning && !queue.isEmpty()) {
+        auto it = std::find_if(queue.begin(), queue.end(),
+                               [](const Request& r) { return !r.prefetch; });
+        if (it == queue.end())
+            it = queue.begin();
+        const auto request = std::move(*it);
+        queue.erase(it);
+        if (!request.room)
+            continue; // The room is gone already
+
+        auto* job = request.starter(request.limit);
+        if (!isJobRunning(job))
+            continue;
+        running.push_back({ request.room, job, request.prefetch,
+                            request.stream });
+        connect(job, &BaseJob::finished, this, [this, job] {
+            running.erase(std::remove_if(running.begin(), running.end(),
+                                         [job](const RunningRequest& r) {
+                                             return r.job == job || !r.job;
+                                         }),
+                          running.end());
+            startNext();
+        });
+    }
+}
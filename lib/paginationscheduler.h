@@ -0,0 +1,82 @@
+#pragma once
+
+#include <QtCore/QObject>
+#include <QtCore/QPointer>
+#include <QtCore/QVector>
+
+#include <functional>
+
+namespace Quotient {
+class BaseJob;
+class Room;
+
+/*! \brief Limits the number of history requests running across rooms
+ *
+ * Rooms don't start their GetRoomEventsJob's directly; instead, they submit
+ * a function that starts the job to the scheduler of their connection, which
+ * calls it as soon as the number of running history requests drops below
+ * the limit. Explicit requests (Room::getPreviousContent) go first; history
+ * prefetched ahead of the displayed part of the timeline goes after them and
+ * can be cancelled when the room is no longer displayed.
+ *
+ * There's at most one history request per room and stream (the main
+ * timeline or e.g. a gap being filled), either queued or running; scheduling
+ * another one for the same room and stream merges it with the existing one.
+ * \sa Connection::paginationScheduler
+ */
+class PaginationScheduler : public QObject {
+    Q_OBJECT
+public:
+    /// A function that starts a history request for the given number of events
+    /** It can return nullptr if the request is no more needed */
+    using starter_t = std::function<BaseJob*(int limit)>;
+
+    explicit PaginationScheduler(QObject* parent = nullptr);
+
+    int maxRunningRequests() const;
+    void setMaxRunningRequests(int newMax);
+    int runningRequests() const;
+    int queuedRequests() const;
+
+    /// Queue a history request for the room
+    /**
+     * If there's a free slot, \p starter is called right away; otherwise it
+     * waits in the queue. If the room already has a request for \p stream
+     * queued, the queued
+     * request is updated to fetch at least \p limit events; if it has
+     * a request running, nothing is queued.
+     * Either way, a request that is not a prefetch makes the existing one
+     * non-cancellable.
+     */
+    void schedule(Room* room, int limit, starter_t starter, bool prefetch,
+                  const QString& stream = {});
+    /// Drop the queued prefetches for the room and abandon the running ones
+    void cancelPrefetch(Room* room);
+    /// Drop the queued request for the room and stream or abandon it if running
+    /** Unlike cancelPrefetch(), this cancels explicit requests too */
+    void cancel(Room* room, const QString& stream);
+
+private:
+    struct Request {
+        QPointer<Room> room;
+        int limit;
+        starter_t starter;
+        bool prefetch;
+        QString stream;
+    };
+    struct RunningRequest {
+        QPointer<Room> room;
+        QPointer<BaseJob> job;
+        bool prefetch;
+        QString stream;
+    };
+
+    QVector<Request> queue;
+    QVector<RunningRequest> running;
+    int maxRunning = 3;
+
+    void startNext();
+    void cancelMatching(Room* room,
+                        const std::function<bool(bool, const QString&)>& pred);
+};
+} // namespace Quotient
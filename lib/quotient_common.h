@@ -6,11 +6,22 @@ namespace Quotient {
 Q_NAMESPACE
 
 /** Enumeration with flags defining the network job running policy
- * So far only background/foreground flags are available.
+ * Besides the background/foreground flag, the policy can tell to share
+ * the job: if an identical GET request (same job type, endpoint and query)
+ * is already running on the connection, the running job is returned instead
+ * of starting a new one. Only share jobs whose results can be read by
+ * several callers, i.e. not consumed by take*() or release*() methods;
+ * a shared job should be given up with BaseJob::release() rather than
+ * BaseJob::abandon(), so that it keeps running for its other requesters.
  *
- * \sa Connection::callApi, Connection::run
+ * \sa Connection::callApi, Connection::run, BaseJob::sharingKey
  */
-enum RunningPolicy { ForegroundRequest = 0x0, BackgroundRequest = 0x1 };
+enum RunningPolicy {
+    ForegroundRequest = 0x0,
+    BackgroundRequest = 0x1,
+    SharedForegroundRequest = 0x2,
+    SharedBackgroundRequest = 0x3
+};
 
 Q_ENUM_NS(RunningPolicy)
 
@@ -0,0 +1,290 @@
+#include "retryscheduler.h"
+
+#include "connectiondata.h"
+#include "logging.h"
+
+#include "jobs/basejob.h"
+
+#include <algorithm>
+#include <random>
+
+using namespace Quotient;
+using namespace std::chrono;
+
+static constexpr milliseconds InitialDelay = 5s;
+static constexpr milliseconds MaxDelay = 60s;
+static constexpr milliseconds QuickRetryJitter = 1s;
+/// The number of retries an endpoint can make in a burst
+static constexpr double BudgetSize = 10;
+/// Retries per second added to the budget of an endpoint
+static constexpr double BudgetRefillRate = 1. / 6;
+/// Consecutive network failures after which the circuit breaker opens
+static constexpr int BreakerThreshold = 5;
+static constexpr milliseconds InitialCooldown = 10s;
+static constexpr milliseconds MaxCooldown = 60s;
+/// Jobs held by the circuit breaker are released over this time once
+/// the homeserver responds again
+static constexpr milliseconds ReleaseSpread = 5s;
+
+namespace {
+struct CircuitBreaker {
+    int failures = 0;
+    bool open = false;
+    RetryScheduler::clock::time_point openUntil {};
+    milliseconds cooldown = InitialCooldown;
+    QPointer<BaseJob> probe; //< The retry sent after the cooldown
+};
+
+/// Circuit breakers by homeservers, shared by all connections
+QHash<QString, CircuitBreaker>& breakers()
+{
+    static QHash<QString, CircuitBreaker> b;
+    return b;
+}
+
+std::vector<RetryScheduler*>& allSchedulers()
+{
+    static std::vector<RetryScheduler*> s;
+    return s;
+}
+
+milliseconds jitter(milliseconds upTo)
+{
+    static std::mt19937 rng { std::random_device {}() };
+    return milliseconds(
+        std::uniform_int_distribution<milliseconds::rep>(0, upTo.count())(rng));
+}
+} // namespace
+
+RetryScheduler::RetryScheduler(ConnectionData* connection)
+    : connection(connection)
+{
+    timer.setSingleShot(true);
+    QObject::connect(&timer, &QTimer::timeout, [this] { processWaiting(); });
+    allSchedulers().push_back(this);
+}
+
+RetryScheduler::~RetryScheduler()
+{
+    auto& schedulers = allSchedulers();
+    schedulers.erase(std::remove(schedulers.begin(), schedulers.end(), this),
+                     schedulers.end());
+}
+
+milliseconds RetryScheduler::backoff(int attempt)
+{
+    const auto exponent = std::clamp(attempt - 1, 0, 16);
+    return std::min(InitialDelay * (1 << exponent), MaxDelay);
+}
+
+milliseconds RetryScheduler::schedule(BaseJob* job, int attempt, bool quick)
+{
+    Q_ASSERT(job);
+    const auto now = clock::now();
+    // Half of the backoff is fixed, the other half is random
+    const auto base = backoff(attempt);
+    auto delay = quick ? jitter(QuickRetryJitter) : base / 2 + jitter(base / 2);
+
+    const auto endpoint = job->objectName();
+    auto budgetIt = budgets.find(endpoint);
+    if (budgetIt == budgets.end())
+        budgetIt = budgets.insert(endpoint, { BudgetSize, now });
+    budgetIt->tokens =
+        std::min(BudgetSize,
+                 budgetIt->tokens
+                     + duration<double>(now - budgetIt->updatedAt).count()
+                           * BudgetRefillRate);
+    budgetIt->updatedAt = now;
+    // The budget can go into debt, spacing out the retries over it
+    budgetIt->tokens -= 1;
+    if (budgetIt->tokens < 0) {
+        const auto budgetDelay = duration_cast<milliseconds>(
+            duration<double>(-budgetIt->tokens / BudgetRefillRate));
+        if (budgetDelay > delay) {
+            ++stats.retriesOverBudget;
+            qCDebug(JOBS) << "Retry budget for" << endpoint
+                          << "is exhausted, postponing" << job;
+            delay = budgetDelay;
+        }
+    }
+
+    cancel(job);
+    waiting.push_back({ job, now + delay, now });
+    restartTimer();
+    return timeToRetry(job);
+}
+
+void RetryScheduler::cancel(const BaseJob* job)
+{
+    waiting.erase(std::remove_if(waiting.begin(), waiting.end(),
+                                 [job](const WaitingJob& w) {
+                                     return w.job == job || !w.job;
+                                 }),
+                  waiting.end());
+    if (waiting.empty())
+        timer.stop();
+}
+
+milliseconds RetryScheduler::timeToRetry(const BaseJob* job) const
+{
+    const auto it = std::find_if(waiting.cbegin(), waiting.cend(),
+                                 [job](const WaitingJob& w) {
+                                     return w.job == job;
+                                 });
+    if (it == waiting.cend())
+        return 0ms;
+    auto due = it->due;
+    const auto& breaker = breakers().value(homeserver());
+    if (breaker.open)
+        due = std::max(due, breaker.openUntil);
+    return std::max(duration_cast<milliseconds>(due - clock::now()), 0ms);
+}
+
+int RetryScheduler::waitingJobs() const { return int(waiting.size()); }
+
+void RetryScheduler::reportResponse()
+{
+    const auto server = homeserver();
+    auto& breaker = breakers()[server];
+    if (breaker.failures == 0 && !breaker.open)
+        return;
+
+    const auto wasOpen = breaker.open;
+    breaker = {};
+    if (!wasOpen)
+        return; // Waiting jobs keep their own schedule
+
+    qCInfo(JOBS) << server << "responds again, resuming waiting jobs";
+    for (auto* s : allSchedulers())
+        if (s->homeserver() == server)
+            s->releaseWaiting();
+}
+
+void RetryScheduler::reportNetworkFailure(const BaseJob* job)
+{
+    const auto server = homeserver();
+    auto& breaker = breakers()[server];
+    ++breaker.failures;
+    if (breaker.open) {
+        // Requests that were already running when the breaker opened don't
+        // count; only the probe decides on the next cooldown
+        if (breaker.probe.data() != job)
+            return;
+        breaker.cooldown = std::min(breaker.cooldown * 2, MaxCooldown);
+    } else if (breaker.failures < BreakerThreshold)
+        return;
+
+    breaker.open = true;
+    breaker.probe = nullptr;
+    breaker.openUntil = clock::now() + breaker.cooldown;
+    ++stats.circuitOpenings;
+    qCWarning(JOBS) << server << "seems unreachable, holding retries for"
+                    << breaker.cooldown.count() << "ms";
+    for (auto* s : allSchedulers())
+        if (s->homeserver() == server)
+            s->restartTimer();
+}
+
+void RetryScheduler::retryAll()
+{
+    timer.stop();
+    auto jobs = std::move(waiting);
+    waiting.clear();
+    std::stable_sort(jobs.begin(), jobs.end(),
+                     [](const WaitingJob& w1, const WaitingJob& w2) {
+                         return w1.due < w2.due;
+                     });
+    const auto now = clock::now();
+    for (const auto& w : jobs)
+        if (w.job)
+            resubmit(w, now);
+}
+
+const RetryScheduler::Metrics& RetryScheduler::metrics() const
+{
+    return stats;
+}
+
+QString RetryScheduler::homeserver() const
+{
+    return connection->baseUrl().authority();
+}
+
+void RetryScheduler::releaseWaiting()
+{
+    const auto now = clock::now();
+    for (auto& w : waiting)
+        w.due = std::min(w.due, now + jitter(ReleaseSpread));
+    restartTimer();
+}
+
+void RetryScheduler::resubmit(const WaitingJob& w, clock::time_point now)
+{
+    const auto waited = duration_cast<milliseconds>(now - w.scheduledAt);
+    ++stats.retriesTaken;
+    stats.timeWaiting += waited;
+    qCDebug(JOBS) << "Retrying" << w.job.data() << "after" << waited.count()
+                  << "ms";
+    connection->submit(w.job);
+}
+
+void RetryScheduler::processWaiting()
+{
+    const auto now = clock::now();
+    auto& breaker = breakers()[homeserver()];
+    if (breaker.open) {
+        if (now >= breaker.openUntil && !isJobRunning(breaker.probe)) {
+            // Send one retry to see if the homeserver is back
+            const auto it =
+                std::min_element(waiting.begin(), waiting.end(),
+                                 [](const WaitingJob& w1, const WaitingJob& w2) {
+                                     return w1.due < w2.due;
+                                 });
+            if (it != waiting.end() && it->job) {
+                const auto w = *it;
+                waiting.erase(it);
+                breaker.probe = w.job;
+                qCDebug(JOBS) << "Probing" << homeserver() << "with"
+                              << w.job.data();
+                resubmit(w, now);
+            }
+        }
+    } else {
+        std::vector<WaitingJob> dueJobs;
+        for (auto it = waiting.begin(); it != waiting.end();)
+            if (it->due <= now) {
+                dueJobs.push_back(*it);
+                it = waiting.erase(it);
+            } else
+                ++it;
+        for (const auto& w : dueJobs)
+            if (w.job)
+                resubmit(w, now);
+    }
+    restartTimer();
+}
+
+void RetryScheduler::restartTimer()
+{
+    waiting.erase(std::remove_if(waiting.begin(), waiting.end(),
+                                 [](const WaitingJob& w) { return !w.job; }),
+                  waiting.end());
+    if (waiting.empty()) {
+        timer.stop();
+        return;
+    }
+    const auto now = clock::now();
+    const auto& breaker = breakers().value(homeserver());
+    clock::time_point wakeAt;
+    if (!breaker.open)
+        wakeAt = std::min_element(waiting.cbegin(), waiting.cend(),
+                                  [](const WaitingJob& w1, const WaitingJob& w2) {
+                                      return w1.due < w2.due;
+                                  })
+                     ->due;
+    else if (now < breaker.openUntil)
+        wakeAt = breaker.openUntil;
+    else // Check on the probe from time to time, in case it's gone
+        wakeAt = isJobRunning(breaker.probe) ? now + InitialCooldown : now;
+    timer.start(std::max(duration_cast<milliseconds>(wakeAt - now), 0ms));
+}
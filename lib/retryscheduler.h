@@ -0,0 +1,102 @@
+#pragma once
+
+#include <QtCore/QHash>
+#include <QtCore/QPointer>
+#include <QtCore/QTimer>
+
+#include <chrono>
+#include <vector>
+
+namespace Quotient {
+class BaseJob;
+class ConnectionData;
+
+/*! \brief Schedules retries of the failed jobs of a connection
+ *
+ * Instead of each job waiting on its own timer, jobs hand their retries
+ * over to the scheduler of their connection, which spreads them in time and
+ * holds them back together when the homeserver is out of reach:
+ * - retry delays grow exponentially with the attempt number and are
+ *   jittered, so that jobs failed at the same time don't retry in lockstep;
+ * - each endpoint (job name) has a budget of retries that refills with
+ *   time; retries over the budget are postponed until it refills;
+ * - network failures are counted per homeserver, across all connections to
+ *   it; after several consecutive failures the circuit breaker opens and
+ *   retries are held until it cools down, after which a single retry probes
+ *   the homeserver. Once the homeserver responds to any request while
+ *   the breaker is open, the jobs held by it on all connections to that
+ *   homeserver are released, spread over a few seconds.
+ */
+class RetryScheduler {
+public:
+    using clock = std::chrono::steady_clock;
+
+    struct Metrics {
+        /// The number of retries made
+        int retriesTaken = 0;
+        /// The total time jobs have waited for their retries
+        std::chrono::milliseconds timeWaiting {};
+        /// The number of retries postponed due to exhausted budgets
+        int retriesOverBudget = 0;
+        /// The number of times the circuit breaker has opened
+        int circuitOpenings = 0;
+    };
+
+    explicit RetryScheduler(ConnectionData* connection);
+    ~RetryScheduler();
+    RetryScheduler(const RetryScheduler&) = delete;
+    RetryScheduler& operator=(const RetryScheduler&) = delete;
+
+    /// The delay before the given attempt, without the jitter
+    static std::chrono::milliseconds backoff(int attempt);
+
+    /// Schedule the next attempt of the job
+    /*!
+     * \param attempt the 1-based number of the retry
+     * \param quick whether the job may be retried without backing off, e.g.
+     *              after a timeout
+     * \return the expected delay before the retry
+     */
+    std::chrono::milliseconds schedule(BaseJob* job, int attempt,
+                                       bool quick = false);
+    /// Forget the job if it waits for a retry
+    void cancel(const BaseJob* job);
+    /// The time left until the job is retried; zero if it doesn't wait
+    std::chrono::milliseconds timeToRetry(const BaseJob* job) const;
+    int waitingJobs() const;
+
+    /// Note that the homeserver has responded to a request
+    void reportResponse();
+    /// Note that a request to the homeserver failed at the network level
+    void reportNetworkFailure(const BaseJob* job);
+    /// Retry all waiting jobs right away
+    /** Use this when the network becomes available */
+    void retryAll();
+
+    const Metrics& metrics() const;
+
+private:
+    struct WaitingJob {
+        QPointer<BaseJob> job;
+        clock::time_point due;
+        clock::time_point scheduledAt;
+    };
+    struct Budget {
+        double tokens;
+        clock::time_point updatedAt;
+    };
+
+    ConnectionData* connection;
+    std::vector<WaitingJob> waiting;
+    QHash<QString, Budget> budgets;
+    QTimer timer;
+    Metrics stats;
+
+    QString homeserver() const;
+    /// Bring the waiting jobs forward, spreading them over a short time
+    void releaseWaiting();
+    void resubmit(const WaitingJob& w, clock::time_point now);
+    void processWaiting();
+    void restartTimer();
+};
+} // namespace Quotient
@@ -19,14 +19,21 @@
 #include "room.h"
 
 #include "avatar.h"
+#include "backgroundtask.h"
 #include "connection.h"
 #include "converters.h"
 #include "e2ee.h"
+#include "mediaprefetcher.h"
+#include "memberloader.h"
+#include "membertable.h"
+#include "paginationscheduler.h"
+#include "searchindex.h"
 #include "syncdata.h"
 #include "user.h"
 
 #include "csapi/account-data.h"
 #include "csapi/banning.h"
+#include "csapi/event_context.h"
 #include "csapi/inviting.h"
 #include "csapi/kicking.h"
 #include "csapi/leaving.h"
@@ -58,17 +65,28 @@
 #include "jobs/postreadmarkersjob.h"
 #include "events/roomcanonicalaliasevent.h"
 
+#if QT_VERSION >= QT_VERSION_CHECK(5, 15, 0)
+#    include <QtCore/QCborValue>
+#endif
+
+#include <QtCore/QBuffer>
+#include <QtCore/QCollator>
 #include <QtCore/QDir>
+#include <QtCore/QElapsedTimer>
 #include <QtCore/QHash>
 #include <QtCore/QMimeDatabase>
 #include <QtCore/QPointer>
 #include <QtCore/QRegularExpression>
 #include <QtCore/QStringBuilder> // for efficient string concats (operator%)
 #include <QtCore/QTemporaryFile>
+#include <QtCore/QTimer>
 
+#include <algorithm>
 #include <array>
 #include <cmath>
+#include <deque>
 #include <functional>
+#include <map>
 
 #ifdef Quotient_E2EE_ENABLED
 #include <account.h> // QtOlm
@@ -93,7 +111,11 @@ public:
     using members_map_t = QMultiHash<QString, User*>;
 
     Private(Connection* c, QString id_, JoinState initialJoinState)
-        : q(nullptr), connection(c), id(move(id_)), joinState(initialJoinState)
+        : q(nullptr)
+        , connection(c)
+        , id(move(id_))
+        , joinState(initialJoinState)
+        , searchIndex(id)
     {}
 
     Room* q;
@@ -110,6 +132,17 @@ public:
     /// The state of the room at timeline position after-maxTimelineIndex()
     /// \sa Room::syncEdge
     QHash<StateEventKey, const StateEventBase*> currentState;
+    /// Member states in a compact form; in large rooms, member events from
+    /// baseState are packed into it and are out of baseState and currentState
+    /// until somebody asks for them. \sa packMembers, unpackMember
+    MemberTable memberTable;
+    /// Members with events in baseState that haven't been packed since
+    /// the last packMembers()
+    QStringList membersToPack;
+    /// Members whose current events have been given out by
+    /// Room::getCurrentState(); these events are never packed, so that
+    /// the pointers stay valid until the state actually changes
+    QSet<QString> exposedMembers;
     /// Servers with aliases for this room except the one of the local user
     /// \sa Room::remoteAliases
     QSet<QString> aliasServers;
@@ -121,26 +154,96 @@ public:
     // pointers. Not using QMultiHash, because we want to quickly return
     // a number of relations for a given event without enumerating them.
     QHash<QPair<QString, QString>, RelatedEvents> relations;
+    /// Reply index: ids of direct replies to an event, in timeline order
+    QHash<QString, QStringList> replies;
+    /// Reverse reply index: the id of the event a reply relates to
+    QHash<QString, QString> replyParents;
+    /// Reply parents that are not in the timeline, fetched from the server
+    UnorderedMap<QString, RoomEventPtr> fetchedReplyParents;
+    QHash<QString, QPointer<GetOneRoomEventJob>> replyParentJobs;
+    /// A part of the room history detached from the main timeline
+    struct TimelineSegment {
+        std::deque<RoomEventPtr> events; ///< Oldest first
+        QString backToken;
+        QString forwardToken;
+        QPointer<BaseJob> backJob;
+        QPointer<BaseJob> forwardJob;
+    };
+    std::map<int, TimelineSegment> segments;
+    /// Running loadEventContext() requests, by event id
+    QHash<QString, QPointer<GetEventContextJob>> eventContextJobs;
+    /// A map from event ids to ids of the detached segments holding them
+    QHash<QString, int> segmentsIndex;
+    int nextSegmentId = 0;
+    QVector<Gap> gaps;
+    bool insertFilledGaps = false;
+    /// Full-text index over the message events loaded to the timeline
+    SearchIndex searchIndex;
+    bool searchIndexChanged = false;
+    bool searchIndexSaveScheduled = false;
+    /// Texts waiting to be split into words for the search index
+    QVector<SearchIndex::Document> searchBacklog;
+    bool tokenizingSearchBacklog = false;
     QString displayname;
     Avatar avatar;
     int highlightCount = 0;
     int notificationCount = 0;
     members_map_t membersMap;
+    /// Joined members in the order of their names, see Room::sortedMembers()
+    /** Only the first sortedMembersCount entries are sorted; members added
+     * after that are appended and get sorted in one go when the list is
+     * needed, see sortAddedMembers() */
+    QVector<User*> sortedMembers;
+    /// Collation keys of member names, in parallel with sortedMembers
+    std::vector<QCollatorSortKey> memberSortKeys;
+    int sortedMembersCount = 0;
+    QCollator memberCollator;
     QList<User*> usersTyping;
     QMultiHash<QString, User*> eventIdReadUsers;
     QList<User*> usersInvited;
     QList<User*> membersLeft;
+    /// Bumped whenever the lists of members, invitees or former members,
+    /// the heroes or the join state change
+    uint membershipVersion = 0;
     int unreadMessages = 0;
+    /// Running totals of notable events, aligned with the timeline
+    /**
+     * notableTotals[i] - notableTotals[j] is the number of notable events
+     * at timeline positions (j, i]; notableTotalsBase stands for the total
+     * before the oldest event. Only the differences are meaningful, so
+     * historical events can be prepended without touching the existing
+     * totals.
+     * \sa countNotable, updateNotableTotals
+     */
+    std::deque<int> notableTotals;
+    int notableTotalsBase = 0;
     bool displayed = false;
+    bool batchNotifications = false;
+    bool batchReadReceipts = false;
+    /// Engaged while batched notifications are being collected
+    std::optional<RoomChangeSet> changeSet;
     QString firstDisplayedEventId;
     QString lastDisplayedEventId;
     QHash<const User*, QString> lastReadEventIds;
+    /// While engaged, setLastReadEvent() collects users here for
+    /// lastReadEventsChanged() instead of emitting per-user signals
+    std::optional<QSet<User*>> movedReadMarkers;
     QString serverReadMarker;
     TagsMap tags;
     UnorderedMap<QString, EventPtr> accountData;
     QString prevBatch;
     QPointer<GetRoomEventsJob> eventsHistoryJob;
-    QPointer<GetMembersByRoomJob> allMembersJob;
+    /// Scrolling speed towards older events, in events per second
+    double scrollVelocity = 0;
+    bool mediaPrefetchQueued = false;
+    QElapsedTimer scrollTimer;
+    TimelineItem::index_t lastFirstDisplayedIndex = 0;
+    QPointer<MemberLoader> memberLoader;
+    /// Members loaded by memberLoader, being applied in slices
+    EventsArray<RoomMemberEvent> loadedMembers;
+    size_t appliedMembers = 0;
+    /// The first timeline index after the point memberLoader loads members at
+    TimelineItem::index_t membersReplayIndex = 0;
 
     struct FileTransferPrivateInfo {
         FileTransferPrivateInfo() = default;
@@ -150,7 +253,9 @@ public:
             , job(j)
             , localFileInfo(fileName)
             , isUpload(isUploading)
-        {}
+        {
+            clock.start();
+        }
 
         FileTransferInfo::Status status = FileTransferInfo::None;
         QPointer<BaseJob> job = nullptr;
@@ -158,6 +263,8 @@ public:
         bool isUpload = false;
         qint64 progress = 0;
         qint64 total = -1;
+        /// The transfer rate over the last RateWindow milliseconds
+        qint64 bytesPerSecond = 0;
 
         void update(qint64 p, qint64 t)
         {
@@ -166,12 +273,42 @@ public:
                 if (p == 0)
                     p = -1;
             }
-            if (p != -1)
+            if (p != -1) {
                 qCDebug(PROFILER) << "Transfer progress:" << p << "/" << t
                                   << "=" << llround(double(p) / t * 100) << "%";
+                updateRate(p);
+            }
             progress = p;
             total = t;
         }
+
+    private:
+        static constexpr qint64 RateWindow = 3000;
+        struct RateSample {
+            qint64 msecs;
+            qint64 bytes;
+        };
+        QElapsedTimer clock {};
+        std::deque<RateSample> rateSamples {};
+
+        void updateRate(qint64 bytes)
+        {
+            if (!clock.isValid())
+                clock.start();
+            // Progress going back means the transfer has been restarted
+            if (!rateSamples.empty() && bytes < rateSamples.back().bytes)
+                rateSamples.clear();
+            const auto now = clock.elapsed();
+            rateSamples.push_back({ now, bytes });
+            while (rateSamples.size() > 2
+                   && now - rateSamples.front().msecs > RateWindow)
+                rateSamples.pop_front();
+            const auto& first = rateSamples.front();
+            bytesPerSecond = now > first.msecs
+                                 ? (bytes - first.bytes) * 1000
+                                       / (now - first.msecs)
+                                 : 0;
+        }
     };
     void failedTransfer(const QString& tid, const QString& errorMessage = {})
     {
@@ -184,6 +321,19 @@ public:
     /// A map from event/txn ids to information about the long operation;
     /// used for both download and upload operations
     QHash<QString, FileTransferPrivateInfo> fileTransfers;
+    /// Preparation of files posted with postFile(), by transaction ids;
+    /// the event is sent once the file is probed and uploaded, along with
+    /// its thumbnail if there's one
+    struct AttachmentPreparation {
+        bool probed = false;
+        QUrl fileUrl; //< Known once the file is uploaded
+        QPointer<BaseJob> thumbnailJob;
+    };
+    QHash<QString, AttachmentPreparation> attachments;
+    void attachmentProbed(const QString& txnId,
+                          const EventContent::LocalFileInfo& info,
+                          const QByteArray& thumbnailData);
+    void sendAttachmentIfReady(const QString& txnId);
 
     const RoomMessageEvent* getEventWithFile(const QString& eventId) const;
     QString fileNameToDownload(const RoomMessageEvent* event) const;
@@ -193,23 +343,52 @@ public:
     // void inviteUser(User* u); // We might get it at some point in time.
     void insertMemberIntoMap(User* u);
     void removeMemberFromMap(User* u);
+    QCollatorSortKey memberSortKey(const User* u) const;
+    /// Add the user to sortedMembers, to be sorted by its current room name
+    void addSortedMember(User* u);
+    /// Remove the user from sortedMembers
+    /** Should be called before the user's room name changes */
+    void removeSortedMember(User* u);
+    /// Put the members added since the last call to their places
+    void sortAddedMembers();
+
+    // The following emit the respective signals or, if batched
+    // notifications are being collected, add the change to changeSet;
+    // the matching "about to" signals are not emitted in the latter case
+    void notifyAddedMessages(TimelineItem::index_t from,
+                             TimelineItem::index_t to);
+    void notifyUpdatedEvent(const QString& eventId);
+    void notifyUserAdded(User* u);
+    void notifyUserRemoved(User* u);
+    void notifyMemberAboutToRename(User* u, const QString& newName);
+    void notifyMemberRenamed(User* u);
 
     // This updates the room displayname field (which is the way a room
     // should be shown in the room list); called whenever the list of
     // members, the room name (m.room.name) or canonical alias change.
     void updateDisplayname();
     // This is used by updateDisplayname() but only calculates the new name
-    // without any updates.
-    QString calculateDisplayname() const;
+    // without any updates; the heavy lifting is only done when the inputs
+    // have changed since the previous call, see displaynameCache.
+    QString calculateDisplayname();
 
     /// A point in the timeline corresponding to baseState
     rev_iter_t timelineBase() const { return q->findInTimeline(-1); }
 
-    void getPreviousContent(int limit = 10);
+    void getPreviousContent(int limit = 10, bool prefetch = false);
+    void updateScrollVelocity();
+    /// Request more history if scrolling may soon run out of loaded events
+    void prefetchHistory();
+    /// Prefetch thumbnails and avatars around the displayed events
+    /** The actual work is deferred to coalesce changes of the range */
+    void prefetchMedia();
+    void doPrefetchMedia();
 
-    const StateEventBase* getCurrentState(const StateEventKey& evtKey) const
+    const StateEventBase* getCurrentState(const StateEventKey& evtKey)
     {
         const auto* evt = currentState.value(evtKey, nullptr);
+        if (!evt && evtKey.first == RoomMemberEvent::matrixTypeId())
+            evt = unpackMember(evtKey.second);
         if (!evt) {
             if (stubbedState.find(evtKey) == stubbedState.end()) {
                 // In the absence of a real event, make a stub as-if an event
@@ -229,10 +408,13 @@ public:
     }
 
     template <typename EventT>
-    const EventT* getCurrentState(const QString& stateKey = {}) const
+    const EventT* getCurrentState(const QString& stateKey = {})
     {
         const StateEventKey evtKey { EventT::matrixTypeId(), stateKey };
         const auto* evt = currentState.value(evtKey, nullptr);
+        if constexpr (std::is_same_v<EventT, RoomMemberEvent>)
+            if (!evt)
+                evt = unpackMember(stateKey);
         if (!evt) {
             if (stubbedState.find(evtKey) == stubbedState.end()) {
                 // In the absence of a real event, make a stub as-if an event
@@ -282,6 +464,8 @@ public:
                 // Update baseState afterwards to make sure that the old state
                 // is valid and usable inside processStateEvent
                 changes |= q->processStateEvent(evt);
+                if (is<RoomMemberEvent>(evt))
+                    membersToPack.push_back(evt.stateKey());
                 baseState[{ evt.matrixType(), evt.stateKey() }] = move(eptr);
             }
             if (events.size() > 9 || et.nsecsElapsed() >= profilerMinNsecs())
@@ -312,12 +496,28 @@ public:
     void dropDuplicateEvents(RoomEvents& events) const;
 
     Changes setLastReadEvent(User* u, QString eventId);
+    /// Count notable events in the range of the timeline, in O(1)
+    int countNotable(Timeline::const_iterator from,
+                     Timeline::const_iterator to) const;
+    /// Account for an event at the position becoming (non-)notable
+    void updateNotableTotals(Timeline::size_type pos, bool wasNotable);
     void updateUnreadCount(const rev_iter_t& from, const rev_iter_t& to);
     Changes promoteReadMarker(User* u, const rev_iter_t& newMarker, bool force = false);
 
     Changes markMessagesAsRead(rev_iter_t upToMarker);
 
+    /// Whether there's a current state event (possibly packed) for the key
+    bool hasCurrentState(const StateEventKey& evtKey) const;
+    /// Pack member events from membersToPack into memberTable, in large rooms
+    void packMembers();
+    /// Put the packed member event of the user back to the room state
+    /** The event stays unpacked until the member state changes.
+     * \return the unpacked event, or nullptr if it was not packed */
+    const RoomMemberEvent* unpackMember(const QString& userId);
+
     void getAllMembers();
+    /// Apply loadedMembers for a limited time, rescheduling the rest
+    void applyLoadedMembers(const QString& membership);
 
     QString sendEvent(RoomEventPtr&& event);
 
@@ -366,6 +566,60 @@ public:
      */
     bool processReplacement(const RoomMessageEvent& newEvent);
 
+    /*! Add a timeline event to the reply index if it's a reply
+     *
+     * \p placement defines whether the reply is added after (Newer) or
+     * before (Older) the already indexed replies to the same event.
+     * \return the id of the event replied to; an empty string if \p evt
+     *         is not a reply
+     */
+    QString indexReply(const RoomEvent& evt, EventsPlacement placement);
+    /// Remove an event from the reply index, e.g. after redaction
+    void unindexReply(const QString& replyId);
+    void fetchReplyParent(const QString& parentId);
+
+    /*! Add paginated events to a detached segment
+     *
+     * \p events should be in the order of pagination, i.e. newest first
+     * if \p backwards is true and oldest first otherwise. If the events run
+     * into another segment or the main timeline, the segments get merged.
+     */
+    void addToSegment(int segmentId, RoomEvents&& events, bool backwards);
+    /// Merge a newer detached segment into the older one
+    void mergeSegments(int olderId, int newerId);
+    /*! Move the events of a detached segment to the main timeline
+     *
+     * This only works if the segment meets the history edge of the main
+     * timeline: either the events overlap, or the segment directly precedes
+     * the oldest loaded event (\p adjacent is true).
+     * \return true if the segment has been merged; false otherwise
+     */
+    bool mergeSegmentIntoTimeline(int segmentId, bool adjacent);
+    GetRoomEventsJob* startSegmentPagination(int segmentId, int limit,
+                                             bool backwards,
+                                             RunningPolicy policy);
+
+    /// Record a gap before the event, to be filled using the token
+    void addGap(const QString& afterEventId, const QString& prevBatchToken);
+    Gap* findGap(const QString& afterEventId);
+    Gap* findGapBySegment(int segmentId);
+    /// Schedule loading the next batch of events missing in the gap
+    void fillGap(const QString& afterEventId);
+    /// Mark the gap filled, inserting its events if the client opted in
+    void finishGap(const QString& afterEventId);
+    /// Move the events loaded into the gap to the main timeline
+    /** The gap is removed from the list of gaps after that */
+    void spliceGap(const QString& afterEventId);
+
+    /// Add the message text of a timeline item to the search index
+    void indexForSearch(const TimelineItem& ti);
+    /// Split the queued texts into words on a worker thread and index them
+    void tokenizeSearchBacklog();
+    void loadSearchIndex();
+    /// Save the search index after a while, collecting more changes
+    void scheduleSearchIndexSave();
+    void saveSearchIndex();
+
     void setTags(TagsMap&& newTags);
 
     QJsonObject toJson() const;
@@ -462,6 +716,17 @@ private:
     template <typename ContT>
     users_shortlist_t buildShortlist(const ContT& users) const;
     users_shortlist_t buildShortlist(const QStringList& userIds) const;
+
+    /// The inputs and the result of the last member-based display name
+    struct DisplaynameCache {
+        uint membershipVersion;
+        users_shortlist_t shortlist;
+        bool emptyRoom;
+        QStringList names;
+        int usersCountExceptLocal;
+        QString displayname;
+    };
+    Omittable<DisplaynameCache> displaynameCache;
 };
 
 decltype(Room::Private::baseState) Room::Private::stubbedState {};
@@ -474,9 +739,12 @@ Room::Room(Connection* connection, QString id, JoinState initialJoinState)
     // https://marcmutz.wordpress.com/translated-articles/pimp-my-pimpl-%E2%80%94-reloaded/
     d->q = this;
     d->displayname = d->calculateDisplayname(); // Set initial "Empty room" name
+    qRegisterMetaType<RoomChangeSet>(); // For queued changesBatched() handlers
     connectUntil(connection, &Connection::loadedRoomState, this, [this](Room* r) {
-        if (this == r)
+        if (this == r) {
+            d->loadSearchIndex();
             emit baseStateLoaded();
+        }
         return this == r; // loadedRoomState fires only once per room
     });
     qCDebug(STATE) << "New" << toCString(initialJoinState) << "Room:" << id;
@@ -581,7 +849,11 @@ QString Room::canonicalAlias() const
 
 QString Room::displayName() const { return d->displayname; }
 
-void Room::refreshDisplayName() { d->updateDisplayname(); }
+void Room::refreshDisplayName()
+{
+    d->displaynameCache = none;
+    d->updateDisplayname();
+}
 
 QString Room::topic() const
 {
@@ -618,8 +890,75 @@ User* Room::user(const QString& userId) const
 
 JoinState Room::memberJoinState(User* user) const
 {
-    return d->membersMap.contains(user->name(this), user) ? JoinState::Join
-                                                          : JoinState::Leave;
+    return d->memberTable.membership(user->id()) == MembershipType::Join
+               ? JoinState::Join
+               : JoinState::Leave;
+}
+
+QString Room::memberName(const QString& mxId) const
+{
+    return d->memberTable.bestKnownName(mxId);
+}
+
+QUrl Room::memberAvatarUrl(const QString& mxId) const
+{
+    return d->memberTable.bestKnownAvatarUrl(mxId);
+}
+
+bool Room::Private::hasCurrentState(const StateEventKey& evtKey) const
+{
+    return currentState.contains(evtKey)
+           || (evtKey.first == RoomMemberEvent::matrixTypeId()
+               && memberTable.isPacked(evtKey.second));
+}
+
+void Room::Private::packMembers()
+{
+    // Small rooms don't take much memory, and their events are quicker
+    // to get at when they are not packed
+    static constexpr int MinMembersToPack = 1000;
+    if (memberTable.size() < MinMembersToPack) {
+        membersToPack.clear();
+        return;
+    }
+
+    QElapsedTimer et;
+    et.start();
+    const auto packedBefore = memberTable.packedCount();
+    for (const auto& userId : qAsConst(membersToPack)) {
+        if (userId == connection->userId() || exposedMembers.contains(userId))
+            continue; // The local user's membership is looked at too often
+        const StateEventKey evtKey { RoomMemberEvent::matrixTypeId(), userId };
+        const auto baseIt = baseState.find(evtKey);
+        const auto curIt = currentState.find(evtKey);
+        // Only pack events that are still current and are not in the timeline
+        if (baseIt == baseState.end() || curIt == currentState.end()
+            || *curIt != baseIt->second.get())
+            continue;
+        memberTable.pack(userId, baseIt->second->fullJson());
+        currentState.erase(curIt);
+        baseState.erase(baseIt);
+    }
+    membersToPack.clear();
+    if (et.nsecsElapsed() > profilerMinNsecs() / 10)
+        qCDebug(PROFILER) << "Packed"
+                          << memberTable.packedCount() - packedBefore
+                          << "member event(s) in" << q->objectName() << "in"
+                          << et;
+}
+
+const RoomMemberEvent* Room::Private::unpackMember(const QString& userId)
+{
+    // Packing is an implementation detail; the state remains the same
+    auto evt = memberTable.unpack(userId);
+    if (!evt)
+        return nullptr;
+
+    const auto* const result = evt.get();
+    const StateEventKey evtKey { RoomMemberEvent::matrixTypeId(), userId };
+    currentState.insert(evtKey, result);
+    baseState[evtKey] = move(evt);
+    return result;
 }
 
 JoinState Room::joinState() const { return d->joinState; }
@@ -630,6 +969,7 @@ void Room::setJoinState(JoinState state)
     if (state == oldState)
         return;
     d->joinState = state;
+    ++d->membershipVersion;
     qCDebug(STATE) << "Room" << id() << "changed state: " << int(oldState)
                    << "->" << int(state);
     emit changed(Change::JoinStateChange);
@@ -644,8 +984,12 @@ Room::Changes Room::Private::setLastReadEvent(User* u, QString eventId)
     eventIdReadUsers.remove(storedId, u);
     eventIdReadUsers.insert(eventId, u);
     swap(storedId, eventId);
-    emit q->lastReadEventChanged(u);
-    emit q->readMarkerForUserMoved(u, eventId, storedId);
+    if (movedReadMarkers)
+        movedReadMarkers->insert(u);
+    else {
+        emit q->lastReadEventChanged(u);
+        emit q->readMarkerForUserMoved(u, eventId, storedId);
+    }
     if (isLocalUser(u)) {
         if (storedId != serverReadMarker)
             connection->callApi<PostReadMarkersJob>(BackgroundRequest, id,
@@ -656,6 +1000,42 @@ Room::Changes Room::Private::setLastReadEvent(User* u, QString eventId)
     return Change::NoChange;
 }
 
+int Room::Private::countNotable(Timeline::const_iterator from,
+                                Timeline::const_iterator to) const
+{
+    Q_ASSERT(from <= to);
+    Q_ASSERT(notableTotals.size() == timeline.size());
+    const auto totalBefore = [this](Timeline::const_iterator it) {
+        return it == timeline.cbegin()
+                   ? notableTotalsBase
+                   : notableTotals[Timeline::size_type(it - timeline.cbegin()) - 1];
+    };
+    return totalBefore(to) - totalBefore(from);
+}
+
+void Room::Private::updateNotableTotals(Timeline::size_type pos,
+                                        bool wasNotable)
+{
+    Q_ASSERT(pos < timeline.size());
+    const auto delta = int(isEventNotable(timeline[pos])) - int(wasNotable);
+    if (delta == 0)
+        return;
+
+    // Since only differences between totals matter, either the totals from
+    // pos onwards can be increased or those before pos can be decreased;
+    // pick the shorter side.
+    if (pos >= timeline.size() / 2)
+        for (auto it = notableTotals.begin() + pos; it != notableTotals.end();
+             ++it)
+            *it += delta;
+    else {
+        for (auto it = notableTotals.begin(); it != notableTotals.begin() + pos;
+             ++it)
+            *it -= delta;
+        notableTotalsBase -= delta;
+    }
+}
+
 void Room::Private::updateUnreadCount(const rev_iter_t& from,
                                       const rev_iter_t& to)
 {
@@ -678,8 +1058,7 @@ void Room::Private::updateUnreadCount(const rev_iter_t& from,
 
     QElapsedTimer et;
     et.start();
-    const auto newUnreadMessages =
-        count_if(from, to, std::bind(&Room::Private::isEventNotable, this, _1));
+    const auto newUnreadMessages = countNotable(to.base(), from.base());
     if (et.nsecsElapsed() > profilerMinNsecs() / 10)
         qCDebug(PROFILER) << "Counting gained unread messages took" << et;
 
@@ -725,9 +1104,7 @@ Room::Changes Room::Private::promoteReadMarker(User* u,
         const auto oldUnreadCount = unreadMessages;
         QElapsedTimer et;
         et.start();
-        unreadMessages =
-            int(count_if(eagerMarker, timeline.cend(),
-                         [this](const auto& ti) { return isEventNotable(ti); }));
+        unreadMessages = countNotable(eagerMarker, timeline.cend());
         if (et.nsecsElapsed() > profilerMinNsecs() / 10)
             qCDebug(PROFILER) << "Recounting unread messages took" << et;
 
@@ -870,33 +1247,587 @@ const Room::RelatedEvents Room::relatedEvents(const RoomEvent& evt,
     return relatedEvents(evt.id(), relType);
 }
 
+QStringList Room::replies(const QString& evtId) const
+{
+    return d->replies.value(evtId);
+}
+
+QString Room::replyParentId(const QString& replyId) const
+{
+    return d->replyParents.value(replyId);
+}
+
+const RoomEvent* Room::replyParent(const QString& replyId) const
+{
+    const auto parentId = replyParentId(replyId);
+    if (parentId.isEmpty())
+        return nullptr;
+
+    if (const auto it = findInTimeline(parentId); it != historyEdge())
+        return it->event();
+    if (const auto it = d->fetchedReplyParents.find(parentId);
+        it != d->fetchedReplyParents.cend())
+        return it->second.get();
+
+    d->fetchReplyParent(parentId);
+    return nullptr;
+}
+
+/// Get the id of the event \p evt replies to; empty if it's not a reply
+inline QString replyTargetId(const RoomEvent& evt)
+{
+    return evt.contentJson()
+        .value("m.relates_to"_ls)
+        .toObject()
+        .value(EventRelation::Reply())
+        .toObject()
+        .value(EventIdKeyL)
+        .toString();
+}
+
+QString Room::Private::indexReply(const RoomEvent& evt,
+                                  EventsPlacement placement)
+{
+    if (!fetchedReplyParents.empty())
+        fetchedReplyParents.erase(evt.id()); // Now it's in the timeline
+
+    auto parentId = replyTargetId(evt);
+    if (parentId.isEmpty() || replyParents.contains(evt.id()))
+        return {};
+
+    replyParents.insert(evt.id(), parentId);
+    auto& siblings = replies[parentId];
+    if (placement == Older)
+        siblings.prepend(evt.id());
+    else
+        siblings.append(evt.id());
+    return parentId;
+}
+
+void Room::Private::unindexReply(const QString& replyId)
+{
+    const auto parentId = replyParents.take(replyId);
+    if (parentId.isEmpty())
+        return;
+
+    const auto it = replies.find(parentId);
+    if (it == replies.end())
+        return;
+    it->removeOne(replyId);
+    if (it->isEmpty())
+        replies.erase(it);
+    notifyUpdatedEvent(parentId);
+}
+
+void Room::Private::fetchReplyParent(const QString& parentId)
+{
+    if (isJobRunning(replyParentJobs.value(parentId)))
+        return;
+
+    auto* job = connection->callApi<GetOneRoomEventJob>(BackgroundRequest, id,
+                                                        parentId);
+    replyParentJobs.insert(parentId, job);
+    connect(job, &BaseJob::finished, q,
+            [this, parentId] { replyParentJobs.remove(parentId); });
+    connect(job, &BaseJob::success, q, [this, job, parentId] {
+        // The parent may have come with the timeline in the meantime
+        if (eventsIndex.contains(parentId))
+            return;
+        auto evt = loadEvent<RoomEvent>(job->jsonData());
+        if (!evt || evt->id() != parentId) {
+            qCWarning(EVENTS) << "Unexpected reply to the request for event"
+                              << parentId << "in" << id;
+            return;
+        }
+        fetchedReplyParents[parentId] = move(evt);
+        for (const auto& replyId : replies.value(parentId))
+            notifyUpdatedEvent(replyId);
+    });
+}
+
+SearchHits Room::searchMessages(const QString& query, int limit) const
+{
+    return d->searchIndex.search(query, limit);
+}
+
+int Room::findSegment(const QString& evtId) const
+{
+    if (d->eventsIndex.contains(evtId))
+        return MainTimeline;
+    return d->segmentsIndex.value(evtId, NoSegment);
+}
+
+QVector<const RoomEvent*> Room::segmentEvents(int segmentId) const
+{
+    QVector<const RoomEvent*> result;
+    if (const auto segIt = d->segments.find(segmentId);
+        segIt != d->segments.cend()) {
+        result.reserve(int(segIt->second.events.size()));
+        for (const auto& e : segIt->second.events)
+            result.push_back(e.get());
+    }
+    return result;
+}
+
+void Room::loadEventContext(const QString& eventId, int limit)
+{
+    if (const auto segmentId = findSegment(eventId); segmentId != NoSegment) {
+        emit eventContextLoaded(eventId, segmentId);
+        return;
+    }
+
+    // The running request will emit eventContextLoaded() for this call too
+    if (isJobRunning(d->eventContextJobs.value(eventId)))
+        return;
+
+    auto* job = connection()->callApi<GetEventContextJob>(id(), eventId, limit);
+    d->eventContextJobs.insert(eventId, job);
+    connect(job, &BaseJob::finished, this,
+            [this, eventId] { d->eventContextJobs.remove(eventId); });
+    connect(job, &BaseJob::success, this, [this, job, eventId] {
+        if (findSegment(eventId) == NoSegment) { // Still not loaded
+            auto evt = job->event();
+            if (!evt || evt->id() != eventId) {
+                qCWarning(MESSAGES)
+                    << "Unexpected response when loading the context of"
+                    << eventId << "in" << objectName();
+                return;
+            }
+            const auto segmentId = d->nextSegmentId++;
+            auto& segment = d->segments[segmentId];
+            segment.backToken = job->begin();
+            segment.forwardToken = job->end();
+            segment.events.push_back(move(evt));
+            d->segmentsIndex.insert(eventId, segmentId);
+            d->addToSegment(segmentId, job->eventsBefore(), true);
+            // The segment may have been merged with another one by now
+            if (const auto newSegmentId = findSegment(eventId);
+                newSegmentId != MainTimeline)
+                d->addToSegment(newSegmentId, job->eventsAfter(), false);
+        }
+        emit eventContextLoaded(eventId, findSegment(eventId));
+    });
+}
+
+void Room::paginateSegment(int segmentId, int limit, bool backwards)
+{
+    d->startSegmentPagination(segmentId, limit, backwards, ForegroundRequest);
+}
+
+GetRoomEventsJob* Room::Private::startSegmentPagination(int segmentId,
+                                                        int limit,
+                                                        bool backwards,
+                                                        RunningPolicy policy)
+{
+    const auto segIt = segments.find(segmentId);
+    if (segIt == segments.end()) {
+        qCWarning(MESSAGES) << "No segment" << segmentId << "in" << id;
+        return nullptr;
+    }
+    auto& segment = segIt->second;
+    auto& job = backwards ? segment.backJob : segment.forwardJob;
+    const auto& token = backwards ? segment.backToken : segment.forwardToken;
+    if (isJobRunning(job) || token.isEmpty())
+        return nullptr;
+
+    auto* j = connection->callApi<GetRoomEventsJob>(
+        policy, id, token, backwards ? "b" : "f", "", limit);
+    job = j;
+    connect(j, &BaseJob::success, q, [this, j, segmentId, backwards] {
+        const auto segIt = segments.find(segmentId);
+        if (segIt == segments.end())
+            return; // Merged into something else in the meantime
+
+        auto events = j->chunk();
+        auto& token =
+            backwards ? segIt->second.backToken : segIt->second.forwardToken;
+        // An empty backwards batch means the beginning of the room history
+        token = backwards && events.empty() ? QString() : j->end();
+        addToSegment(segmentId, move(events), backwards);
+    });
+    return j;
+}
+
+QVector<Room::Gap> Room::gaps() const { return d->gaps; }
+
+bool Room::insertsFilledGaps() const { return d->insertFilledGaps; }
+
+void Room::setInsertFilledGaps(bool insert)
+{
+    d->insertFilledGaps = insert;
+    if (insert)
+        for (const auto& gap : QVector<Gap>(d->gaps))
+            if (gap.filled)
+                d->spliceGap(gap.afterEventId);
+}
+
+void Room::Private::addGap(const QString& afterEventId,
+                           const QString& prevBatchToken)
+{
+    Q_ASSERT(!timeline.empty());
+    const auto segmentId = nextSegmentId++;
+    segments[segmentId].backToken = prevBatchToken;
+    gaps.push_back({ timeline.back()->id(), afterEventId, segmentId, false });
+    qCDebug(MESSAGES) << "Limited timeline in" << id << "- recorded a gap"
+                      << "between" << timeline.back()->id() << "and"
+                      << afterEventId;
+    emit q->gapsChanged();
+}
+
+Room::Gap* Room::Private::findGap(const QString& afterEventId)
+{
+    const auto it = std::find_if(gaps.begin(), gaps.end(),
+                                 [&afterEventId](const Gap& g) {
+                                     return g.afterEventId == afterEventId;
+                                 });
+    return it != gaps.end() ? &*it : nullptr;
+}
+
+Room::Gap* Room::Private::findGapBySegment(int segmentId)
+{
+    const auto it = std::find_if(gaps.begin(), gaps.end(),
+                                 [segmentId](const Gap& g) {
+                                     return g.segmentId == segmentId;
+                                 });
+    return it != gaps.end() ? &*it : nullptr;
+}
+
+inline QString gapStream(const QString& afterEventId)
+{
+    return QStringLiteral("gap:") + afterEventId;
+}
+
+void Room::Private::fillGap(const QString& afterEventId)
+{
+    static constexpr int GapFillBatch = 50;
+    // Gaps in rooms that are not displayed are filled only when no explicit
+    // history requests are waiting, and are cancelled along with prefetches
+    connection->paginationScheduler()->schedule(
+        q, GapFillBatch,
+        [this, afterEventId](int limit) -> BaseJob* {
+            const auto* gap = findGap(afterEventId);
+            if (!gap || gap->filled)
+                return nullptr;
+            const auto segIt = segments.find(gap->segmentId);
+            if (segIt == segments.end() || segIt->second.backToken.isEmpty()) {
+                // Nothing more to load
+                finishGap(afterEventId);
+                return nullptr;
+            }
+            auto* job = startSegmentPagination(gap->segmentId, limit, true,
+                                               BackgroundRequest);
+            if (job)
+                connect(job, &BaseJob::success, q, [this, afterEventId] {
+                    if (findGap(afterEventId))
+                        fillGap(afterEventId);
+                });
+            return job;
+        },
+        !displayed, gapStream(afterEventId));
+}
+
+void Room::Private::finishGap(const QString& afterEventId)
+{
+    auto* gap = findGap(afterEventId);
+    if (!gap || gap->filled)
+        return;
+    if (insertFilledGaps) {
+        spliceGap(afterEventId);
+        return;
+    }
+    gap->filled = true;
+    emit q->gapFilled(afterEventId);
+    emit q->gapsChanged();
+}
+
+void Room::Private::spliceGap(const QString& afterEventId)
+{
+    const auto gapIt = std::find_if(gaps.begin(), gaps.end(),
+                                    [&afterEventId](const Gap& g) {
+                                        return g.afterEventId == afterEventId;
+                                    });
+    if (gapIt == gaps.end())
+        return;
+    const auto segmentId = gapIt->segmentId;
+    gaps.erase(gapIt);
+
+    RoomEvents gapEvents; // Oldest first
+    if (auto segNode = segments.extract(segmentId); !segNode.empty()) {
+        auto& segment = segNode.mapped();
+        for (auto* j : { segment.backJob.data(), segment.forwardJob.data() })
+            if (isJobRunning(j))
+                j->abandon();
+        for (auto& e : segment.events) {
+            segmentsIndex.remove(e->id());
+            if (!eventsIndex.contains(e->id()))
+                gapEvents.push_back(move(e));
+        }
+    }
+    const auto afterIt = eventsIndex.constFind(afterEventId);
+    if (!gapEvents.empty() && afterIt != eventsIndex.cend()) {
+        QElapsedTimer et;
+        et.start();
+        const auto atIndex = *afterIt;
+        const auto pos = Timeline::size_type(atIndex - q->minTimelineIndex());
+        Q_ASSERT(pos > 0); // The gap is always after some event
+        for (const auto& eptr : gapEvents) {
+            const auto& e = *eptr;
+            if (e.isStateEvent()
+                && !hasCurrentState({ e.matrixType(), e.stateKey() }))
+                q->processStateEvent(e);
+        }
+
+        if (!changeSet)
+            emit q->aboutToInsertMessages(gapEvents, atIndex);
+        // Take the events after the gap out of the timeline to insert
+        // the missing events in the usual way and then put them back;
+        // this increases their indices by the number of inserted events
+        RoomEvents newerEvents;
+        newerEvents.reserve(timeline.size() - pos);
+        for (auto it = timeline.begin() + Timeline::difference_type(pos);
+             it != timeline.end(); ++it) {
+            eventsIndex.remove((*it)->id());
+            newerEvents.push_back(it->replaceEvent({}));
+        }
+        timeline.erase(timeline.begin() + Timeline::difference_type(pos),
+                       timeline.end());
+        notableTotals.erase(notableTotals.begin()
+                                + std::deque<int>::difference_type(pos),
+                            notableTotals.end());
+        const auto insertedSize = moveEventsToTimeline(gapEvents, Newer);
+        // The events after the gap are not in the timeline yet, so that
+        // derived classes only get to process the inserted ones
+        q->onAddNewTimelineEvents(timeline.cend()
+                                  - Timeline::difference_type(insertedSize));
+        moveEventsToTimeline(newerEvents, Newer);
+        if (membersReplayIndex >= atIndex)
+            membersReplayIndex += TimelineItem::index_t(insertedSize);
+
+        const auto from = timeline.cbegin() + Timeline::difference_type(pos);
+        const auto to = from + Timeline::difference_type(insertedSize);
+        QSet<QString> replyParentIds;
+        for (auto it = from; it != to; ++it) {
+            if (const auto* reaction = it->viewAs<ReactionEvent>()) {
+                const auto& relation = reaction->relation();
+                relations[{ relation.eventId, relation.type }] << reaction;
+                notifyUpdatedEvent(relation.eventId);
+            }
+            if (const auto parentId = indexReply(**it, Newer);
+                !parentId.isEmpty())
+                replyParentIds.insert(parentId);
+            indexForSearch(*it);
+        }
+        // Replies from the gap have been appended to the lists of siblings;
+        // restore the timeline order
+        for (const auto& parentId : qAsConst(replyParentIds)) {
+            auto& siblings = replies[parentId];
+            std::stable_sort(siblings.begin(), siblings.end(),
+                             [this](const QString& id1, const QString& id2) {
+                                 return eventsIndex.value(id1)
+                                        < eventsIndex.value(id2);
+                             });
+            notifyUpdatedEvent(parentId);
+        }
+        notifyAddedMessages(atIndex, atIndex + int(insertedSize) - 1);
+        if (const auto revFrom = rev_iter_t(to); revFrom <= q->readMarker())
+            updateUnreadCount(revFrom, rev_iter_t(from));
+        qCDebug(MESSAGES) << "Inserted" << insertedSize
+                          << "event(s) from the gap before" << afterEventId
+                          << "in" << id << "in" << et;
+    }
+    emit q->segmentMerged(segmentId, MainTimeline);
+    emit q->gapFilled(afterEventId);
+    emit q->gapsChanged();
+}
+
+void Room::Private::indexForSearch(const TimelineItem& ti)
+{
+    const auto* msg = ti.viewAs<RoomMessageEvent>();
+    // Replacing events only carry the new content for their targets, which
+    // get reindexed in processReplacement()
+    if (!msg || msg->isRedacted() || !msg->replacedEvent().isEmpty())
+        return;
+    searchBacklog.push_back(
+        { msg->id(), msg->plainBody(), msg->originTimestamp() });
+    // Collect the whole batch of events being added before tokenizing
+    if (searchBacklog.size() == 1 && !tokenizingSearchBacklog)
+        QTimer::singleShot(0, q, [this] { tokenizeSearchBacklog(); });
+}
+
+void Room::Private::tokenizeSearchBacklog()
+{
+    if (searchBacklog.isEmpty() || tokenizingSearchBacklog)
+        return;
+
+    // Only one batch is tokenized at a time, so that a newer text of an event
+    // (e.g., after an edit) doesn't get overwritten with an older one
+    tokenizingSearchBacklog = true;
+    runInBackground(
+        q,
+        [documents = std::exchange(searchBacklog, {})]() mutable {
+            SearchIndex::tokenizeAll(documents);
+            return documents;
+        },
+        [this](QVector<SearchIndex::Document>&& documents) {
+            tokenizingSearchBacklog = false;
+            for (auto& d : documents) {
+                // Skip events redacted while their texts were tokenized
+                const auto it = q->findInTimeline(d.eventId);
+                if (it == q->historyEdge() || (*it)->isRedacted())
+                    continue;
+                searchIndex.addTokenized(std::move(d));
+                searchIndexChanged = true;
+            }
+            scheduleSearchIndexSave();
+            tokenizeSearchBacklog();
+        });
+}
+
+void Room::Private::loadSearchIndex()
+{
+    if (!connection->cacheState())
+        return;
+    const auto fileName = connection->stateCacheDir().filePath(
+        SearchIndex::fileNameForRoom(id));
+    if (!QFile::exists(fileName))
+        return;
+
+    QElapsedTimer et;
+    et.start();
+    searchIndex.loadFrom(SyncData::loadJson(fileName));
+    qCDebug(PROFILER) << "Search index for" << id << "loaded in" << et;
+}
+
+void Room::Private::scheduleSearchIndexSave()
+{
+    static constexpr auto SaveDelayMs = 5000;
+    if (!searchIndexChanged || searchIndexSaveScheduled)
+        return;
+    searchIndexSaveScheduled = true;
+    QTimer::singleShot(SaveDelayMs, q, [this] {
+        searchIndexSaveScheduled = false;
+        saveSearchIndex();
+    });
+}
+
+void Room::Private::saveSearchIndex()
+{
+    if (!searchIndexChanged || !connection->cacheState())
+        return;
+    // A forgotten room is no more in the room map and its index file has been
+    // removed already; don't bring it back
+    if (connection->room(id, JoinState::Join | JoinState::Invite
+                                 | JoinState::Leave)
+        != q)
+        return;
+
+    QFile outFile { connection->stateCacheDir().filePath(
+        SearchIndex::fileNameForRoom(id)) };
+    if (!outFile.open(QFile::WriteOnly)) {
+        qCWarning(MAIN) << "Error opening" << outFile.fileName() << ":"
+                        << outFile.errorString();
+        return;
+    }
+#if QT_VERSION >= QT_VERSION_CHECK(5, 15, 0)
+    const auto data = QCborValue::fromJsonValue(searchIndex.toJson()).toCbor();
+#else
+    const auto data = QJsonDocument(searchIndex.toJson()).toBinaryData();
+#endif
+    outFile.write(data.data(), data.size());
+    searchIndexChanged = false;
+    qCDebug(MAIN) << "Search index saved to" << outFile.fileName();
+}
+
 void Room::Private::getAllMembers()
 {
     // If already loaded or already loading, there's nothing to do here.
-    if (q->joinedCount() <= membersMap.size() || isJobRunning(allMembersJob))
+    if (q->joinedCount() <= membersMap.size() || memberLoader)
         return;
 
-    allMembersJob = connection->callApi<GetMembersByRoomJob>(
-        id, connection->nextBatchToken(), "join");
-    auto nextIndex = timeline.empty() ? 0 : timeline.back().index() + 1;
-    connect(allMembersJob, &BaseJob::success, q, [=] {
-        Q_ASSERT(timeline.empty() || nextIndex <= q->maxTimelineIndex() + 1);
-        auto roomChanges = updateStateFrom(allMembersJob->chunk());
-        // Replay member events that arrived after the point for which
-        // the full members list was requested.
-        if (!timeline.empty())
-            for (auto it = q->findInTimeline(nextIndex).base();
-                 it != timeline.cend(); ++it)
-                if (is<RoomMemberEvent>(**it))
-                    roomChanges |= q->processStateEvent(**it);
-        if (roomChanges & MembersChange)
-            emit q->memberListChanged();
-        emit q->allMembersLoaded();
+    // Joined members are shown first; invitees come after them
+    memberLoader = new MemberLoader(
+        connection, id, connection->nextBatchToken(),
+        { QStringLiteral("join"), QStringLiteral("invite") },
+        [this](EventsArray<RoomMemberEvent>&& events, const QString& membership) {
+            loadedMembers = std::move(events);
+            appliedMembers = 0;
+            applyLoadedMembers(membership);
+        },
+        q);
+    membersReplayIndex = timeline.empty() ? 0 : timeline.back().index() + 1;
+    connect(memberLoader, &MemberLoader::failed, q, [this] {
+        loadedMembers.clear();
+        memberLoader->deleteLater();
     });
 }
 
+void Room::Private::applyLoadedMembers(const QString& membership)
+{
+    // Leave the rest of a 60 Hz frame to the UI
+    static constexpr auto SliceBudgetNs = 8'000'000;
+    // Check the time once in a while, not on every event
+    static constexpr size_t CheckTimeEvery = 64;
+
+    QElapsedTimer et;
+    et.start();
+    Changes roomChanges = NoChange;
+    for (; appliedMembers < loadedMembers.size()
+           && (appliedMembers % CheckTimeEvery != 0
+               || et.nsecsElapsed() < SliceBudgetNs);
+         ++appliedMembers) {
+        // Same as updateStateFrom() but without logging every slice
+        auto& eptr = loadedMembers[appliedMembers];
+        roomChanges |= q->processStateEvent(*eptr);
+        membersToPack.push_back(eptr->stateKey());
+        baseState[{ eptr->matrixType(), eptr->stateKey() }] = move(eptr);
+    }
+    packMembers();
+    if (roomChanges & MembersChange)
+        emit q->memberListChanged();
+    emit q->membersLoadingProgress(membership, int(appliedMembers),
+                                   int(loadedMembers.size()));
+    if (appliedMembers < loadedMembers.size()) {
+        QTimer::singleShot(0, q, [this, membership] {
+            applyLoadedMembers(membership);
+        });
+        return;
+    }
+    loadedMembers.clear();
+
+    // Replay member events that arrived after the point for which
+    // the full members list was requested.
+    Q_ASSERT(timeline.empty() || membersReplayIndex <= q->maxTimelineIndex() + 1);
+    roomChanges = NoChange;
+    if (!timeline.empty())
+        for (auto it = q->findInTimeline(membersReplayIndex).base();
+             it != timeline.cend(); ++it)
+            if (is<RoomMemberEvent>(**it))
+                roomChanges |= q->processStateEvent(**it);
+    if (roomChanges & MembersChange)
+        emit q->memberListChanged();
+    if (membership == QStringLiteral("join"))
+        emit q->allMembersLoaded();
+
+    if (!memberLoader->loadNext())
+        memberLoader->deleteLater();
+}
+
 bool Room::displayed() const { return d->displayed; }
 
+bool Room::batchedNotifications() const { return d->batchNotifications; }
+
+void Room::setBatchedNotifications(bool batched)
+{
+    d->batchNotifications = batched;
+}
+
+bool Room::batchedReadReceipts() const { return d->batchReadReceipts; }
+
+void Room::setBatchedReadReceipts(bool batched)
+{
+    d->batchReadReceipts = batched;
+}
+
 void Room::setDisplayed(bool displayed)
 {
     if (d->displayed == displayed)
@@ -908,6 +1839,23 @@ void Room::setDisplayed(bool displayed)
         resetHighlightCount();
         resetNotificationCount();
         d->getAllMembers();
+        // Bump the priority of filling the gaps in this room
+        for (const auto& gap : QVector<Gap>(d->gaps))
+            if (!gap.filled)
+                d->fillGap(gap.afterEventId);
+        d->prefetchMedia();
+    } else {
+        d->scrollVelocity = 0;
+        auto* scheduler = connection()->paginationScheduler();
+        scheduler->cancelPrefetch(this);
+        // Gaps in a displayed room are filled with explicit requests;
+        // schedule them again as prefetches, at the lower priority
+        for (const auto& gap : QVector<Gap>(d->gaps))
+            if (!gap.filled) {
+                scheduler->cancel(this, gapStream(gap.afterEventId));
+                d->fillGap(gap.afterEventId);
+            }
+        connection()->mediaPrefetcher()->cancel(this);
     }
 }
 
@@ -925,6 +1873,9 @@ void Room::setFirstDisplayedEventId(const QString& eventId)
 
     d->firstDisplayedEventId = eventId;
     emit firstDisplayedEventChanged();
+    d->updateScrollVelocity();
+    d->prefetchHistory();
+    d->prefetchMedia();
 }
 
 void Room::setFirstDisplayedEvent(TimelineItem::index_t index)
@@ -947,6 +1898,7 @@ void Room::setLastDisplayedEventId(const QString& eventId)
 
     d->lastDisplayedEventId = eventId;
     emit lastDisplayedEventChanged();
+    d->prefetchMedia();
 }
 
 void Room::setLastDisplayedEvent(TimelineItem::index_t index)
@@ -1228,7 +2180,8 @@ FileTransferInfo Room::fileTransferInfo(const QString& id) const
              int(progress),
              int(total),
              QUrl::fromLocalFile(infoIt->localFileInfo.absolutePath()),
-             QUrl::fromLocalFile(infoIt->localFileInfo.absoluteFilePath()) };
+             QUrl::fromLocalFile(infoIt->localFileInfo.absoluteFilePath()),
+             int(std::min(infoIt->bytesPerSecond, qint64(INT_MAX))) };
 }
 
 QUrl Room::fileSource(const QString& id) const
@@ -1257,6 +2210,12 @@ QList<User*> Room::membersLeft() const { return d->membersLeft; }
 
 QList<User*> Room::users() const { return d->membersMap.values(); }
 
+QVector<User*> Room::sortedMembers() const
+{
+    d->sortAddedMembers();
+    return d->sortedMembers;
+}
+
 QStringList Room::memberNames() const
 {
     QStringList res;
@@ -1279,7 +2238,12 @@ bool Room::usesEncryption() const
 const StateEventBase* Room::getCurrentState(const QString& evtType,
                                             const QString& stateKey) const
 {
-    return d->getCurrentState({ evtType, stateKey });
+    const auto* evt = d->getCurrentState({ evtType, stateKey });
+    // Keep member events given out from being packed (stubs aren't packed)
+    if (evtType == RoomMemberEvent::matrixTypeId()
+        && d->currentState.value({ evtType, stateKey }) == evt)
+        d->exposedMembers.insert(stateKey);
+    return evt;
 }
 
 RoomEventPtr Room::decryptMessage(const EncryptedEvent& encryptedEvent)
@@ -1346,6 +2310,7 @@ Room::Changes Room::Private::setSummary(RoomSummary&& newSummary)
 {
     if (!summary.merge(newSummary))
         return Change::NoChange;
+    ++membershipVersion;
     qCDebug(STATE).nospace().noquote()
         << "Updated room summary for " << q->objectName() << ": " << summary;
     emit q->memberListChanged();
@@ -1354,8 +2319,7 @@ Room::Changes Room::Private::setSummary(RoomSummary&& newSummary)
 
 void Room::Private::insertMemberIntoMap(User* u)
 {
-    const auto userName =
-        getCurrentState<RoomMemberEvent>(u->id())->displayName();
+    const auto userName = memberTable.displayName(u->id());
     // If there is exactly one namesake of the added user, signal member
     // renaming for that other one because the two should be disambiguated now.
     const auto namesakes = membersMap.values(userName);
@@ -1368,31 +2332,180 @@ void Room::Private::insertMemberIntoMap(User* u)
         return;
     }
 
-    if (namesakes.size() == 1)
-        emit q->memberAboutToRename(namesakes.front(),
-                                    namesakes.front()->fullName(q));
+    if (namesakes.size() == 1) {
+        notifyMemberAboutToRename(namesakes.front(),
+                                  namesakes.front()->fullName(q));
+        removeSortedMember(namesakes.front());
+    }
     membersMap.insert(userName, u);
-    if (namesakes.size() == 1)
-        emit q->memberRenamed(namesakes.front());
+    ++membershipVersion;
+    addSortedMember(u);
+    if (namesakes.size() == 1) {
+        addSortedMember(namesakes.front());
+        notifyMemberRenamed(namesakes.front());
+    }
 }
 
 void Room::Private::removeMemberFromMap(User* u)
 {
-    const auto userName =
-        getCurrentState<RoomMemberEvent>(u->id())->displayName();
+    const auto userName = memberTable.displayName(u->id());
 
     User* namesake = nullptr;
     auto namesakes = membersMap.values(userName);
     if (namesakes.size() == 2) {
         namesake = namesakes.front() == u ? namesakes.back() : namesakes.front();
         Q_ASSERT_X(namesake != u, __FUNCTION__, "Room members list is broken");
-        emit q->memberAboutToRename(namesake, userName);
+        notifyMemberAboutToRename(namesake, userName);
+        removeSortedMember(namesake);
     }
+    removeSortedMember(u);
     membersMap.remove(userName, u);
+    ++membershipVersion;
     // If there was one namesake besides the removed user, signal member
     // renaming for it because it doesn't need to be disambiguated any more.
-    if (namesake)
-        emit q->memberRenamed(namesake);
+    if (namesake) {
+        addSortedMember(namesake);
+        notifyMemberRenamed(namesake);
+    }
+}
+
+QCollatorSortKey Room::Private::memberSortKey(const User* u) const
+{
+    // Same as in MemberSorter: ignore the leading @ of ids used as names
+    auto name = q->roomMembername(u);
+    if (name.startsWith('@'))
+        name.remove(0, 1);
+    return memberCollator.sortKey(name);
+}
+
+inline bool collatedBefore(const QCollatorSortKey& lhs,
+                           const QCollatorSortKey& rhs)
+{
+    return lhs.compare(rhs) < 0;
+}
+
+void Room::Private::addSortedMember(User* u)
+{
+    Q_ASSERT(memberSortKeys.size() == size_t(sortedMembers.size()));
+    // Inserting each member at its place would make loading a large room
+    // quadratic; so just append here and sort when the list is needed
+    memberSortKeys.push_back(memberSortKey(u));
+    sortedMembers.push_back(u);
+}
+
+void Room::Private::removeSortedMember(User* u)
+{
+    Q_ASSERT(memberSortKeys.size() == size_t(sortedMembers.size()));
+    const auto sortedEnd = memberSortKeys.cbegin() + sortedMembersCount;
+    const auto range = std::equal_range(memberSortKeys.cbegin(), sortedEnd,
+                                        memberSortKey(u), collatedBefore);
+    auto pos = int(range.first - memberSortKeys.cbegin());
+    const auto end = int(range.second - memberSortKeys.cbegin());
+    while (pos < end && sortedMembers[pos] != u)
+        ++pos;
+    if (pos == end) {
+        // Either not sorted yet or the name has changed behind our back
+        pos = sortedMembers.indexOf(u, sortedMembersCount);
+        if (pos == -1) {
+            qCWarning(STATE) << "Member" << u->id() << "is not where expected"
+                             << "in the sorted list of room"
+                             << q->objectName();
+            pos = sortedMembers.indexOf(u);
+        }
+        if (pos == -1)
+            return;
+    }
+    memberSortKeys.erase(memberSortKeys.cbegin() + pos);
+    sortedMembers.remove(pos);
+    if (pos < sortedMembersCount)
+        --sortedMembersCount;
+}
+
+void Room::Private::sortAddedMembers()
+{
+    Q_ASSERT(memberSortKeys.size() == size_t(sortedMembers.size()));
+    if (sortedMembersCount == sortedMembers.size())
+        return;
+
+    using entry_t = std::pair<QCollatorSortKey, User*>;
+    const auto byKey = [](const entry_t& lhs, const entry_t& rhs) {
+        return collatedBefore(lhs.first, rhs.first);
+    };
+    std::vector<entry_t> entries;
+    entries.reserve(memberSortKeys.size());
+    for (int i = 0; i < sortedMembers.size(); ++i)
+        entries.emplace_back(std::move(memberSortKeys[size_t(i)]),
+                             sortedMembers[i]);
+    // Namesakes (as far as the collator can tell) go in the order of arrival
+    const auto addedBegin = entries.begin() + sortedMembersCount;
+    std::stable_sort(addedBegin, entries.end(), byKey);
+    std::inplace_merge(entries.begin(), addedBegin, entries.end(), byKey);
+
+    memberSortKeys.clear();
+    for (int i = 0; i < int(entries.size()); ++i) {
+        memberSortKeys.push_back(std::move(entries[size_t(i)].first));
+        sortedMembers[i] = entries[size_t(i)].second;
+    }
+    sortedMembersCount = sortedMembers.size();
+}
+
+void Room::Private::notifyAddedMessages(TimelineItem::index_t from,
+                                        TimelineItem::index_t to)
+{
+    if (!changeSet) {
+        emit q->addedMessages(from, to);
+        return;
+    }
+    // Spans between local echoes come back to back; merge them
+    auto& ranges = changeSet->insertedRanges;
+    if (!ranges.empty() && ranges.back().second + 1 == from)
+        ranges.back().second = to;
+    else
+        ranges.push_back({ from, to });
+}
+
+void Room::Private::notifyUpdatedEvent(const QString& eventId)
+{
+    if (changeSet)
+        changeSet->updatedEventIds.insert(eventId);
+    else
+        emit q->updatedEvent(eventId);
+}
+
+void Room::Private::notifyUserAdded(User* u)
+{
+    if (!changeSet) {
+        emit q->userAdded(u);
+        return;
+    }
+    if (!changeSet->removedMembers.remove(u))
+        changeSet->addedMembers.insert(u);
+}
+
+void Room::Private::notifyUserRemoved(User* u)
+{
+    if (!changeSet) {
+        emit q->userRemoved(u);
+        return;
+    }
+    changeSet->renamedMembers.remove(u);
+    if (!changeSet->addedMembers.remove(u))
+        changeSet->removedMembers.insert(u);
+}
+
+void Room::Private::notifyMemberAboutToRename(User* u,
+                                              const QString& newName)
+{
+    if (!changeSet)
+        emit q->memberAboutToRename(u, newName);
+}
+
+void Room::Private::notifyMemberRenamed(User* u)
+{
+    if (changeSet)
+        changeSet->renamedMembers.insert(u);
+    else
+        emit q->memberRenamed(u);
 }
 
 inline auto makeErrorStr(const Event& e, QByteArray msg)
@@ -1423,10 +2536,17 @@ Room::Private::moveEventsToTimeline(RoomEventsRange events,
             !eventsIndex.contains(eId), __FUNCTION__,
             makeErrorStr(*e, "Event is already in the timeline; "
                              "incoming events were not properly deduplicated"));
-        if (placement == Older)
+        if (placement == Older) {
             timeline.emplace_front(move(e), --index);
-        else
+            notableTotals.push_front(notableTotalsBase);
+            notableTotalsBase -= int(isEventNotable(timeline.front()));
+        } else {
             timeline.emplace_back(move(e), ++index);
+            notableTotals.push_back(
+                (notableTotals.empty() ? notableTotalsBase
+                                       : notableTotals.back())
+                + int(isEventNotable(timeline.back())));
+        }
         eventsIndex.insert(eId, index);
         Q_ASSERT(q->findInTimeline(eId)->event()->id() == eId);
     }
@@ -1472,6 +2592,8 @@ QString Room::safeMemberName(const QString& userId) const
 
 void Room::updateData(SyncRoomData&& data, bool fromCache)
 {
+    if (d->batchNotifications)
+        d->changeSet.emplace();
     if (d->prevBatch.isEmpty())
         d->prevBatch = data.timelinePrevBatch;
     setJoinState(data.joinState);
@@ -1483,14 +2605,24 @@ void Room::updateData(SyncRoomData&& data, bool fromCache)
         roomChanges |= processAccountDataEvent(move(event));
 
     roomChanges |= d->updateStateFrom(data.state);
+    d->packMembers();
 
     if (!data.timeline.empty()) {
+        QString gapEndId;
+        if (data.timelineLimited && !fromCache && !d->timeline.empty()
+            && !data.timelinePrevBatch.isEmpty()
+            && !d->eventsIndex.contains(data.timeline.front()->id())) {
+            gapEndId = data.timeline.front()->id();
+            d->addGap(gapEndId, data.timelinePrevBatch);
+        }
         et.restart();
         roomChanges |= d->addNewMessageEvents(move(data.timeline));
         if (data.timeline.size() > 9 || et.nsecsElapsed() >= profilerMinNsecs())
             qCDebug(PROFILER)
                 << "*** Room::addNewMessageEvents():" << data.timeline.size()
                 << "event(s)," << et;
+        if (!gapEndId.isEmpty())
+            d->fillGap(gapEndId);
     }
     if (roomChanges & TopicChange)
         emit topicChanged();
@@ -1521,6 +2653,13 @@ void Room::updateData(SyncRoomData&& data, bool fromCache)
         d->notificationCount = data.notificationCount;
         emit notificationCountChanged();
     }
+    if (d->changeSet) {
+        // Stop collecting before emitting, so that changes made by
+        // the signal handlers are notified about in the usual way
+        const auto changeSet = *std::exchange(d->changeSet, none);
+        if (!changeSet.empty())
+            emit changesBatched(changeSet);
+    }
     if (roomChanges != Change::NoChange) {
         d->updateDisplayname();
         emit changed(roomChanges);
@@ -1654,6 +2793,14 @@ void Room::discardMessage(const QString& txnId)
                            });
     Q_ASSERT(it != d->unsyncedEvents.end());
     qCDebug(EVENTS) << "Discarding transaction" << txnId;
+    if (const auto stateIt = d->attachments.find(txnId);
+        stateIt != d->attachments.end()) {
+        // Forget the attachment first, so that it's not sent on abandoning
+        const auto thumbnailJob = stateIt->thumbnailJob;
+        d->attachments.erase(stateIt);
+        if (isJobRunning(thumbnailJob))
+            thumbnailJob->abandon();
+    }
     const auto& transferIt = d->fileTransfers.find(txnId);
     if (transferIt != d->fileTransfers.end()) {
         Q_ASSERT(transferIt->isUpload);
@@ -1706,10 +2853,37 @@ QString Room::postFile(const QString& plainText, const QUrl& localPath,
     QFileInfo localFile { localPath.toLocalFile() };
     Q_ASSERT(localFile.isFile());
 
+    // Reading the file can take a while; so the pending event is made from
+    // what the file name tells, and the rest is filled in once the file is
+    // probed on a worker thread (see Private::attachmentProbed())
     const auto txnId =
-        d->addAsPending(
-             makeEvent<RoomMessageEvent>(plainText, localFile, asGenericFile))
+        d->addAsPending(makeEvent<RoomMessageEvent>(
+                            plainText,
+                            EventContent::LocalFileInfo::guess(localFile),
+                            asGenericFile))
             ->transactionId();
+    d->attachments.insert(txnId, {});
+    runInBackground(
+        this,
+        [localFile, asGenericFile] {
+            static const QSize MaxThumbnailSize { 800, 600 };
+            auto info = EventContent::LocalFileInfo::probe(
+                localFile, asGenericFile ? QSize() : MaxThumbnailSize);
+            QByteArray thumbnailData;
+            if (!info.thumbnail.isNull()) {
+                QBuffer buffer(&thumbnailData);
+                buffer.open(QIODevice::WriteOnly);
+                info.thumbnail.save(&buffer, info.thumbnail.hasAlphaChannel()
+                                                 ? "PNG"
+                                                 : "JPEG");
+            }
+            return std::make_pair(std::move(info), std::move(thumbnailData));
+        },
+        [this, txnId](
+            std::pair<EventContent::LocalFileInfo, QByteArray> result) {
+            d->attachmentProbed(txnId, result.first, result.second);
+        });
+
     // Remote URL will only be known after upload; fill in the local path
     // to enable the preview while the event is pending.
     uploadFile(txnId, localPath);
@@ -1718,12 +2892,11 @@ QString Room::postFile(const QString& plainText, const QUrl& localPath,
     connect(this, &Room::fileTransferCompleted, transferJob,
             [this, txnId](const QString& id, const QUrl&, const QUrl& mxcUri) {
                 if (id == txnId) {
-                    auto it = findPendingEvent(txnId);
-                    if (it != d->unsyncedEvents.end()) {
-                        it->setFileUploaded(mxcUri);
-                        emit pendingEventChanged(
-                            int(it - d->unsyncedEvents.begin()));
-                        d->doSendEvent(it->get());
+                    const auto stateIt = d->attachments.find(txnId);
+                    if (stateIt != d->attachments.end()
+                        && findPendingEvent(txnId) != d->unsyncedEvents.end()) {
+                        stateIt->fileUrl = mxcUri;
+                        d->sendAttachmentIfReady(txnId);
                     } else {
                         // Normally in this situation we should instruct
                         // the media server to delete the file; alas, there's no
@@ -1737,6 +2910,13 @@ QString Room::postFile(const QString& plainText, const QUrl& localPath,
     connect(this, &Room::fileTransferCancelled, transferJob,
             [this, txnId](const QString& id) {
                 if (id == txnId) {
+                    if (const auto stateIt = d->attachments.find(txnId);
+                        stateIt != d->attachments.end()) {
+                        const auto thumbnailJob = stateIt->thumbnailJob;
+                        d->attachments.erase(stateIt);
+                        if (isJobRunning(thumbnailJob))
+                            thumbnailJob->abandon();
+                    }
                     auto it = findPendingEvent(txnId);
                     if (it != d->unsyncedEvents.end()) {
                         const auto idx = int(it - d->unsyncedEvents.begin());
@@ -1751,6 +2931,93 @@ QString Room::postFile(const QString& plainText, const QUrl& localPath,
     return txnId;
 }
 
+void Room::Private::attachmentProbed(const QString& txnId,
+                                     const EventContent::LocalFileInfo& info,
+                                     const QByteArray& thumbnailData)
+{
+    const auto stateIt = attachments.find(txnId);
+    if (stateIt == attachments.end())
+        return; // The event has been discarded meanwhile
+    auto it = q->findPendingEvent(txnId);
+    if (it == unsyncedEvents.end()) {
+        attachments.erase(stateIt);
+        return;
+    }
+    using namespace EventContent;
+    auto* rme = it->getAs<RoomMessageEvent>();
+    Q_ASSERT(rme && rme->hasFileContent());
+    rme->editContent([&info](TypedBase& ec) {
+        auto* fi = ec.fileInfo();
+        fi->mimeType = info.mimeType;
+        fi->payloadSize = info.file.size();
+        // This covers both images and videos
+        if (auto* ic = dynamic_cast<UrlWithThumbnailContent<ImageInfo>*>(&ec))
+            ic->imageSize = info.imageSize;
+    });
+    emit q->pendingEventChanged(int(it - unsyncedEvents.begin()));
+
+    if (!thumbnailData.isEmpty()) {
+        const auto thumbnailMimeType =
+            QMimeDatabase().mimeTypeForData(thumbnailData);
+        auto* buffer = new QBuffer();
+        buffer->setData(thumbnailData);
+        buffer->open(QIODevice::ReadOnly);
+        auto* job = connection->uploadContent(
+            buffer, QStringLiteral("thumbnail-") + info.file.fileName(),
+            thumbnailMimeType.name());
+        if (!job) {
+            delete buffer;
+            stateIt->probed = true;
+            sendAttachmentIfReady(txnId);
+            return;
+        }
+        stateIt->thumbnailJob = job;
+        Thumbnail thumbnail { QUrl(), thumbnailData.size(), thumbnailMimeType,
+                              info.thumbnail.size() };
+        // Abandoned jobs only emit finished(); the event should be sent
+        // without the thumbnail then, rather than stay pending forever
+        QObject::connect(job, &BaseJob::finished, q, [this, txnId, job,
+                                                      thumbnail]() mutable {
+            if (job->status().good()) {
+                thumbnail.url = job->contentUri();
+                auto it = q->findPendingEvent(txnId);
+                if (it != unsyncedEvents.end())
+                    it->getAs<RoomMessageEvent>()->editContent(
+                        [&thumbnail](TypedBase& ec) {
+                            if (auto* ic = dynamic_cast<
+                                    UrlWithThumbnailContent<ImageInfo>*>(&ec))
+                                ic->thumbnail = thumbnail;
+                        });
+            } else
+                qCWarning(MAIN) << "Couldn't upload the thumbnail for"
+                                << txnId << "- sending without it";
+            if (const auto stateIt = attachments.find(txnId);
+                stateIt != attachments.end())
+                stateIt->thumbnailJob = nullptr;
+            sendAttachmentIfReady(txnId);
+        });
+    }
+    stateIt->probed = true;
+    sendAttachmentIfReady(txnId);
+}
+
+void Room::Private::sendAttachmentIfReady(const QString& txnId)
+{
+    const auto stateIt = attachments.constFind(txnId);
+    if (stateIt == attachments.cend() || !stateIt->probed
+        || stateIt->fileUrl.isEmpty() || stateIt->thumbnailJob)
+        return;
+
+    const auto fileUrl = stateIt->fileUrl;
+    attachments.erase(stateIt);
+    auto it = q->findPendingEvent(txnId);
+    if (it == unsyncedEvents.end())
+        return; // Shouldn't happen but there's nothing to send
+    it->setFileUploaded(fileUrl);
+    emit q->pendingEventChanged(int(it - unsyncedEvents.begin()));
+    doSendEvent(it->get());
+}
+
 QString Room::postEvent(RoomEvent* event)
 {
     return d->sendEvent(RoomEventPtr(event));
@@ -1861,20 +3128,146 @@ void Room::hangupCall(const QString& callId)
 
 void Room::getPreviousContent(int limit) { d->getPreviousContent(limit); }
 
-void Room::Private::getPreviousContent(int limit)
+void Room::Private::getPreviousContent(int limit, bool prefetch)
 {
-    if (isJobRunning(eventsHistoryJob))
+    if (isJobRunning(eventsHistoryJob) && prefetch)
         return;
 
-    eventsHistoryJob =
-        connection->callApi<GetRoomEventsJob>(id, prevBatch, "b", "", limit);
-    emit q->eventsHistoryJobChanged();
-    connect(eventsHistoryJob, &BaseJob::success, q, [=] {
-        prevBatch = eventsHistoryJob->end();
-        addHistoricalMessageEvents(eventsHistoryJob->chunk());
+    // Requests from all rooms go through the connection-wide scheduler that
+    // limits the number of them running at once
+    connection->paginationScheduler()->schedule(
+        q, limit,
+        [this, prefetch](int actualLimit) -> BaseJob* {
+            if (isJobRunning(eventsHistoryJob))
+                return nullptr;
+
+            eventsHistoryJob = connection->callApi<GetRoomEventsJob>(
+                prefetch ? BackgroundRequest : ForegroundRequest, id,
+                prevBatch, "b", "", actualLimit);
+            emit q->eventsHistoryJobChanged();
+            connect(eventsHistoryJob, &BaseJob::success, q, [this] {
+                prevBatch = eventsHistoryJob->end();
+                const auto timelineSize = timeline.size();
+                addHistoricalMessageEvents(eventsHistoryJob->chunk());
+                // Keep prefetching if a fast scroll outran this batch
+                if (timeline.size() > timelineSize)
+                    prefetchHistory();
+            });
+            connect(eventsHistoryJob, &QObject::destroyed, q,
+                    &Room::eventsHistoryJobChanged);
+            return eventsHistoryJob;
+        },
+        prefetch);
+}
+
+void Room::Private::updateScrollVelocity()
+{
+    const auto marker = q->firstDisplayedMarker();
+    if (marker == q->historyEdge())
+        return;
+
+    const auto index = marker->index();
+    // Scrolling pauses longer than this are not considered as
+    // a continuation of the same scrolling movement
+    static constexpr qint64 MaxScrollPauseMs = 1000;
+    if (scrollTimer.isValid() && scrollTimer.elapsed() < MaxScrollPauseMs) {
+        const auto elapsedMs = std::max(scrollTimer.elapsed(), qint64(1));
+        const auto currentVelocity =
+            double(lastFirstDisplayedIndex - index) * 1000 / elapsedMs;
+        // Smooth the velocity to avoid prefetching on every jitter
+        scrollVelocity = (scrollVelocity + currentVelocity) / 2;
+    } else
+        scrollVelocity = 0;
+    scrollTimer.start();
+    lastFirstDisplayedIndex = index;
+}
+
+void Room::Private::prefetchHistory()
+{
+    if (!displayed || q->allHistoryLoaded())
+        return;
+    const auto marker = q->firstDisplayedMarker();
+    if (marker == q->historyEdge())
+        return;
+
+    // Keep enough events loaded above the displayed part of the timeline
+    // for a couple of seconds of scrolling at the current speed, and never
+    // less than a screenful or so
+    static constexpr int MinMargin = 30;
+    static constexpr double PrefetchHorizonSecs = 2;
+    static constexpr int MaxBatch = 100;
+    const auto loadedAbove = int(marker->index() - q->minTimelineIndex());
+    const auto wanted =
+        MinMargin + int(std::max(scrollVelocity, 0.) * PrefetchHorizonSecs);
+    if (loadedAbove >= wanted)
+        return;
+
+    qCDebug(MESSAGES) << "Prefetching history for" << q->objectName() << "-"
+                      << loadedAbove << "event(s) loaded above the viewport,"
+                      << "scrolling at" << scrollVelocity << "events/s";
+    getPreviousContent(std::clamp(wanted - loadedAbove, MinMargin, MaxBatch),
+                       true);
+}
+
+void Room::Private::prefetchMedia()
+{
+    if (!displayed || mediaPrefetchQueued)
+        return;
+    mediaPrefetchQueued = true;
+    QTimer::singleShot(0, q, [this] {
+        mediaPrefetchQueued = false;
+        doPrefetchMedia();
     });
-    connect(eventsHistoryJob, &QObject::destroyed, q,
-            &Room::eventsHistoryJobChanged);
+}
+
+void Room::Private::doPrefetchMedia()
+{
+    if (!displayed)
+        return;
+    const auto firstMarker = q->firstDisplayedMarker();
+    if (firstMarker == q->historyEdge())
+        return;
+    auto lastMarker = q->lastDisplayedMarker();
+    if (lastMarker == q->historyEdge())
+        lastMarker = firstMarker;
+    const auto first = std::min(firstMarker->index(), lastMarker->index());
+    const auto last = std::max(firstMarker->index(), lastMarker->index());
+
+    // Take events on both sides of the displayed range, nearest first;
+    // at the same distance, the side the user scrolls to goes first
+    static constexpr TimelineItem::index_t Margin = 20;
+    auto* prefetcher = connection->mediaPrefetcher();
+    QVector<MediaPrefetcher::Item> items;
+    QSet<QString> seenAvatars;
+    const auto addEvent = [&](TimelineItem::index_t index) {
+        if (!q->isValidIndex(index))
+            return;
+        const auto& ti = *q->findInTimeline(index);
+        if (const auto* user = q->user(ti->senderId())) {
+            const auto avatarId = user->avatarMediaId(q);
+            if (!avatarId.isEmpty() && !seenAvatars.contains(avatarId)) {
+                seenAvatars.insert(avatarId);
+                items.push_back({ avatarId, prefetcher->avatarSize() });
+            }
+        }
+        if (const auto* e = eventCast<const RoomMessageEvent>(ti.event());
+            e && e->hasThumbnail()) {
+            const auto* thumbnail = e->content()->thumbnailInfo();
+            if (thumbnail->imageSize.isValid())
+                items.push_back({ thumbnail->mediaId(), thumbnail->imageSize });
+        }
+    };
+    const auto scrollingUp = scrollVelocity > 0;
+    for (TimelineItem::index_t i = 1; i <= Margin; ++i) {
+        if (scrollingUp) {
+            addEvent(first - i);
+            addEvent(last + i);
+        } else {
+            addEvent(last + i);
+            addEvent(first - i);
+        }
+    }
+    prefetcher->prefetch(q, items);
 }
 
 void Room::inviteToRoom(const QString& memberId)
@@ -2006,8 +3399,9 @@ void Room::cancelFileTransfer(const QString& id)
                         << d->id;
         return;
     }
+    // Downloads may be shared with other requesters, don't abort them
     if (isJobRunning(it->job))
-        it->job->abandon();
+        it->job->release(this);
     d->fileTransfers.remove(id);
     emit fileTransferCancelled(id);
 }
@@ -2118,12 +3512,15 @@ bool Room::Private::processRedaction(const RedactionEvent& redaction)
 
     // Make a new event from the redacted JSON and put it in the timeline
     // instead of the redacted one. oldEvent will be deleted on return.
+    const auto wasNotable = isEventNotable(ti);
     auto oldEvent = ti.replaceEvent(makeRedacted(*ti, redaction));
+    updateNotableTotals(Timeline::size_type(*pIdx - q->minTimelineIndex()),
+                        wasNotable);
     qCDebug(EVENTS) << "Redacted" << oldEvent->id() << "with" << redaction.id();
     if (oldEvent->isStateEvent()) {
         const StateEventKey evtKey { oldEvent->matrixType(),
                                      oldEvent->stateKey() };
-        Q_ASSERT(currentState.contains(evtKey));
+        Q_ASSERT(hasCurrentState(evtKey));
         if (currentState.value(evtKey) == oldEvent.get()) {
             Q_ASSERT(ti.index() >= 0); // Historical states can't be in
                                        // currentState
@@ -2142,9 +3539,14 @@ bool Room::Private::processRedaction(const RedactionEvent& redaction)
             qMakePair(targetEvtId, EventRelation::Annotation());
         if (relations.contains(lookupKey)) {
             relations[lookupKey].removeOne(reaction);
-            emit q->updatedEvent(targetEvtId);
+            notifyUpdatedEvent(targetEvtId);
         }
     }
+    unindexReply(oldEvent->id());
+    if (searchIndex.removeEvent(oldEvent->id())) {
+        searchIndexChanged = true;
+        scheduleSearchIndexSave();
+    }
     q->onRedaction(*oldEvent, *ti);
     emit q->replacedEvent(ti.event(), rawPtr(oldEvent));
     return true;
@@ -2189,8 +3591,12 @@ bool Room::Private::processReplacement(const RoomMessageEvent& newEvent)
 
     // Make a new event from the redacted JSON and put it in the timeline
     // instead of the redacted one. oldEvent will be deleted on return.
+    const auto wasNotable = isEventNotable(ti);
     auto oldEvent = ti.replaceEvent(makeReplaced(*ti, newEvent));
+    updateNotableTotals(Timeline::size_type(*pIdx - q->minTimelineIndex()),
+                        wasNotable);
     qCDebug(STATE) << "Replaced" << oldEvent->id() << "with" << newEvent.id();
+    indexForSearch(ti);
     emit q->replacedEvent(ti.event(), rawPtr(oldEvent));
     return true;
 }
@@ -2285,13 +3691,14 @@ Room::Changes Room::Private::addNewMessageEvents(RoomEvents&& events)
 
         if (it != remoteEcho) {
             RoomEventsRange eventsSpan { it, remoteEcho };
-            emit q->aboutToAddNewMessages(eventsSpan);
+            if (!changeSet)
+                emit q->aboutToAddNewMessages(eventsSpan);
             auto insertedSize = moveEventsToTimeline(eventsSpan, Newer);
             totalInserted += insertedSize;
             auto firstInserted = timeline.cend() - insertedSize;
             q->onAddNewTimelineEvents(firstInserted);
-            emit q->addedMessages(firstInserted->index(),
-                                  timeline.back().index());
+            notifyAddedMessages(firstInserted->index(),
+                                timeline.back().index());
         }
         if (remoteEcho == events.end())
             break;
@@ -2303,7 +3710,10 @@ Room::Changes Room::Private::addNewMessageEvents(RoomEvents&& events)
             localEcho->setReachedServer(nextPendingEvt->id());
             emit q->pendingEventChanged(pendingEvtIdx);
         }
-        emit q->pendingEventAboutToMerge(nextPendingEvt, pendingEvtIdx);
+        if (changeSet)
+            changeSet->mergedPendingIndices.push_back(pendingEvtIdx);
+        else
+            emit q->pendingEventAboutToMerge(nextPendingEvt, pendingEvtIdx);
         qCDebug(MESSAGES) << "Merging pending event from transaction"
                          << nextPendingEvt->transactionId() << "into"
                          << nextPendingEvt->id();
@@ -2319,8 +3729,13 @@ Room::Changes Room::Private::addNewMessageEvents(RoomEvents&& events)
         if (auto insertedSize = moveEventsToTimeline({ remoteEcho, it }, Newer)) {
             totalInserted += insertedSize;
             q->onAddNewTimelineEvents(timeline.cend() - insertedSize);
+            // The merge itself tells about the event when not batching
+            if (changeSet)
+                notifyAddedMessages(timeline.back().index(),
+                                    timeline.back().index());
         }
-        emit q->pendingEventMerged();
+        if (!changeSet)
+            emit q->pendingEventMerged();
     }
     // Events merged and transferred from `events` to `timeline` now.
     const auto from = timeline.cend() - totalInserted;
@@ -2335,8 +3750,12 @@ Room::Changes Room::Private::addNewMessageEvents(RoomEvents&& events)
             if (const auto* reaction = it->viewAs<ReactionEvent>()) {
                 const auto& relation = reaction->relation();
                 relations[{ relation.eventId, relation.type }] << reaction;
-                emit q->updatedEvent(relation.eventId);
+                notifyUpdatedEvent(relation.eventId);
             }
+            if (const auto parentId = indexReply(**it, Newer);
+                !parentId.isEmpty())
+                notifyUpdatedEvent(parentId);
+            indexForSearch(*it);
         }
 
         qCDebug(MESSAGES) << "Room" << q->objectName() << "received"
@@ -2385,26 +3804,30 @@ void Room::Private::addHistoricalMessageEvents(RoomEvents&& events)
     for (const auto& eptr : events) {
         const auto& e = *eptr;
         if (e.isStateEvent()
-            && !currentState.contains({ e.matrixType(), e.stateKey() })) {
+            && !hasCurrentState({ e.matrixType(), e.stateKey() })) {
             q->processStateEvent(e);
         }
     }
 
-    emit q->aboutToAddHistoricalMessages(events);
+    if (!changeSet)
+        emit q->aboutToAddHistoricalMessages(events);
     const auto insertedSize = moveEventsToTimeline(events, Older);
     const auto from = timeline.crend() - insertedSize;
 
     qCDebug(STATE) << "Room" << displayname << "received" << insertedSize
                    << "past events; the oldest event is now" << timeline.front();
     q->onAddHistoricalTimelineEvents(from);
-    emit q->addedMessages(timeline.front().index(), from->index());
+    notifyAddedMessages(timeline.front().index(), from->index());
 
     for (auto it = from; it != timeline.crend(); ++it) {
         if (const auto* reaction = it->viewAs<ReactionEvent>()) {
             const auto& relation = reaction->relation();
             relations[{ relation.eventId, relation.type }] << reaction;
-            emit q->updatedEvent(relation.eventId);
+            notifyUpdatedEvent(relation.eventId);
         }
+        if (const auto parentId = indexReply(**it, Older); !parentId.isEmpty())
+            notifyUpdatedEvent(parentId);
+        indexForSearch(*it);
     }
     if (from <= q->readMarker())
         updateUnreadCount(from, timeline.crend());
@@ -2413,6 +3836,152 @@ void Room::Private::addHistoricalMessageEvents(RoomEvents&& events)
     if (insertedSize > 9 || et.nsecsElapsed() >= profilerMinNsecs())
         qCDebug(PROFILER) << "*** Room::addHistoricalMessageEvents():"
                           << insertedSize << "event(s)," << et;
+
+    if (!segments.empty()) {
+        // Paginating the main timeline may run into detached segments
+        QSet<int> metSegmentIds;
+        for (auto it = timeline.cbegin();
+             it != timeline.cbegin() + Timeline::difference_type(insertedSize);
+             ++it)
+            if (const auto segIt = segmentsIndex.constFind((*it)->id());
+                segIt != segmentsIndex.cend())
+                metSegmentIds.insert(*segIt);
+        for (const auto segmentId : qAsConst(metSegmentIds))
+            mergeSegmentIntoTimeline(segmentId, false);
+    }
+}
+
+void Room::Private::addToSegment(int segmentId, RoomEvents&& events,
+                                 bool backwards)
+{
+    for (auto& e : events) {
+        const auto evtId = e->id();
+        if (eventsIndex.contains(evtId)) {
+            if (const auto* gap = findGapBySegment(segmentId);
+                gap && backwards) {
+                // The gap's segment has reached the main timeline
+                segments.at(segmentId).backToken.clear();
+                if (!gap->filled) {
+                    qCDebug(MESSAGES) << "Filled the gap before"
+                                      << gap->afterEventId << "in" << id;
+                    const auto afterEventId = gap->afterEventId;
+                    emit q->segmentChanged(segmentId);
+                    finishGap(afterEventId);
+                }
+                return;
+            }
+            if (mergeSegmentIntoTimeline(segmentId,
+                                         !backwards
+                                             && timeline.front()->id() == evtId))
+                return;
+            // Don't paginate into the main timeline any further
+            qCDebug(MESSAGES) << "Segment" << segmentId << "in" << id
+                              << "cannot be joined with the main timeline";
+            auto& seg = segments.at(segmentId);
+            (backwards ? seg.backToken : seg.forwardToken).clear();
+            break;
+        }
+        const auto otherId = segmentsIndex.value(evtId, segmentId);
+        if (otherId != segmentId) {
+            if (backwards)
+                mergeSegments(otherId, segmentId);
+            else
+                mergeSegments(segmentId, otherId);
+            return;
+        }
+        if (segmentsIndex.contains(evtId))
+            continue; // Already in this segment
+
+        segmentsIndex.insert(evtId, segmentId);
+        auto& segmentEvents = segments.at(segmentId).events;
+        if (backwards)
+            segmentEvents.push_front(move(e));
+        else
+            segmentEvents.push_back(move(e));
+    }
+    emit q->segmentChanged(segmentId);
+}
+
+void Room::Private::mergeSegments(int olderId, int newerId)
+{
+    auto newerNode = segments.extract(newerId);
+    Q_ASSERT(!newerNode.empty());
+    auto& newer = newerNode.mapped();
+    auto& older = segments.at(olderId);
+    for (auto* j : { newer.backJob.data(), newer.forwardJob.data(),
+                     older.forwardJob.data() })
+        if (isJobRunning(j))
+            j->abandon();
+
+    for (auto& e : newer.events) {
+        auto& evtSegmentId = segmentsIndex[e->id()];
+        if (evtSegmentId == olderId)
+            continue; // The segments overlap
+        evtSegmentId = olderId;
+        older.events.push_back(move(e));
+    }
+    older.forwardToken = newer.forwardToken;
+    for (auto& gap : gaps)
+        if (gap.segmentId == newerId)
+            gap.segmentId = olderId;
+    qCDebug(MESSAGES) << "Merged segment" << newerId << "into segment"
+                      << olderId << "in" << id;
+    emit q->segmentMerged(newerId, olderId);
+    emit q->segmentChanged(olderId);
+}
+
+bool Room::Private::mergeSegmentIntoTimeline(int segmentId, bool adjacent)
+{
+    const auto segIt = segments.find(segmentId);
+    if (segIt == segments.end() || timeline.empty())
+        return false;
+
+    auto& segmentEvents = segIt->second.events;
+    const auto& frontId = timeline.front()->id();
+    auto joinIt = std::find_if(segmentEvents.begin(), segmentEvents.end(),
+                               [&frontId](const RoomEventPtr& e) {
+                                   return e->id() == frontId;
+                               });
+    if (joinIt == segmentEvents.end() && !adjacent) {
+        if (!std::all_of(segmentEvents.cbegin(), segmentEvents.cend(),
+                         [this](const RoomEventPtr& e) {
+                             return eventsIndex.contains(e->id());
+                         }))
+            return false;
+        // The main timeline has gone past the whole segment
+        joinIt = segmentEvents.begin();
+    }
+
+    for (const auto& e : segmentEvents)
+        segmentsIndex.remove(e->id());
+    const auto joinPos = joinIt - segmentEvents.begin();
+    auto segment = move(segIt->second);
+    segments.erase(segIt);
+    for (auto* j : { segment.backJob.data(), segment.forwardJob.data() })
+        if (isJobRunning(j))
+            j->abandon();
+
+    // Historical events go newest first
+    RoomEvents olderEvents;
+    for (auto it = std::make_reverse_iterator(segment.events.begin() + joinPos);
+         it != segment.events.rend(); ++it)
+        olderEvents.push_back(move(*it));
+    qCDebug(MESSAGES) << "Merging segment" << segmentId << "into the timeline"
+                      << "of" << id << "adds" << olderEvents.size()
+                      << "event(s)";
+    if (!olderEvents.empty()) {
+        // A history request still running would overwrite prevBatch with
+        // a token pointing back into the merged events
+        if (isJobRunning(eventsHistoryJob)) {
+            qCDebug(MESSAGES) << "Abandoning the history request in" << id
+                              << "superseded by the merged segment";
+            eventsHistoryJob->abandon();
+        }
+        addHistoricalMessageEvents(move(olderEvents));
+        prevBatch = segment.backToken;
+    }
+    emit q->segmentMerged(segmentId, MainTimeline);
+    return true;
 }
 
 Room::Changes Room::processStateEvent(const RoomEvent& e)
@@ -2427,13 +3996,17 @@ Room::Changes Room::processStateEvent(const RoomEvent& e)
         return Change::NoChange;
     }
 
-    // Find a value (create an empty one if necessary) and get a reference
-    // to it. Can't use getCurrentState<>() because it (creates and) returns
-    // a stub if a value is not found, and what's needed here is a "real" event
-    // or nullptr.
-    auto& curStateEvent = d->currentState[{ e.matrixType(), e.stateKey() }];
+    // Can't use getCurrentState<>() because it (creates and) returns a stub
+    // if a value is not found, and what's needed here is a "real" event
+    // or nullptr. Member events may need to be unpacked first; and since
+    // unpacking (e.g. from signal handlers below) inserts to currentState,
+    // no references to its values can be kept.
+    const StateEventKey evtKey { e.matrixType(), e.stateKey() };
+    if (is<RoomMemberEvent>(e))
+        d->unpackMember(e.stateKey());
     // Prepare for the state change
-    const auto oldRme = static_cast<const RoomMemberEvent*>(curStateEvent);
+    const auto oldRme = static_cast<const RoomMemberEvent*>(
+        d->currentState.value(evtKey, nullptr));
     visit(e, [this, &oldRme](const RoomMemberEvent& rme) {
         auto* const u = user(rme.userId());
         if (!u) { // Invalid user id?
@@ -2450,6 +4023,7 @@ Room::Changes Room::processStateEvent(const RoomEvent& e)
         case MembershipType::Invite:
             if (rme.membership() != prevMembership) {
                 d->usersInvited.removeOne(u);
+                ++d->membershipVersion;
                 Q_ASSERT(!d->usersInvited.contains(u));
             }
             break;
@@ -2457,7 +4031,7 @@ Room::Changes Room::processStateEvent(const RoomEvent& e)
             switch (rme.membership()) {
             case MembershipType::Join: // rename/avatar change or no-op
                 if (rme.displayName() != oldRme->displayName()) {
-                    emit memberAboutToRename(u, rme.displayName());
+                    d->notifyMemberAboutToRename(u, rme.displayName());
                     d->removeMemberFromMap(u);
                 }
                 break;
@@ -2467,24 +4041,31 @@ Room::Changes Room::processStateEvent(const RoomEvent& e)
                 [[fallthrough]];
             default: // whatever the new membership, it's no more Join
                 d->removeMemberFromMap(u);
-                emit userRemoved(u);
+                d->notifyUserRemoved(u);
             }
             break;
         default:
             if (rme.membership() == MembershipType::Invite
                 || rme.membership() == MembershipType::Join) {
-                d->membersLeft.removeOne(u);
+                if (d->membersLeft.removeOne(u))
+                    ++d->membershipVersion;
                 Q_ASSERT(!d->membersLeft.contains(u));
             }
         }
     });
 
-    // Change the state
+    // Change the state; the new member event can be packed unless it's
+    // given out again
+    if (is<RoomMemberEvent>(e))
+        d->exposedMembers.remove(e.stateKey());
+    auto& curStateEvent = d->currentState[evtKey];
     const auto* const oldStateEvent =
         std::exchange(curStateEvent, static_cast<const StateEventBase*>(&e));
     Q_ASSERT(!oldStateEvent
              || (oldStateEvent->matrixType() == e.matrixType()
                  && oldStateEvent->stateKey() == e.stateKey()));
+    if (const auto* rme = eventCast<const RoomMemberEvent>(&e))
+        d->memberTable.update(*rme);
     if (!is<RoomMemberEvent>(e)) // Room member events are too numerous
         qCDebug(STATE) << "Updated room state:" << e;
 
@@ -2540,23 +4121,27 @@ Room::Changes Room::processStateEvent(const RoomEvent& e)
             case MembershipType::Join:
                 if (prevMembership != MembershipType::Join) {
                     d->insertMemberIntoMap(u);
-                    emit userAdded(u);
+                    d->notifyUserAdded(u);
                 } else if (oldRme->displayName() != evt.displayName()) {
                     d->insertMemberIntoMap(u);
-                    emit memberRenamed(u);
+                    d->notifyMemberRenamed(u);
                 }
                 break;
             case MembershipType::Invite:
-                if (!d->usersInvited.contains(u))
+                if (!d->usersInvited.contains(u)) {
                     d->usersInvited.push_back(u);
+                    ++d->membershipVersion;
+                }
                 if (u == localUser() && evt.isDirect())
                     connection()->addToDirectChats(this, sender);
                 break;
             case MembershipType::Knock:
             case MembershipType::Ban:
             case MembershipType::Leave:
-                if (!d->membersLeft.contains(u))
+                if (!d->membersLeft.contains(u)) {
                     d->membersLeft.append(u);
+                    ++d->membershipVersion;
+                }
             }
             return MembersChange;
             // clang-format off
@@ -2620,6 +4205,12 @@ Room::Changes Room::processEphemeralEvent(EventPtr&& event)
         emit typingChanged();
     }
     if (auto* evt = eventCast<ReceiptEvent>(event)) {
+        // Find the newest marker for each user across the whole batch first,
+        // so that each marker is moved (and the move is announced) only once.
+        QHash<User*, rev_iter_t> newMarkers;
+        // Receipts for events not in the timeline (most likely, because
+        // they are too old and haven't been fetched from the server yet)
+        QHash<User*, QString> unknownMarkerIds;
         int totalReceipts = 0;
         for (const auto& p : qAsConst(evt->eventsWithReceipts())) {
             totalReceipts += p.receipts.size();
@@ -2632,31 +4223,48 @@ Room::Changes Room::processEphemeralEvent(EventPtr&& event)
                                        << p.receipts.size() << "users";
             }
             const auto newMarker = findInTimeline(p.evtId);
-            if (newMarker != timelineEdge()) {
-                for (const Receipt& r : p.receipts) {
-                    if (r.userId == connection()->userId())
-                        continue; // FIXME, #185
-                    auto* const u = user(r.userId);
-                    if (u && memberJoinState(u) == JoinState::Join)
-                        changes |= d->promoteReadMarker(u, newMarker);
-                }
-            } else {
+            if (newMarker == historyEdge())
                 qCDebug(EPHEMERAL) << "Event" << p.evtId
                                    << "not found; saving read receipts anyway";
-                // If the event is not found (most likely, because it's too old
-                // and hasn't been fetched from the server yet), but there is
-                // a previous marker for a user, keep the previous marker.
-                // Otherwise, blindly store the event id for this user.
-                for (const Receipt& r : p.receipts) {
-                    if (r.userId == connection()->userId())
-                        continue; // FIXME, #185
-                    auto* const u = user(r.userId);
-                    if (u && memberJoinState(u) == JoinState::Join
-                        && readMarker(u) == timelineEdge())
-                        changes |= d->setLastReadEvent(u, p.evtId);
+            for (const Receipt& r : p.receipts) {
+                if (r.userId == connection()->userId())
+                    continue; // FIXME, #185
+                auto* const u = user(r.userId);
+                if (!u)
+                    continue;
+                if (newMarker == historyEdge()) {
+                    unknownMarkerIds.insert(u, p.evtId);
+                    continue;
                 }
+                // Remember, we deal with reverse iterators
+                if (auto it = newMarkers.find(u); it == newMarkers.end())
+                    newMarkers.insert(u, newMarker);
+                else if (newMarker < *it)
+                    *it = newMarker;
             }
         }
+
+        if (d->batchReadReceipts)
+            d->movedReadMarkers.emplace();
+        for (auto it = newMarkers.cbegin(); it != newMarkers.cend(); ++it)
+            if (memberJoinState(it.key()) == JoinState::Join)
+                changes |= d->promoteReadMarker(it.key(), it.value());
+        // If there is a previous marker for a user, keep it; otherwise,
+        // blindly store the event id for this user.
+        for (auto it = unknownMarkerIds.cbegin(); it != unknownMarkerIds.cend();
+             ++it)
+            if (!newMarkers.contains(it.key())
+                && memberJoinState(it.key()) == JoinState::Join
+                && readMarker(it.key()) == historyEdge())
+                changes |= d->setLastReadEvent(it.key(), it.value());
+        if (d->movedReadMarkers) {
+            const auto movedReadMarkers =
+                *std::exchange(d->movedReadMarkers, none);
+            if (!movedReadMarkers.isEmpty())
+                emit lastReadEventsChanged(
+                    movedReadMarkers.values().toVector());
+        }
+
         if (evt->eventsWithReceipts().size() > 3 || totalReceipts > 10
             || et.nsecsElapsed() >= profilerMinNsecs())
             qCDebug(PROFILER)
@@ -2729,7 +4337,7 @@ Room::Private::buildShortlist(const QStringList& userIds) const
     return buildShortlist(users);
 }
 
-QString Room::Private::calculateDisplayname() const
+QString Room::Private::calculateDisplayname()
 {
     // CS spec, section 13.2.2.5 Calculating the display name for a room
     // Numbers below refer to respective parts in the spec.
@@ -2756,27 +4364,41 @@ QString Room::Private::calculateDisplayname() const
 
     // Supplementary code: build the shortlist of users whose names
     // will be used to construct the room name. Takes into account MSC688's
-    // "heroes" if available.
-    const bool localUserIsIn = joinState == JoinState::Join;
-    const bool emptyRoom =
-        membersMap.isEmpty()
-        || (membersMap.size() == 1 && isLocalUser(*membersMap.cbegin()));
-    const bool nonEmptySummary = summary.heroes && !summary.heroes->empty();
-    auto shortlist = nonEmptySummary ? buildShortlist(*summary.heroes)
-                                     : !emptyRoom ? buildShortlist(membersMap)
-                                                  : users_shortlist_t {};
-
-    // When the heroes list is there, we can rely on it. If the heroes list is
-    // missing, the below code gathers invited, or, if there are no invitees,
-    // left members.
-    if (!shortlist.front() && localUserIsIn)
-        shortlist = buildShortlist(usersInvited);
-
-    if (!shortlist.front())
-        shortlist = buildShortlist(membersLeft);
+    // "heroes" if available. This goes through all members, so the shortlist
+    // is only rebuilt when membershipVersion says it may have changed.
+    if (!displaynameCache
+        || displaynameCache->membershipVersion != membershipVersion) {
+        QElapsedTimer et;
+        et.start();
+        const bool localUserIsIn = joinState == JoinState::Join;
+        const bool emptyRoom =
+            membersMap.isEmpty()
+            || (membersMap.size() == 1 && isLocalUser(*membersMap.cbegin()));
+        const bool nonEmptySummary = summary.heroes && !summary.heroes->empty();
+        auto shortlist = nonEmptySummary ? buildShortlist(*summary.heroes)
+                                         : !emptyRoom ? buildShortlist(membersMap)
+                                                      : users_shortlist_t {};
+
+        // When the heroes list is there, we can rely on it. If the heroes list
+        // is missing, the below code gathers invited, or, if there are no
+        // invitees, left members.
+        if (!shortlist.front() && localUserIsIn)
+            shortlist = buildShortlist(usersInvited);
+
+        if (!shortlist.front())
+            shortlist = buildShortlist(membersLeft);
+
+        displaynameCache = DisplaynameCache { membershipVersion, shortlist,
+                                              emptyRoom, {}, -1, {} };
+        if (et.nsecsElapsed() > profilerMinNsecs() / 10)
+            qCDebug(PROFILER) << "Building the display name shortlist for"
+                              << q->objectName() << "took" << et;
+    }
+    auto& cache = *displaynameCache;
+    const auto emptyRoom = cache.emptyRoom;
 
     QStringList names;
-    for (auto u : shortlist) {
+    for (auto u : cache.shortlist) {
         if (u == nullptr || isLocalUser(u))
             break;
         // Only disambiguate if the room is not empty
@@ -2789,27 +4411,36 @@ QString Room::Private::calculateDisplayname() const
             : !usersInvited.empty()
                   ? usersInvited.count()
                   : membersLeft.size() - int(joinState == JoinState::Leave);
-    if (usersCountExceptLocal > int(shortlist.size()))
+    // Names of the shortlisted users and the number of others is all that's
+    // left to check before reusing the previous result
+    if (!cache.displayname.isEmpty() && names == cache.names
+        && usersCountExceptLocal == cache.usersCountExceptLocal)
+        return cache.displayname;
+    cache.names = names;
+    cache.usersCountExceptLocal = usersCountExceptLocal;
+
+    if (usersCountExceptLocal > int(cache.shortlist.size()))
         names << tr(
             "%Ln other(s)",
             "Used to make a room name from user names: A, B and _N others_",
-            usersCountExceptLocal - int(shortlist.size()));
+            usersCountExceptLocal - int(cache.shortlist.size()));
     const auto namesList = QLocale().createSeparatedList(names);
 
     // Room members
     if (!emptyRoom)
-        return namesList;
+        return cache.displayname = namesList;
 
     // (Spec extension) Invited users
     if (!usersInvited.empty())
-        return tr("Empty room (invited: %1)").arg(namesList);
+        return cache.displayname =
+                   tr("Empty room (invited: %1)").arg(namesList);
 
     // Users that previously left the room
     if (!membersLeft.isEmpty())
-        return tr("Empty room (was: %1)").arg(namesList);
+        return cache.displayname = tr("Empty room (was: %1)").arg(namesList);
 
     // Fail miserably
-    return tr("Empty room (%1)").arg(id);
+    return cache.displayname = tr("Empty room (%1)").arg(id);
 }
 
 void Room::Private::updateDisplayname()
@@ -2845,6 +4476,16 @@ QJsonObject Room::Private::toJson() const
             json[UnsignedKeyL] = unsignedJson;
             stateEvents.append(json);
         }
+        // Packed events only come from the base state, where prev_content
+        // is kept; drop it the same way as above
+        memberTable.forEachPacked([&stateEvents](QJsonObject json) {
+            if (json.value(ContentKeyL).toObject().isEmpty())
+                return;
+            auto unsignedJson = json.value(UnsignedKeyL).toObject();
+            unsignedJson.remove(QStringLiteral("prev_content"));
+            json[UnsignedKeyL] = unsignedJson;
+            stateEvents.append(json);
+        });
 
         const auto stateObjName = joinState == JoinState::Invite
                                       ? QStringLiteral("invite_state")
@@ -32,6 +32,7 @@
 #include "events/roomtombstoneevent.h"
 
 #include <QtCore/QJsonObject>
+#include <QtCore/QSet>
 #include <QtGui/QImage>
 
 #include <deque>
@@ -65,6 +66,7 @@ class FileTransferInfo {
     Q_PROPERTY(int total MEMBER total CONSTANT)
     Q_PROPERTY(QUrl localDir MEMBER localDir CONSTANT)
     Q_PROPERTY(QUrl localPath MEMBER localPath CONSTANT)
+    Q_PROPERTY(int bytesPerSecond MEMBER bytesPerSecond CONSTANT)
 public:
     enum Status { None, Started, Completed, Failed, Cancelled };
     Status status = None;
@@ -73,6 +75,8 @@ public:
     int total = -1;
     QUrl localDir {};
     QUrl localPath {};
+    /// The transfer rate over the last few seconds
+    int bytesPerSecond = 0;
 
     bool started() const { return status == Started; }
     bool completed() const { return status == Completed; }
@@ -80,6 +84,38 @@ public:
     bool failed() const { return status == Failed; }
 };
 
+/// A set of changes accumulated by a room while processing a sync batch
+/** \sa Room::setBatchedNotifications, Room::changesBatched */
+struct RoomChangeSet {
+    using index_range_t =
+        std::pair<TimelineItem::index_t, TimelineItem::index_t>;
+
+    /// Ranges of timeline indices of added events, inclusive on both ends
+    /** These include the remote echoes of merged pending events */
+    QVector<index_range_t> insertedRanges;
+    /// Indices of the pending events merged with their remote echoes
+    /**
+     * The indices are in the order of merging; each one is in the list of
+     * pending events as it was right before the merge, i.e. with
+     * the previously merged ones already removed.
+     */
+    QVector<int> mergedPendingIndices;
+    /// Ids of events whose reactions, replies etc. have changed
+    QSet<QString> updatedEventIds;
+    QSet<User*> addedMembers;
+    QSet<User*> removedMembers;
+    /// Members whose display names (including disambiguation) changed
+    QSet<User*> renamedMembers;
+
+    bool empty() const
+    {
+        return insertedRanges.empty() && mergedPendingIndices.empty()
+               && updatedEventIds.empty()
+               && addedMembers.empty() && removedMembers.empty()
+               && renamedMembers.empty();
+    }
+};
+
 class Room : public QObject {
     Q_OBJECT
     Q_PROPERTY(Connection* connection READ connection CONSTANT)
@@ -209,6 +245,13 @@ public:
     QList<User*> membersLeft() const;
 
     Q_INVOKABLE QList<Quotient::User*> users() const;
+    /// Get joined members ordered by their names in this room
+    /*! Like MemberSorter, this uses locale-aware ordering; but the list is
+     * maintained as members join, leave and get renamed, with collation keys
+     * of their names computed once; so this is much faster than sorting
+     * users() in large rooms.
+     */
+    QVector<User*> sortedMembers() const;
     QStringList memberNames() const;
     [[deprecated("Use joinedCount(), invitedCount(), totalMemberCount()")]]
     int memberCount() const;
@@ -258,6 +301,18 @@ public:
      */
     Q_INVOKABLE Quotient::JoinState memberJoinState(Quotient::User* user) const;
 
+    /// Get the display name of the user as set in this room
+    /*! This is the best known name from the current member event of the user:
+     * the name in its content or, if the content has none (e.g. when the user
+     * has left), the name in its previous content. The name is not
+     * disambiguated; it's an empty string if there's no member event or
+     * neither content has a name.
+     * \sa roomMembername, getBestKnownName
+     */
+    QString memberName(const QString& mxId) const;
+    /// Get the avatar URL of the user as set in this room
+    QUrl memberAvatarUrl(const QString& mxId) const;
+
     /**
      * Get a disambiguated name for a given user in
      * the context of the room
@@ -313,6 +368,94 @@ public:
     const RelatedEvents relatedEvents(const RoomEvent& evt,
                                       const char* relType) const;
 
+    /// Get ids of the events directly replying to the given event
+    /**
+     * The returned list only covers replies that are loaded to the timeline,
+     * in the timeline order (oldest first). This is a lookup in the reply
+     * index maintained by the room, not a timeline scan.
+     */
+    QStringList replies(const QString& evtId) const;
+    /// Get the id of the event the given event replies to
+    /**
+     * \return the id from the reply's m.relates_to/m.in_reply_to; an empty
+     *         string if the event is not a reply or is not in the timeline
+     */
+    QString replyParentId(const QString& replyId) const;
+    /// Get the event the given event replies to
+    /**
+     * Looks up the parent in the timeline first, then among the parents
+     * fetched from the server before. If the parent is still not found,
+     * requests it from the server and returns nullptr; once the event
+     * arrives, updatedEvent() is emitted for every loaded reply to it.
+     */
+    const RoomEvent* replyParent(const QString& replyId) const;
+
+    /// Search messages loaded to the timeline of this room
+    /*!
+     * Looks up the words of \p query in the room's local full-text index,
+     * built from message bodies as events enter the timeline and kept along
+     * with the state cache. Every word should be present in a message for
+     * it to match; the last word of the query can be incomplete.
+     * \param limit the maximum number of hits; -1 means no limit
+     * \return hits ranked by recency, the newest first
+     */
+    SearchHits searchMessages(const QString& query, int limit = 50) const;
+
+    /// The segment id used for the main timeline of the room
+    /// \sa loadEventContext, eventContextLoaded
+    static constexpr int MainTimeline = -1;
+    /// The segment id returned for events that are not loaded
+    static constexpr int NoSegment = -2;
+
+    /// Get the id of the detached timeline segment holding the event
+    /**
+     * Detached segments are parts of the room history loaded with
+     * loadEventContext() and not (yet) connected to the main timeline;
+     * events in them are not accessible with findInTimeline() and are not
+     * counted in timelineSize().
+     * \return the segment id; MainTimeline if the event is in the main
+     *         timeline; NoSegment if the event is not loaded at all
+     */
+    int findSegment(const QString& evtId) const;
+    /// Get the events of a detached timeline segment, oldest first
+    QVector<const RoomEvent*> segmentEvents(int segmentId) const;
+
+    /// A hole in the timeline left by a limited sync response
+    struct Gap {
+        /// The newest event before the gap
+        QString beforeEventId;
+        /// The oldest event after the gap
+        QString afterEventId;
+        /// The detached segment with the events loaded into the gap so far
+        int segmentId;
+        /// Whether the segment contains all events missing in the gap
+        bool filled;
+    };
+    /// Get the gaps in the main timeline, oldest first
+    /**
+     * When a sync response has a limited timeline, the room records a gap
+     * between the previously last event and the first event of the response.
+     * The missing events are loaded in the background into a detached
+     * segment (see segmentEvents()), gaps in displayed rooms first. Since
+     * the main timeline only grows at its ends, the events stay in
+     * the segment, and it's up to clients to show them at the place of
+     * the gap; unless the room is told to insert them into the timeline,
+     * see setInsertFilledGaps().
+     * \sa gapsChanged, gapFilled
+     */
+    QVector<Gap> gaps() const;
+    bool insertsFilledGaps() const;
+    /// Insert the events of filled gaps into the main timeline
+    /**
+     * When enabled, once all events missing in a gap are loaded they are
+     * inserted into the main timeline at the place of the gap, and the gap
+     * is removed; gaps already filled are inserted right away. This shifts
+     * the indices of all events after the gap and invalidates iterators
+     * into the timeline, so only enable this if the client handles
+     * aboutToInsertMessages(). Disabled by default.
+     */
+    void setInsertFilledGaps(bool insert);
+
     const RoomCreateEvent* creation() const
     { return getCurrentState<RoomCreateEvent>(); }
     const RoomTombstoneEvent* tombstone() const
@@ -327,6 +470,32 @@ public:
      * measure that "screen time".
      */
     void setDisplayed(bool displayed = true);
+
+    bool batchedNotifications() const;
+    /// Deliver changes from sync batches at once instead of item by item
+    /**
+     * When enabled, the room doesn't emit addedMessages(), updatedEvent(),
+     * pendingEventMerged(), userAdded(), userRemoved() and memberRenamed()
+     * while processing a sync response; instead, it collects them into
+     * a RoomChangeSet emitted with changesBatched() once the whole response
+     * is processed. The "about to" counterparts of these signals
+     * (aboutToAddNewMessages(), aboutToAddHistoricalMessages(),
+     * pendingEventAboutToMerge() and memberAboutToRename()) are not emitted
+     * either, so that models never get one half of a pair; by the time
+     * changesBatched() is emitted, the room already has the changes applied.
+     * Changes happening outside of sync processing (e.g. loading history) are
+     * notified about immediately, with both signals of each pair.
+     */
+    void setBatchedNotifications(bool batched);
+    bool batchedReadReceipts() const;
+    /// Notify about read receipts once per receipt event
+    /**
+     * When enabled, applying a batch of read receipts emits
+     * a single lastReadEventsChanged() instead of lastReadEventChanged() and
+     * readMarkerForUserMoved() for each user whose read marker has moved.
+     * Disabled by default.
+     */
+    void setBatchedReadReceipts(bool batched);
     QString firstDisplayedEventId() const;
     rev_iter_t firstDisplayedMarker() const;
     void setFirstDisplayedEventId(const QString& eventId);
@@ -531,6 +700,10 @@ public slots:
     QString postHtmlText(const QString& plainText, const QString& html);
     /// Send a reaction on a given event with a given key
     QString postReaction(const QString& eventId, const QString& key);
+    /// Upload a file and send a message with it
+    /** The file is examined on a worker thread; for images, a thumbnail
+     *  is made and uploaded along with the file. The message is sent once
+     *  both uploads are done. */
     QString postFile(const QString& plainText, const QUrl& localPath,
                      bool asGenericFile = false);
     /** Post a pre-created room message event
@@ -556,6 +729,20 @@ public slots:
     void refreshDisplayName();
 
     void getPreviousContent(int limit = 10);
+    /// Load the part of the history around the event
+    /**
+     * If the event is not loaded yet, this makes a single request to load
+     * the event with the events around it into a new detached segment,
+     * without paginating the main timeline all the way to the event.
+     * The segment can be paginated in both directions with
+     * paginateSegment(); when it meets the main timeline or another segment,
+     * the two get merged. Either way, eventContextLoaded() is emitted once
+     * the event is available.
+     */
+    void loadEventContext(const QString& eventId, int limit = 20);
+    /// Load more events to a detached segment
+    /** \param backwards whether to load older (true) or newer events */
+    void paginateSegment(int segmentId, int limit = 20, bool backwards = true);
 
     void inviteToRoom(const QString& memberId);
     LeaveRoomJob* leaveRoom();
@@ -598,6 +785,38 @@ signals:
      */
     void baseStateLoaded();
     void eventsHistoryJobChanged();
+    /// The event requested with loadEventContext() is loaded
+    /** \param segmentId the segment with the event, or MainTimeline */
+    void eventContextLoaded(QString eventId, int segmentId);
+    /// A detached segment has been created or got more events
+    void segmentChanged(int segmentId);
+    /// A detached segment has been merged into another one
+    /**
+     * The segment with \p segmentId doesn't exist after this signal; its
+     * events are now in the segment with \p intoSegmentId (which can be
+     * MainTimeline, in which case the usual signals about adding historical
+     * events or, for a gap, about inserting events have been emitted, too).
+     */
+    void segmentMerged(int segmentId, int intoSegmentId);
+    /// A gap has been added to the timeline or has been filled
+    void gapsChanged();
+    /// All events missing in the gap have been loaded into its segment
+    /**
+     * If the room inserts filled gaps into the timeline, this is emitted
+     * after the events have been inserted and the gap is gone.
+     * \sa setInsertFilledGaps
+     */
+    void gapFilled(QString afterEventId);
+    /// Events are about to be inserted in the middle of the timeline
+    /**
+     * This is only emitted when a gap is filled in a room that inserts
+     * filled gaps (see setInsertFilledGaps()). The inserted events get
+     * indices starting from \p atIndex, while indices of the events from
+     * \p atIndex onwards increase by the number of inserted events.
+     * addedMessages() is emitted with the indices of the inserted events
+     * once they are in the timeline.
+     */
+    void aboutToInsertMessages(RoomEventsRange events, int atIndex);
     void aboutToAddHistoricalMessages(RoomEventsRange events);
     void aboutToAddNewMessages(RoomEventsRange events);
     void addedMessages(int fromIndex, int toIndex);
@@ -660,6 +879,18 @@ signals:
      * instead.
      */
     void memberListChanged();
+    /// Changes collected while processing a sync response
+    /** Only emitted when batched notifications are enabled
+     * \sa setBatchedNotifications
+     */
+    void changesBatched(const Quotient::RoomChangeSet& changes);
+    /// Members with the given membership are being loaded
+    /*! The full list of members is loaded in portions, joined members
+     * first; this is emitted as each slice of a portion gets applied.
+     * \sa allMembersLoaded, setDisplayed
+     */
+    void membersLoadingProgress(QString membership, int loadedCount,
+                                int totalCount);
     /// The previously lazy-loaded members list is now loaded entirely
     /// \sa setDisplayed
     void allMembersLoaded();
@@ -679,6 +910,15 @@ signals:
     void readMarkerMoved(QString fromEventId, QString toEventId);
     void readMarkerForUserMoved(Quotient::User* user, QString fromEventId,
                                 QString toEventId);
+    /// Read markers of several users have moved at once
+    /**
+     * This is emitted once after applying a batch of read receipts, with
+     * every user whose read marker has moved in that batch; such batches
+     * then don't emit lastReadEventChanged() and readMarkerForUserMoved()
+     * for each user. Only emitted when batched read receipts are enabled.
+     * \sa setBatchedReadReceipts
+     */
+    void lastReadEventsChanged(QVector<Quotient::User*> users);
     void unreadMessagesChanged(Quotient::Room* room);
 
     void accountDataAboutToChange(QString type);
@@ -751,4 +991,5 @@ private:
 };
 } // namespace Quotient
 Q_DECLARE_METATYPE(Quotient::FileTransferInfo)
+Q_DECLARE_METATYPE(Quotient::RoomChangeSet)
 Q_DECLARE_OPERATORS_FOR_FLAGS(Quotient::Room::Changes)
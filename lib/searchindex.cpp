@@ -0,0 +1,164 @@
+#include "searchindex.h"
+
+#include <QtCore/QJsonArray>
+#include <QtCore/QRegularExpression>
+
+#include <algorithm>
+
+using namespace Quotient;
+
+static const auto EventsKey = QStringLiteral("events");
+static const auto IdKey = QStringLiteral("id");
+static const auto TimestampKey = QStringLiteral("ts");
+static const auto TermsKey = QStringLiteral("terms");
+
+SearchIndex::SearchIndex(QString roomId) : roomId(std::move(roomId)) {}
+
+void SearchIndex::addEvent(const QString& eventId, const QString& text,
+                           const QDateTime& timestamp)
+{
+    removeEvent(eventId);
+    auto terms = tokenize(text);
+    if (!terms.isEmpty())
+        addEntry(eventId, { timestamp.toMSecsSinceEpoch(), std::move(terms) });
+}
+
+void SearchIndex::addTokenized(Document&& document)
+{
+    removeEvent(document.eventId);
+    if (!document.terms.isEmpty())
+        addEntry(document.eventId, { document.timestamp.toMSecsSinceEpoch(),
+                                     std::move(document.terms) });
+}
+
+void SearchIndex::addEntry(const QString& eventId, Entry&& entry)
+{
+    for (const auto& term : qAsConst(entry.terms))
+        postings[term].insert(eventId);
+    entries.insert(eventId, std::move(entry));
+}
+
+bool SearchIndex::removeEvent(const QString& eventId)
+{
+    const auto entryIt = entries.find(eventId);
+    if (entryIt == entries.end())
+        return false;
+
+    for (const auto& term : qAsConst(entryIt->terms)) {
+        const auto postingIt = postings.find(term);
+        if (postingIt == postings.end())
+            continue;
+        postingIt->remove(eventId);
+        if (postingIt->isEmpty())
+            postings.erase(postingIt);
+    }
+    entries.erase(entryIt);
+    return true;
+}
+
+bool SearchIndex::contains(const QString& eventId) const
+{
+    return entries.contains(eventId);
+}
+
+int SearchIndex::size() const { return entries.size(); }
+
+SearchHits SearchIndex::search(const QString& query, int limit) const
+{
+    const auto queryTerms = tokenize(query);
+    if (queryTerms.isEmpty() || limit == 0)
+        return {};
+
+    QSet<QString> matches;
+    for (auto termIt = queryTerms.cbegin(); termIt != queryTerms.cend();
+         ++termIt) {
+        QSet<QString> termMatches;
+        for (auto it = postings.lowerBound(*termIt);
+             it != postings.cend() && it.key().startsWith(*termIt); ++it)
+            termMatches.unite(it.value());
+
+        if (termIt == queryTerms.cbegin())
+            matches = std::move(termMatches);
+        else
+            matches.intersect(termMatches);
+        if (matches.isEmpty())
+            return {};
+    }
+
+    SearchHits hits;
+    hits.reserve(matches.size());
+    for (const auto& eventId : qAsConst(matches))
+        hits.push_back({ roomId, eventId,
+                         QDateTime::fromMSecsSinceEpoch(
+                             entries.value(eventId).timestamp) });
+
+    const auto newerFirst = [](const SearchHit& lhs, const SearchHit& rhs) {
+        return lhs.timestamp > rhs.timestamp;
+    };
+    if (limit > 0 && limit < hits.size()) {
+        std::partial_sort(hits.begin(), hits.begin() + limit, hits.end(),
+                          newerFirst);
+        hits.resize(limit);
+    } else
+        std::sort(hits.begin(), hits.end(), newerFirst);
+    return hits;
+}
+
+QJsonObject SearchIndex::toJson() const
+{
+    QJsonArray eventsJson;
+    for (auto it = entries.cbegin(); it != entries.cend(); ++it)
+        eventsJson.append(
+            QJsonObject { { IdKey, it.key() },
+                          { TimestampKey, double(it->timestamp) },
+                          { TermsKey, it->terms.join(' ') } });
+    return { { EventsKey, eventsJson } };
+}
+
+void SearchIndex::loadFrom(const QJsonObject& json)
+{
+    const auto eventsJson = json.value(EventsKey).toArray();
+    for (const auto& eventJv : eventsJson) {
+        const auto eventJson = eventJv.toObject();
+        const auto eventId = eventJson.value(IdKey).toString();
+        if (eventId.isEmpty() || entries.contains(eventId))
+            continue;
+        auto terms = tokenize(eventJson.value(TermsKey).toString());
+        if (!terms.isEmpty())
+            addEntry(eventId,
+                     { qint64(eventJson.value(TimestampKey).toDouble()),
+                       std::move(terms) });
+    }
+}
+
+QStringList SearchIndex::tokenize(const QString& text)
+{
+    static const QRegularExpression WordRe(
+        QStringLiteral("\\w+"), QRegularExpression::UseUnicodePropertiesOption);
+
+    QStringList terms;
+    auto it = WordRe.globalMatch(text.toCaseFolded());
+    while (it.hasNext())
+        terms.push_back(it.next().captured());
+    terms.removeDuplicates();
+    return terms;
+}
+
+void SearchIndex::tokenizeAll(QVector<Document>& documents)
+{
+    for (auto& d : documents) {
+        d.terms = tokenize(d.text);
+        d.text.clear();
+    }
+}
+
+QString SearchIndex::fileNameForRoom(QString roomId)
+{
+    roomId.replace(':', '_');
+    // Same as the state cache, the index is saved in a binary format
+#if QT_VERSION >= QT_VERSION_CHECK(5, 15, 0)
+    return roomId + ".search.cbor";
+#else
+    return roomId + ".search.qbjs";
+#endif
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <QtCore/QDateTime>
+#include <QtCore/QHash>
+#include <QtCore/QJsonObject>
+#include <QtCore/QMap>
+#include <QtCore/QSet>
+#include <QtCore/QStringList>
+#include <QtCore/QVector>
+
+namespace Quotient {
+struct SearchHit {
+    QString roomId;
+    QString eventId;
+    QDateTime timestamp;
+};
+using SearchHits = QVector<SearchHit>;
+
+/*! \brief A local inverted index over message texts
+ *
+ * The index maps case-folded words to ids of events containing them; every
+ * indexed event also carries its origin timestamp so that search results can
+ * be ranked by recency. Only the words are stored, not the original texts,
+ * which keeps the index compact enough to be saved along with the state cache.
+ *
+ * Rooms maintain their indices as events enter their timelines; use
+ * Room::searchMessages() or Connection::searchMessages() to query them.
+ */
+class SearchIndex {
+public:
+    /// An event text to be indexed in a batch
+    /** \sa tokenizeAll, addTokenized */
+    struct Document {
+        QString eventId;
+        QString text;
+        QDateTime timestamp;
+        /// The words of the text, as filled by tokenizeAll()
+        QStringList terms = {};
+    };
+
+    explicit SearchIndex(QString roomId = {});
+
+    /// Index the text of an event, replacing the previously indexed one
+    void addEvent(const QString& eventId, const QString& text,
+                  const QDateTime& timestamp);
+    /// Remove the event from the index
+    /** \return true if the event has been indexed before, false otherwise */
+    bool removeEvent(const QString& eventId);
+    /// Index a document that has gone through tokenizeAll()
+    /** Same as addEvent() but without splitting the text into words */
+    void addTokenized(Document&& document);
+    bool contains(const QString& eventId) const;
+    int size() const;
+
+    /*! \brief Find events having all words of the query
+     *
+     * Each word of the query matches indexed words that start with it,
+     * so that the word being typed can be found before it's complete.
+     * \return hits ordered from the newest to the oldest; if \p limit is
+     *         not negative, at most \p limit hits
+     */
+    SearchHits search(const QString& query, int limit = -1) const;
+
+    QJsonObject toJson() const;
+    /// Add entries from JSON made by toJson(), keeping the existing ones
+    void loadFrom(const QJsonObject& json);
+
+    /// Split the text into a list of unique case-folded words
+    static QStringList tokenize(const QString& text);
+    /// Fill the terms of the documents, dropping their texts
+    /**
+     * This doesn't touch the index and can be called from any thread;
+     * rooms use it to split texts into words on a worker thread.
+     */
+    static void tokenizeAll(QVector<Document>& documents);
+    static QString fileNameForRoom(QString roomId);
+
+private:
+    struct Entry {
+        qint64 timestamp;
+        QStringList terms;
+    };
+
+    QString roomId;
+    QHash<QString, Entry> entries;
+    /// Sorted to allow prefix lookups
+    QMap<QString, QSet<QString>> postings;
+
+    void addEntry(const QString& eventId, Entry&& entry);
+};
+} // namespace Quotient
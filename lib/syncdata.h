@@ -104,6 +104,8 @@ public:
 
     static std::pair<int, int> cacheVersion() { return { 11, 0 }; }
     static QString fileNameForRoom(QString roomId);
+    /// Load a JSON object from a cache file in either JSON or binary format
+    static QJsonObject loadJson(const QString& fileName);
 
 private:
     QString nextBatch_;
@@ -113,7 +115,5 @@ private:
     SyncDataList roomData;
     QStringList unresolvedRoomIds;
     QHash<QString, int> deviceOneTimeKeysCount_;
-
-    static QJsonObject loadJson(const QString& fileName);
 };
 } // namespace Quotient
@@ -71,7 +71,10 @@ void User::Private::fetchProfile(const User* q)
 {
     defaultAvatar.emplace(Avatar {});
     defaultName = "";
-    auto* j = q->connection()->callApi<GetUserProfileJob>(BackgroundRequest, id);
+    // Profiles are requested with the access token of the connection, and
+    // the HTTP cache is shared across accounts; so they aren't cached there
+    auto* j = q->connection()->callApi<GetUserProfileJob>(
+        SharedBackgroundRequest, id);
     // FIXME: accepting const User* and const_cast'ing it here is only
     //        until we get a better User API in 0.7
     QObject::connect(j, &BaseJob::success, q,
@@ -126,7 +129,7 @@ QString getBestKnownName(const RoomMemberEvent* event)
 QString User::name(const Room* room) const
 {
     if (room)
-        return getBestKnownName(room->getCurrentState<RoomMemberEvent>(id()));
+        return room->memberName(id());
 
     if (d->defaultName.isNull())
         d->fetchProfile(this);
@@ -265,8 +268,7 @@ const Avatar& User::avatarObject(const Room* room) const
         return *d->defaultAvatar;
     }
 
-    const auto& url =
-        getBestKnownAvatarUrl(room->getCurrentState<RoomMemberEvent>(id()));
+    const auto& url = room->memberAvatarUrl(id());
     const auto& mediaId = url.authority() + url.path();
     return d->otherAvatars.try_emplace(mediaId, url).first->second;
 }
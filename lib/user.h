@@ -173,4 +173,9 @@ private:
     class Private;
     QScopedPointer<Private> d;
 };
+
+/// Get the display name from the member event, or from its prev_content
+QString getBestKnownName(const RoomMemberEvent* event);
+/// Get the avatar URL from the member event, or from its prev_content
+QUrl getBestKnownAvatarUrl(const RoomMemberEvent* event);
 } // namespace Quotient
@@ -37,6 +37,14 @@ HEADERS += \
     $$SRCPATH/uri.h \
     $$SRCPATH/uriresolver.h \
     $$SRCPATH/syncdata.h \
+    $$SRCPATH/searchindex.h \
+    $$SRCPATH/paginationscheduler.h \
+    $$SRCPATH/memberloader.h \
+    $$SRCPATH/membertable.h \
+    $$SRCPATH/backgroundtask.h \
+    $$SRCPATH/mediacache.h \
+    $$SRCPATH/mediaprefetcher.h \
+    $$SRCPATH/retryscheduler.h \
     $$SRCPATH/quotient_common.h \
     $$SRCPATH/util.h \
     $$SRCPATH/qt_connection_util.h \
@@ -95,6 +103,14 @@ SOURCES += \
     $$SRCPATH/uri.cpp \
     $$SRCPATH/uriresolver.cpp \
     $$SRCPATH/syncdata.cpp \
+    $$SRCPATH/searchindex.cpp \
+    $$SRCPATH/paginationscheduler.cpp \
+    $$SRCPATH/memberloader.cpp \
+    $$SRCPATH/membertable.cpp \
+    $$SRCPATH/backgroundtask.cpp \
+    $$SRCPATH/mediacache.cpp \
+    $$SRCPATH/mediaprefetcher.cpp \
+    $$SRCPATH/retryscheduler.cpp \
     $$SRCPATH/util.cpp \
     $$SRCPATH/events/event.cpp \
     $$SRCPATH/events/roomevent.cpp \
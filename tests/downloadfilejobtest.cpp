@@ -0,0 +1,217 @@
+#include "connectiondata.h"
+#include "mediacache.h"
+
+#include "jobs/downloadfilejob.h"
+
+#include <QtCore/QPointer>
+#include <QtCore/QTemporaryDir>
+#include <QtNetwork/QNetworkProxy>
+#include <QtNetwork/QTcpServer>
+#include <QtNetwork/QTcpSocket>
+#include <QtTest/QtTest>
+
+using namespace Quotient;
+
+/// A stand-in for the media repository of a homeserver
+/**
+ * Each request is answered on a connection of its own; the server serves
+ * the same content for any media id, honouring or ignoring Range headers
+ * depending on the mode.
+ */
+class MediaServer : public QTcpServer {
+public:
+    enum Mode {
+        IgnoreRanges, //< Always respond with 200 and the whole content
+        ServeRanges, //< Respond to Range requests with 206
+        FailFirstResponse, //< Break off the first response mid-stream
+    };
+
+    explicit MediaServer(QByteArray content) : content(std::move(content))
+    {
+        connect(this, &QTcpServer::newConnection, this, [this] {
+            while (auto* socket = nextPendingConnection()) {
+                connect(socket, &QTcpSocket::disconnected, socket,
+                        &QObject::deleteLater);
+                connect(socket, &QTcpSocket::readyRead, this,
+                        [this, socket] { readRequest(socket); });
+            }
+        });
+    }
+
+    Mode mode = ServeRanges;
+    /// The Range headers of the requests received, empty if none
+    QByteArrayList ranges;
+
+private:
+    QByteArray content;
+    QHash<QTcpSocket*, QByteArray> buffers;
+
+    void readRequest(QTcpSocket* socket)
+    {
+        auto& buffer = buffers[socket];
+        buffer += socket->readAll();
+        if (!buffer.contains("\r\n\r\n"))
+            return;
+        QByteArray range;
+        for (const auto& line : buffer.split('\n'))
+            if (line.toLower().startsWith("range:"))
+                range = line.mid(6).trimmed();
+        buffers.remove(socket);
+        ranges.push_back(range);
+        respond(socket, range);
+    }
+
+    void respond(QTcpSocket* socket, const QByteArray& range)
+    {
+        qint64 begin = 0;
+        qint64 end = content.size() - 1;
+        const auto useRange = mode != IgnoreRanges && !range.isEmpty()
+                              && !(mode == FailFirstResponse
+                                   && ranges.size() == 1);
+        if (useRange) {
+            const auto bounds = range.mid(range.indexOf('=') + 1).split('-');
+            begin = bounds.front().toLongLong();
+            if (!bounds.back().isEmpty())
+                end = std::min(bounds.back().toLongLong(), end);
+        }
+        const auto body = content.mid(int(begin), int(end - begin + 1));
+        QByteArray headers = useRange ? "HTTP/1.1 206 Partial Content\r\n"
+                                      : "HTTP/1.1 200 OK\r\n";
+        if (useRange)
+            headers += "Content-Range: bytes " + QByteArray::number(begin) + '-'
+                       + QByteArray::number(end) + '/'
+                       + QByteArray::number(content.size()) + "\r\n";
+        headers += "Content-Type: application/octet-stream\r\n"
+                   "Content-Length: "
+                   + QByteArray::number(body.size())
+                   + "\r\nConnection: close\r\n\r\n";
+        socket->write(headers);
+        if (mode == FailFirstResponse && ranges.size() == 1) {
+            socket->write(body.left(body.size() / 2));
+            socket->disconnectFromHost();
+            return;
+        }
+        socket->write(body);
+        socket->disconnectFromHost();
+    }
+};
+
+class DownloadFileJobTest : public QObject {
+    Q_OBJECT
+private:
+    QByteArray content;
+    QScopedPointer<MediaServer> server;
+    QScopedPointer<ConnectionData> connectionData;
+    QTemporaryDir targetDir;
+    int mediaCounter = 0;
+
+    /// Download a new media id, wait for the result and check the file
+    void download(int parallelRanges = 1)
+    {
+        const auto mediaId = QStringLiteral("media%1").arg(++mediaCounter);
+        download(mediaId, parallelRanges);
+    }
+
+    void download(const QString& mediaId, int parallelRanges = 1)
+    {
+        const auto targetFileName = targetDir.filePath(mediaId);
+        QPointer<DownloadFileJob> job =
+            new DownloadFileJob("example.org", mediaId, targetFileName);
+        job->setParallelRanges(parallelRanges, 0);
+        auto finished = false;
+        auto result = BaseJob::Status(BaseJob::Pending);
+        connect(job, &BaseJob::finished, this, [&finished, &result, job] {
+            finished = true;
+            result = job->status();
+        });
+        job->initiate(connectionData.data(), false);
+        // Failed main requests are retried with a backoff of a few seconds
+        QTRY_VERIFY_WITH_TIMEOUT(finished, 20000);
+        QCOMPARE(result.code, int(BaseJob::Success));
+        QFile targetFile(targetFileName);
+        QVERIFY(targetFile.open(QIODevice::ReadOnly));
+        QCOMPARE(targetFile.size(), qint64(content.size()));
+        QVERIFY(targetFile.readAll() == content);
+    }
+
+private slots:
+    void initTestCase()
+    {
+        QStandardPaths::setTestModeEnabled(true);
+        QNetworkProxy::setApplicationProxy(QNetworkProxy::NoProxy);
+        QVERIFY(targetDir.isValid());
+        // Big enough for several ranges and for QNetworkReply to deliver
+        // the body in several chunks
+        content.reserve(512 * 1024);
+        for (int i = 0; content.size() < 512 * 1024; ++i)
+            content += QByteArray::number(i) + ' ';
+    }
+
+    void init()
+    {
+        MediaCache::instance().clear();
+        server.reset(new MediaServer(content));
+        QVERIFY(server->listen(QHostAddress::LocalHost));
+        connectionData.reset(new ConnectionData(
+            QUrl("http://127.0.0.1:" + QString::number(server->serverPort()))));
+        connectionData->setToken("test_token");
+    }
+
+    void cleanup()
+    {
+        connectionData.reset();
+        server.reset();
+    }
+
+    void wholeFile()
+    {
+        server->mode = MediaServer::IgnoreRanges;
+        download();
+        QCOMPARE(server->ranges.size(), 1);
+        QVERIFY(server->ranges.front().isEmpty());
+    }
+
+    void rangesIgnored()
+    {
+        // The first request asks for a range; a 200 response must be taken
+        // as the whole file
+        server->mode = MediaServer::IgnoreRanges;
+        download(4);
+        QCOMPARE(server->ranges.size(), 1);
+        QVERIFY(!server->ranges.front().isEmpty());
+    }
+
+    void parallelRanges()
+    {
+        server->mode = MediaServer::ServeRanges;
+        download(4);
+        QVERIFY(server->ranges.size() > 1);
+        for (const auto& range : qAsConst(server->ranges))
+            QVERIFY(range.startsWith("bytes="));
+    }
+
+    void resumeAfterFailure()
+    {
+        server->mode = MediaServer::FailFirstResponse;
+        download();
+        QVERIFY(server->ranges.size() >= 2);
+        // The retry asks for the rest of the file only
+        const auto& resumed = server->ranges.back();
+        QVERIFY(resumed.startsWith("bytes="));
+        QVERIFY(!resumed.startsWith("bytes=0-"));
+    }
+
+    void servedFromCache()
+    {
+        const auto mediaId = QStringLiteral("cached");
+        download(mediaId);
+        QTRY_VERIFY(!MediaCache::instance().find("example.org/" + mediaId)
+                         .isEmpty());
+        server->ranges.clear();
+        download(mediaId);
+        QVERIFY(server->ranges.isEmpty());
+    }
+};
+
+QTEST_GUILESS_MAIN(DownloadFileJobTest)
+#include "downloadfilejobtest.moc"
@@ -0,0 +1,206 @@
+#include "connectiondata.h"
+#include "retryscheduler.h"
+
+#include "jobs/basejob.h"
+
+#include <QtNetwork/QNetworkProxy>
+#include <QtNetwork/QTcpServer>
+#include <QtNetwork/QTcpSocket>
+#include <QtTest/QtTest>
+
+using namespace Quotient;
+using namespace std::chrono_literals;
+
+/// A homeserver that fails, holds or serves requests depending on the mode
+class FlakyServer : public QTcpServer {
+public:
+    enum Mode {
+        Failing, //< Respond with 503 to any request
+        Holding, //< Leave requests without a response
+        Serving, //< Respond with 200 and an empty JSON object
+    };
+
+    FlakyServer()
+    {
+        connect(this, &QTcpServer::newConnection, this, [this] {
+            while (auto* socket = nextPendingConnection()) {
+                connect(socket, &QTcpSocket::disconnected, socket,
+                        &QObject::deleteLater);
+                connect(socket, &QTcpSocket::readyRead, this,
+                        [this, socket] { readRequest(socket); });
+            }
+        });
+    }
+
+    Mode mode = Failing;
+    /// Requests left without a response in the Holding mode
+    QVector<QPointer<QTcpSocket>> held;
+
+    /// Serve the requests held so far and any further requests
+    void serveHeld()
+    {
+        mode = Serving;
+        for (const auto& socket : qAsConst(held))
+            if (socket)
+                respond(socket);
+        held.clear();
+    }
+
+private:
+    QHash<QTcpSocket*, QByteArray> buffers;
+
+    void readRequest(QTcpSocket* socket)
+    {
+        auto& buffer = buffers[socket];
+        buffer += socket->readAll();
+        if (!buffer.contains("\r\n\r\n"))
+            return;
+        buffers.remove(socket);
+        if (mode == Holding)
+            held.push_back(socket);
+        else
+            respond(socket);
+    }
+
+    void respond(QTcpSocket* socket)
+    {
+        const QByteArray body = mode == Serving ? "{}" : "";
+        socket->write((mode == Serving ? "HTTP/1.1 200 OK\r\n"
+                                       : "HTTP/1.1 503 Service Unavailable\r\n")
+                      + QByteArray("Content-Type: application/json\r\n"
+                                   "Content-Length: ")
+                      + QByteArray::number(body.size())
+                      + "\r\nConnection: close\r\n\r\n" + body);
+        socket->disconnectFromHost();
+    }
+};
+
+class RetrySchedulerTest : public QObject {
+    Q_OBJECT
+private:
+    QScopedPointer<FlakyServer> server;
+    QScopedPointer<ConnectionData> connectionData;
+
+private slots:
+    void initTestCase()
+    {
+        QNetworkProxy::setApplicationProxy(QNetworkProxy::NoProxy);
+    }
+
+    void init()
+    {
+        server.reset(new FlakyServer);
+        QVERIFY(server->listen(QHostAddress::LocalHost));
+        connectionData.reset(new ConnectionData(
+            QUrl("http://127.0.0.1:" + QString::number(server->serverPort()))));
+    }
+
+    void cleanup()
+    {
+        connectionData.reset();
+        server.reset();
+    }
+
+    void backoff()
+    {
+        QCOMPARE(RetryScheduler::backoff(1), 5000ms);
+        QCOMPARE(RetryScheduler::backoff(2), 10000ms);
+        QCOMPARE(RetryScheduler::backoff(3), 20000ms);
+        QCOMPARE(RetryScheduler::backoff(4), 40000ms);
+        // Capped from there on
+        QCOMPARE(RetryScheduler::backoff(5), 60000ms);
+        QCOMPARE(RetryScheduler::backoff(100), 60000ms);
+        // Out-of-range attempts are treated as the first one
+        QCOMPARE(RetryScheduler::backoff(0), 5000ms);
+        QCOMPARE(RetryScheduler::backoff(-1), 5000ms);
+    }
+
+    void jitter()
+    {
+        // Half of the backoff is fixed, the other half is random
+        QObject jobs;
+        RetryScheduler scheduler(connectionData.data());
+        for (auto attempt = 1; attempt <= 5; ++attempt) {
+            auto* job = new BaseJob(HttpVerb::Get, "JitterTest", "/", false);
+            job->setParent(&jobs);
+            const auto delay = scheduler.schedule(job, attempt);
+            const auto base = RetryScheduler::backoff(attempt);
+            QVERIFY(delay <= base);
+            // Allow for the time passed since scheduling
+            QVERIFY(delay >= base / 2 - 100ms);
+        }
+        auto* quickJob = new BaseJob(HttpVerb::Get, "JitterTest", "/", false);
+        quickJob->setParent(&jobs);
+        QVERIFY(scheduler.schedule(quickJob, 5, true) <= 1000ms);
+        QCOMPARE(scheduler.waitingJobs(), 6);
+    }
+
+    void budgetPostponement()
+    {
+        QObject jobs;
+        RetryScheduler scheduler(connectionData.data());
+        const auto scheduleNew = [&jobs, &scheduler](const QString& name) {
+            auto* job = new BaseJob(HttpVerb::Get, name, "/", false);
+            job->setParent(&jobs);
+            return scheduler.schedule(job, 1);
+        };
+        // A burst of 10 retries fits in the budget of an endpoint
+        for (auto i = 0; i < 10; ++i)
+            QVERIFY(scheduleNew("BudgetTest") <= RetryScheduler::backoff(1));
+        QCOMPARE(scheduler.metrics().retriesOverBudget, 0);
+
+        // Further retries wait for the budget to refill, at 6 s per retry
+        const auto overBudget = scheduleNew("BudgetTest");
+        QVERIFY(overBudget > 5900ms && overBudget <= 6000ms);
+        const auto furtherOverBudget = scheduleNew("BudgetTest");
+        QVERIFY(furtherOverBudget > 11900ms && furtherOverBudget <= 12000ms);
+        QCOMPARE(scheduler.metrics().retriesOverBudget, 2);
+
+        // Other endpoints have budgets of their own
+        QVERIFY(scheduleNew("OtherBudgetTest") <= RetryScheduler::backoff(1));
+        QCOMPARE(scheduler.metrics().retriesOverBudget, 2);
+        QCOMPARE(scheduler.waitingJobs(), 13);
+    }
+
+    void circuitBreaker()
+    {
+        auto* scheduler = connectionData->retryScheduler();
+        QVector<QPointer<BaseJob>> jobs;
+        auto succeeded = 0;
+        for (auto i = 0; i < 6; ++i) {
+            auto* job = new BaseJob(HttpVerb::Get, "BreakerTest", "/", false);
+            connect(job, &BaseJob::success, this,
+                    [&succeeded] { ++succeeded; });
+            jobs.push_back(job);
+            job->initiate(connectionData.data(), false);
+        }
+
+        // Opening: the failures of the first requests open the breaker, which
+        // holds all retries for longer than their own backoff
+        QTRY_COMPARE(scheduler->waitingJobs(), jobs.size());
+        QCOMPARE(scheduler->metrics().circuitOpenings, 1);
+        for (const auto& job : qAsConst(jobs))
+            QVERIFY(scheduler->timeToRetry(job) > RetryScheduler::backoff(1));
+
+        // Probing: after the cooldown, a single retry goes to the homeserver
+        // and the rest keep waiting while it runs
+        server->mode = FlakyServer::Holding;
+        QTRY_COMPARE_WITH_TIMEOUT(server->held.size(), 1, 15000);
+        QCOMPARE(scheduler->waitingJobs(), jobs.size() - 1);
+        QCOMPARE(scheduler->metrics().retriesTaken, 1);
+        QTest::qWait(1000);
+        QCOMPARE(server->held.size(), 1);
+        QCOMPARE(scheduler->waitingJobs(), jobs.size() - 1);
+
+        // Release: once the probe gets a response, the breaker closes and
+        // the held retries go out within a few seconds
+        server->serveHeld();
+        QTRY_COMPARE_WITH_TIMEOUT(succeeded, jobs.size(), 10000);
+        QCOMPARE(scheduler->waitingJobs(), 0);
+        QCOMPARE(scheduler->metrics().retriesTaken, jobs.size());
+        QCOMPARE(scheduler->metrics().circuitOpenings, 1);
+    }
+};
+
+QTEST_GUILESS_MAIN(RetrySchedulerTest)
+#include "retryschedulertest.moc"
@@ -0,0 +1,138 @@
+#include "connection.h"
+#include "room.h"
+#include "syncdata.h"
+
+#include <QtCore/QJsonArray>
+#include <QtTest/QtTest>
+
+using namespace Quotient;
+
+static const auto RoomId = QStringLiteral("!benchmark:example.org");
+static const auto SenderId = QStringLiteral("@sender:example.org");
+static constexpr auto TimelineSize = 100000;
+
+inline QString eventId(int n)
+{
+    return QStringLiteral("$event%1:example.org").arg(n);
+}
+
+inline QJsonObject messageEvent(const QString& id, const QString& body)
+{
+    return { { "type"_ls, "m.room.message"_ls },
+             { "event_id"_ls, id },
+             { "sender"_ls, SenderId },
+             { "origin_server_ts"_ls, Q_INT64_C(1600000000000) },
+             { "content"_ls,
+               QJsonObject { { "msgtype"_ls, "m.text"_ls },
+                             { "body"_ls, body } } } };
+}
+
+/// Measures the timeline bookkeeping on a room with 100k notable events
+/**
+ * The room is filled through the regular sync path, so loading it covers
+ * unread counting and the notable totals; redactions and edits in the
+ * middle of the timeline go through updateNotableTotals().
+ */
+class TimelineBenchmark : public QObject {
+    Q_OBJECT
+private:
+    QScopedPointer<Connection> connection;
+    Room* room = nullptr;
+    int batchCounter = 0;
+    int editedCounter = 0;
+
+    /// Feed the events to the room as a single non-limited sync batch
+    void sync(const QJsonArray& events)
+    {
+        const QJsonObject roomJson {
+            { "timeline"_ls,
+              QJsonObject { { "events"_ls, events },
+                            { "limited"_ls, false } } }
+        };
+        SyncData data;
+        const auto nextBatch = QStringLiteral("batch%1").arg(++batchCounter);
+        data.parseJson(
+            { { "next_batch"_ls, nextBatch },
+              { "rooms"_ls,
+                QJsonObject {
+                    { "join"_ls, QJsonObject { { RoomId, roomJson } } } } } });
+        connection->onSyncSuccess(std::move(data));
+    }
+
+    /// The id of the next event in the middle of the timeline to change
+    QString nextEditedId()
+    {
+        return eventId(TimelineSize / 2 + editedCounter++);
+    }
+
+private slots:
+    void initTestCase()
+    {
+        // Nothing listens there; the capabilities request simply fails
+        connection.reset(new Connection(QUrl("http://127.0.0.1:1")));
+        connection->setCacheState(false);
+        connection->assumeIdentity("@local:example.org", "token", "DEVICE");
+        QVERIFY(connection->user());
+    }
+
+    void cleanupTestCase() { connection.reset(); }
+
+    void loadTimeline()
+    {
+        QJsonArray events;
+        for (auto i = 0; i < TimelineSize; ++i)
+            events.append(messageEvent(eventId(i), QString::number(i)));
+        QBENCHMARK_ONCE { sync(events); }
+        room = connection->room(RoomId);
+        QVERIFY(room);
+        QCOMPARE(room->timelineSize(), TimelineSize);
+        QCOMPARE(room->unreadCount(), TimelineSize);
+    }
+
+    void redactInTheMiddle()
+    {
+        QVERIFY(room);
+        QString redactedId;
+        QBENCHMARK {
+            redactedId = nextEditedId();
+            sync({ QJsonObject {
+                { "type"_ls, "m.room.redaction"_ls },
+                { "event_id"_ls, QStringLiteral("$redaction%1:example.org")
+                                     .arg(editedCounter) },
+                { "sender"_ls, SenderId },
+                { "origin_server_ts"_ls, Q_INT64_C(1600000000000) },
+                { "redacts"_ls, redactedId },
+                { "content"_ls, QJsonObject() } } });
+        }
+        const auto it = room->findInTimeline(redactedId);
+        QVERIFY(it != room->historyEdge());
+        QVERIFY((*it)->isRedacted());
+    }
+
+    void editInTheMiddle()
+    {
+        QVERIFY(room);
+        QString editedId;
+        QBENCHMARK {
+            editedId = nextEditedId();
+            auto edit = messageEvent(QStringLiteral("$edit%1:example.org")
+                                         .arg(editedCounter),
+                                     "* edited"_ls);
+            auto content = edit.value("content"_ls).toObject();
+            content.insert("m.new_content"_ls,
+                           QJsonObject { { "msgtype"_ls, "m.text"_ls },
+                                         { "body"_ls, "edited"_ls } });
+            content.insert("m.relates_to"_ls,
+                           QJsonObject { { "rel_type"_ls, "m.replace"_ls },
+                                         { "event_id"_ls, editedId } });
+            edit.insert("content"_ls, content);
+            sync({ edit });
+        }
+        const auto it = room->findInTimeline(editedId);
+        QVERIFY(it != room->historyEdge());
+        QVERIFY(!(*it)->replacedBy().isEmpty());
+    }
+};
+
+QTEST_GUILESS_MAIN(TimelineBenchmark)
+#include "timelinebenchmark.moc"